@@ -1,5 +1,12 @@
 #include "migi.h"
 #include "file.h"
+#include "migi_thread.h"
+#include "random.h"
+#include "timing.h"
+#include "profiler.h"
+#include "repetition_tester.h"
+#include "hashmap.h"
+#include "process.h"
 
 void test_arena_functions() {
     typedef struct {
@@ -105,7 +112,11 @@ void test_arena_functions() {
         size_t prev_committed = a->committed;
         arena_pop(a, char, 10*KB);
         assert(a->current == c && a->current->position - sizeof(Arena) == (1023*KB + 1*KB) - 10*KB);
+#ifndef ARENA_LAZY_DECOMMIT
         assert(a->current->committed < prev_committed);
+#else
+        assert(a->current->committed == prev_committed);
+#endif
     }
 
     // checkpoint save and rewind
@@ -119,11 +130,15 @@ void test_arena_functions() {
         arena_push(a, char, 1*KB);
         arena_rewind(tmp);
         assert(a->current->position == sizeof(Arena) + 1*KB);
+#ifndef ARENA_LAZY_DECOMMIT
         assert(a->current->committed == 4*KB);
+#endif
 
         arena_pop(a, char, 10*KB);
         assert(a->current->position == sizeof(Arena) + 1*KB);
+#ifndef ARENA_LAZY_DECOMMIT
         assert(a->committed == 4*KB);
+#endif
     }
 
     // realloc
@@ -174,14 +189,1015 @@ void test_arena_temp() {
 
     assertf(str_eq(foo, S("hello world 123 4.510000, testing!!!\n")), "data is not overwritten");
     arena_temp_release(tmp);
+
+    // more arenas are created when all the existing ones conflict
+    arena_temp_free();
+    arena_temp_set_options(.reserve_size = 8*MB);
+    Temp temps[ARENA_TEMP_MAX_COUNT] = {0};
+    for (size_t i = 0; i < ARENA_TEMP_MAX_COUNT; i++) {
+        temps[i] = arena_temp_excluding((Arena **)MIGI_GLOBAL_TEMP_ARENAS, i);
+        assert(temps[i].arena == MIGI_GLOBAL_TEMP_ARENAS[i]);
+        assert(temps[i].arena->reserved == 8*MB);
+        arena_push(temps[i].arena, byte, (i + 1)*KB);
+    }
+    Temp none = arena_temp_excluding((Arena **)MIGI_GLOBAL_TEMP_ARENAS, ARENA_TEMP_MAX_COUNT);
+    assert(none.arena == NULL && MIGI_ARENA_TEMP_EXHAUSTED == 1);
+    for (size_t i = ARENA_TEMP_MAX_COUNT; i > 0; i--) {
+        arena_temp_release(temps[i - 1]);
+    }
+
+    // the high-water marks are kept after releasing
+    for (size_t i = 0; i < ARENA_TEMP_MAX_COUNT; i++) {
+        assert(MIGI_ARENA_TEMP_HIGH_WATER[i] >= (i + 1)*KB);
+        assert(MIGI_GLOBAL_TEMP_ARENAS[i]->position == sizeof(Arena));
+    }
+    arena_temp_set_options();
+    arena_temp_free();
+    assert(MIGI_GLOBAL_TEMP_ARENAS[0] == NULL && MIGI_ARENA_TEMP_HIGH_WATER[0] == 0);
+}
+
+// A push which only partly reaches into newly committed memory must still clear the
+// part which was committed before, since it may have been used already
+void test_arena_partial_commit() {
+    Arena *a = arena_init(.commit_size = 64*KB);
+    byte *mem = arena_push(a, byte, 60*KB, .zeroed=false);
+    memset(mem, 0xff, 60*KB);
+    arena_reset(a);
+
+    size_t committed = a->committed;
+    mem = arena_push(a, byte, 100*KB);
+    assert(a->committed > committed);
+    for (size_t i = 0; i < 100*KB; i++) assert(mem[i] == 0);
+    arena_free(a);
+}
+
+void test_arena_keep_committed() {
+    Arena *a = arena_init(.commit_size = 64*KB, .keep_committed = 1*MB);
+    assert(a->keep_committed_kb == 1*KB);
+
+    Temp tmp = arena_save(a);
+    byte *mem = arena_push(a, byte, 2*MB, .zeroed=false);
+    memset(mem, 0xff, 2*MB);
+    size_t committed = a->committed;
+    assert(committed >= 2*MB);
+    arena_rewind(tmp);
+#ifndef ARENA_LAZY_DECOMMIT
+    // only the part past the threshold is decommitted
+    assert(a->committed == 1*MB);
+#else
+    assert(a->committed == committed);
+#endif
+
+    // the memory which stayed committed is dirty, so it is still cleared
+    mem = arena_push(a, byte, 2*MB);
+    for (size_t i = 0; i < 2*MB; i++) assert(mem[i] == 0);
+
+    // below the threshold nothing is decommitted
+    arena_pop(a, byte, 2*MB - 4*KB);
+#ifndef ARENA_LAZY_DECOMMIT
+    assert(a->committed == 1*MB);
+#endif
+    arena_free(a);
+
+    // the threshold is rounded up to the commit size, and passed on to new blocks of chained arenas
+    a = arena_init(.type = Arena_Chained, .commit_size = 64*KB, .reserve_size = 256*KB, .keep_committed = 1);
+    assert(a->keep_committed_kb == 64);
+    arena_push(a, byte, 200*KB);
+    arena_push(a, byte, 200*KB);
+    assert(a->current != a && a->current->keep_committed_kb == 64);
+    arena_free(a);
+
+    Temp t = arena_temp();
+    assert(t.arena->keep_committed_kb == ARENA_TEMP_KEEP_COMMITTED / KB);
+    arena_temp_release(t);
+}
+
+void test_arena_huge_pages() {
+    Arena *a = arena_init(.reserve_size = 7*MB, .commit_size = 64*KB, .huge_pages = Arena_HugePages);
+#ifndef ARENA_USE_MALLOC
+    // everything is rounded up to whole huge pages
+    assert(a->commit_size == MEMORY_HUGE_PAGE_SIZE && a->reserved == 8*MB);
+    assert((uintptr_t)a % MEMORY_HUGE_PAGE_SIZE == 0);
+#endif
+    byte *mem = arena_push(a, byte, 3*MB);
+    memset(mem, 1, 3*MB);
+#ifndef ARENA_USE_MALLOC
+    assert(a->committed == 4*MB);
+#endif
+    arena_free(a);
+
+    // there are most likely no preallocated huge pages, which must fall back to transparent ones
+    a = arena_init(.reserve_size = 4*MB, .huge_pages = Arena_HugePagesExplicit);
+    mem = arena_push(a, byte, 3*MB);
+    memset(mem, 1, 3*MB);
+    arena_free(a);
+
+    // new blocks get the same kind of pages
+    a = arena_init(.type = Arena_Chained, .huge_pages = Arena_HugePages, .populate = true);
+    arena_push(a, byte, 3*MB);
+    arena_push(a, byte, 3*MB);
+    assert(a->current != a && a->current->huge_pages == Arena_HugePages && a->current->populate);
+    arena_free(a);
+
+#ifndef ARENA_USE_MALLOC
+    // populated memory is committed and zeroed like any other fresh memory
+    // NOTE: whether it page faults when first accessed isn't checked, since that
+    // depends on the kernel, transparent huge pages and sanitizers
+    a = arena_init(.commit_size = 4*MB, .populate = true);
+    assert(a->committed == 4*MB);
+    mem = arena_push(a, byte, 3*MB, .zeroed=false);
+    for (size_t i = 0; i < 3*MB; i++) assert(mem[i] == 0);
+    memset(mem, 1, 3*MB);
+    arena_free(a);
+#endif
+}
+
+void test_arena_stats() {
+    Arena *a = arena_init(.type = Arena_Chained, .commit_size = 64*KB);
+    arena_push(a, byte, 1);
+    arena_push(a, uint64_t, 1);
+    int loop_line = __LINE__ + 2;
+    for (size_t i = 0; i < 100; i++) {
+        arena_push(a, byte, 8*KB);
+    }
+    int *x = arena_push(a, int, 4);
+    x = arena_realloc(a, int, x, 4, 8);
+    unused(x);
+    unused(loop_line);
+
+#ifdef ARENA_STATS
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    ArenaStats stats = *arena__stats_find(a);
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+
+    // extending in place adds bytes, but isn't another allocation
+    assert(stats.allocations == 103);
+    assert(stats.bytes == 1 + 8 + 100*8*KB + 8*sizeof(int));
+    assert(stats.alignment_waste >= 7);
+    assert(stats.blocks > 1 && stats.blocks == stats.peak_blocks);
+    assert(stats.peak >= stats.bytes);
+    assert(stats.commits >= 1 && stats.decommits == 0);
+
+    bool found = false;
+    for (size_t i = 0; i < ARENA_STATS_MAX_CALLSITES; i++) {
+        ArenaCallsite site = stats.callsites[i];
+        if (site.file && strcmp(site.file, __FILE__) == 0 && site.line == loop_line) {
+            assert(site.bytes == 100*8*KB && site.count == 100);
+            found = true;
+        }
+    }
+    assert(found);
+    arena_print_stats(a);
+
+    // the peak stays, but the blocks are gone
+    arena_reset(a);
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    stats = *arena__stats_find(a);
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+    assert(stats.blocks == 1 && stats.peak_blocks > 1 && stats.peak >= 100*8*KB);
+
+    Arena *freed = a;
+    arena_free(a);
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    assert(arena__stats_find(freed) == NULL);
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+#else
+    arena_free(a);
+#endif
+}
+
+void test_arena_chained_blocks() {
+    arena_release_free_blocks();
+    Arena *a = arena_init(.type = Arena_Chained);
+    assert(a->reserved == ARENA_CHAINED_FIRST_BLOCK_SIZE);
+
+    // each block is twice as large as the previous one
+    size_t blocks = 1;
+    for (size_t i = 0; i < 1000; i++) {
+        Arena *prev = a->current;
+        arena_push(a, char, 1*KB, .zeroed=false);
+        if (a->current != prev) {
+            assert(a->current->reserved == 2*prev->reserved);
+            blocks++;
+        }
+    }
+    assert(blocks == 5);
+
+    // a single allocation can still be larger than the next block
+    Temp tmp = arena_save(a);
+    byte *big = arena_push(a, byte, 3*MB);
+    assert(a->current->reserved >= 3*MB + sizeof(Arena));
+    Arena *big_block = a->current;
+    memset(big, 0xab, 3*MB);
+
+    arena_rewind(tmp);
+    big = arena_push(a, byte, 3*MB);
+    for (size_t i = 0; i < 3*MB; i++) assert(big[i] == 0);
+#if ARENA_MAX_FREE_BLOCKS >= 2
+    // released blocks are reused, and their memory is cleared again
+    assert(a->current == big_block && MIGI_ARENA_FREE_BLOCKS_COUNT == 0);
+
+    // freeing the arena keeps all of its blocks, up to the limit
+    arena_free(a);
+    size_t kept = min_of(blocks + 1, (size_t)ARENA_MAX_FREE_BLOCKS);
+    assert(MIGI_ARENA_FREE_BLOCKS_COUNT == kept);
+
+    // the kept blocks are decommitted down to their first chunk
+    size_t free_bytes = 0;
+    for (Arena *block = MIGI_ARENA_FREE_BLOCKS; block; block = block->prev) {
+#ifndef ARENA_LAZY_DECOMMIT
+        assert(block->committed <= max_of(block->commit_size, (size_t)block->keep_committed_kb * KB));
+#endif
+        free_bytes += block->committed;
+    }
+    assert(free_bytes == MIGI_ARENA_FREE_BLOCKS_BYTES && free_bytes <= ARENA_MAX_FREE_BYTES);
+    Arena *b = arena_init(.type = Arena_Chained);
+    assert(MIGI_ARENA_FREE_BLOCKS_COUNT == kept - 1);
+    arena_free(b);
+#else
+    unused(big_block);
+    arena_free(a);
+#endif
+
+    // blocks which would go over the byte limit are released instead of being kept
+    Arena *huge = arena_init(.type = Arena_Chained);
+    arena_push(huge, byte, ARENA_MAX_FREE_BYTES, .zeroed=false);
+    size_t count = MIGI_ARENA_FREE_BLOCKS_COUNT;
+    arena_free(huge);
+    assert(MIGI_ARENA_FREE_BLOCKS_COUNT <= count + 1 && MIGI_ARENA_FREE_BLOCKS_BYTES <= ARENA_MAX_FREE_BYTES);
+
+    arena_release_free_blocks();
+    assert(MIGI_ARENA_FREE_BLOCKS == NULL && MIGI_ARENA_FREE_BLOCKS_COUNT == 0);
+    assert(MIGI_ARENA_FREE_BLOCKS_BYTES == 0);
+}
+
+#if OS_LINUX && !defined(ARENA_USE_MALLOC) && ARENA_MAX_FREE_BLOCKS > 0
+#include <sys/mman.h>
+
+static void free_blocks_thread(void *arg) {
+    Arena *a = arena_init(.type = Arena_Chained);
+    for (size_t i = 0; i < 100; i++) arena_push(a, char, 1*KB, .zeroed=false);
+    arena_free(a);
+    assert(MIGI_ARENA_FREE_BLOCKS != NULL);
+    *(Arena **)arg = MIGI_ARENA_FREE_BLOCKS;
+}
+
+// The blocks kept by a thread are released when it exits
+void test_arena_free_blocks_thread_exit() {
+    Arena *block = NULL;
+    thread_join(thread_spawn(free_blocks_thread, &block));
+    // msync fails with ENOMEM if the memory isn't mapped anymore
+    assert(block && msync(block, memory_page_size(), MS_ASYNC) == -1 && errno == ENOMEM);
+}
+#endif
+
+#ifdef ARENA_HAS_FILES
+// A string keyed open addressing table which only refers to its contents with relative pointers,
+// so that it can be stored in a file arena and used again straight away after reopening it
+typedef struct {
+    RelStr key;         // data is NULL for empty slots
+    uint64_t value;
+} IndexSlot;
+
+typedef struct {
+    RelPtr(IndexSlot) slots;
+    size_t capacity;
+    size_t count;
+} Index;
+
+static Index *index_create(Arena *a, size_t capacity) {
+    Index *index = arena_new(a, Index);
+    relptr_set(&index->slots, arena_push(a, IndexSlot, capacity));
+    index->capacity = capacity;
+    return index;
+}
+
+static IndexSlot *index_slot(Index *index, Str key) {
+    IndexSlot *slots = relptr_get(&index->slots);
+    for (size_t i = str_hash(key) & (index->capacity - 1);; i = (i + 1) & (index->capacity - 1)) {
+        if (!relptr_get(&slots[i].key.data) || str_eq(relstr_get(&slots[i].key), key)) return &slots[i];
+    }
+}
+
+static void index_put(Arena *a, Index *index, Str key, uint64_t value) {
+    assert(2*(index->count + 1) <= index->capacity);
+    IndexSlot *slot = index_slot(index, key);
+    if (!relptr_get(&slot->key.data)) {
+        relstr_set(&slot->key, str_from(arena_copy(a, char, key.data, key.length), key.length));
+        index->count++;
+    }
+    slot->value = value;
+}
+
+static uint64_t index_get(Index *index, Str key) {
+    IndexSlot *slot = index_slot(index, key);
+    return relptr_get(&slot->key.data)? slot->value: 0;
+}
+
+void test_arena_file() {
+    Str path = S("build/test_arena_file.bin");
+    remove("build/test_arena_file.bin");
+
+    Arena *a = arena_open_file(path, .commit_size = 64*KB, .reserve_size = 16*MB);
+    assert(a && a->type == Arena_File && a->committed == 64*KB);
+    // the first allocation is the root of everything else
+    Index *index = index_create(a, 1 << 14);
+    assert((byte *)index == a->data);
+    Temp keys = arena_temp();
+    size_t count = 5000;
+    for (size_t i = 0; i < count; i++) {
+        index_put(a, index, strf(keys.arena, "key_%zu", i), i + 1);
+    }
+    size_t committed = a->committed;
+    size_t position = a->position;
+    assert(committed > 64*KB);
+    arena_flush(a);
+    arena_free(a);
+
+    // reopening maps the same contents at a (most likely) different address
+    a = arena_open_file(path, .commit_size = 64*KB, .reserve_size = 1*MB);
+    assert(a && a->committed == committed && a->position == position);
+    assert(a->reserved >= committed);
+    index = (Index *)a->data;
+    assert(index->count == count);
+    for (size_t i = 0; i < count; i++) {
+        assert(index_get(index, strf(keys.arena, "key_%zu", i)) == i + 1);
+    }
+    assert(index_get(index, S("key_5000")) == 0);
+    arena_temp_release(keys);
+
+    // changes are kept even without flushing, as long as the OS is still running
+    index_put(a, index, S("extra"), 42);
+    arena_free(a);
+    a = arena_open_file(path);
+    index = (Index *)a->data;
+    assert(index->count == count + 1 && index_get(index, S("extra")) == 42);
+    arena_free(a);
+
+    // files which aren't file arenas, or were cut short, are rejected
+    Arena *tmp = arena_init();
+    Str contents = str_from_file(tmp, path);
+    assert(str_to_file(str_take(contents, contents.length - 1), path));
+    assert(arena_open_file(path) == NULL);
+    assert(str_to_file(S("not an arena, but long enough to be mistaken for one if only the length was checked......"), path));
+    assert(arena_open_file(path) == NULL);
+    arena_free(tmp);
+    remove("build/test_arena_file.bin");
+
+    // relative pointers stay valid after copying both the pointer and its target
+    struct { RelPtr(int) ptr; int value; } a1 = {0}, a2 = {0};
+    assert(relptr_get(&a1.ptr) == NULL);
+    a1.value = 7;
+    relptr_set(&a1.ptr, &a1.value);
+    a2 = a1;
+    assert(relptr_get(&a2.ptr) == &a2.value && *relptr_get(&a2.ptr) == 7);
+    relptr_set(&a2.ptr, NULL);
+    assert(relptr_get(&a2.ptr) == NULL);
+}
+
+typedef struct {
+    StrList names;      // pushed by the parent
+    Str reply;          // pushed by the child
+    byte *blob;
+} SharedMessage;
+
+// Runs in the child process started by test_arena_shared_memory
+static int shared_memory_child(int file) {
+    Arena *a = arena_open_shared(file);
+    if (!a) return 1;
+    SharedMessage *msg = (SharedMessage *)a->data;
+
+    // the list was built by the parent, with plain pointers
+    size_t i = 0;
+    strlist_foreach(&msg->names, node) {
+        if (!str_eq(node->string, strf(arena_temp().arena, "name_%zu", i))) return 2;
+        i++;
+    }
+    if (i != 1000) return 3;
+
+    msg->reply = str_copy(a, S("hello from the child"));
+    // enough to grow the file
+    msg->blob = arena_push(a, byte, 1*MB);
+    memset(msg->blob, 7, 1*MB);
+    arena_free(a);
+    return 0;
+}
+
+void test_arena_shared_memory() {
+    Arena *a = arena_init_shared_memory(.commit_size = 64*KB);
+    SharedMessage *msg = arena_new(a, SharedMessage);
+    for (size_t i = 0; i < 1000; i++) {
+        strlist_push(a, &msg->names, strf(a, "name_%zu", i));
+    }
+    size_t committed = a->committed;
+
+    Cmd cmd = {0};
+    cmd_push_many(&cmd, S("/proc/self/exe"), S("shared-memory-child"));
+    cmd_push_arena(&cmd, a);
+    CmdResult res = cmd_run(&cmd, .no_log_cmd = true);
+    assert(cmd_ok(res));
+
+    // everything the child pushed is in the same arena
+    assert(a->committed > committed && a->committed >= 1*MB);
+    assert(str_eq(msg->reply, S("hello from the child")));
+    for (size_t i = 0; i < 1*MB; i++) assert(msg->blob[i] == 7);
+    byte *mem = arena_push(a, byte, 16);
+    assert(mem >= msg->blob + 1*MB);
+
+    // it can't be mapped at the same address twice
+    assert(arena_open_shared(a->file) == NULL);
+    cmd_free(&cmd);
+    arena_free(a);
+}
+#endif
+
+void test_arena_static_spill() {
+    byte buffer[1*KB];
+    Arena *a = arena_init_static_spill(buffer, sizeof(buffer));
+    char *small = arena_push(a, char, 100);
+    memset(small, 'a', 100);
+    assert(a->current == a);
+
+    // doesn't fit in the buffer anymore
+    Temp tmp = arena_save(a);
+    char *big = arena_push(a, char, 10*KB);
+    memset(big, 'b', 10*KB);
+    assert(a->current != a && a->current->prev == a && a->current->type == Arena_Chained);
+    assert(a->current->reserved >= ARENA_CHAINED_FIRST_BLOCK_SIZE);
+    for (size_t i = 0; i < 1000; i++) arena_push(a, char, 1*KB);
+    assert(a->current->prev != a);
+
+    // rewinding into the buffer releases all the blocks
+    arena_rewind(tmp);
+    assert(a->current == a && a->position == tmp.position);
+    for (size_t i = 0; i < 100; i++) assert(small[i] == 'a');
+    char *next = arena_push(a, char, 100);
+    assert(next >= small + 100 && next + 100 <= (char *)buffer + sizeof(buffer));
+
+    // and so does popping
+    arena_push(a, char, 2*KB);
+    assert(a->current != a);
+    arena_pop(a, char, 2*KB);
+    assert(a->current == a);
+
+    // freeing only releases the blocks, the buffer belongs to the caller
+    arena_push(a, char, 4*KB);
+    arena_free(a);
+    arena_release_free_blocks();
+    for (size_t i = 0; i < sizeof(buffer); i++) assert(buffer[i] == 0);
+
+    // without spilling, the buffer is all there is
+    Arena *b = arena_init_static(buffer, sizeof(buffer));
+    assert(!b->spill);
+    arena_push(b, char, sizeof(buffer) - sizeof(Arena));
+    assert(b->position == b->reserved);
+    arena_free(b);
+}
+
+typedef struct {
+    Arena *arena;
+    size_t count;
+    uint64_t seed;
+    byte **allocations;
+    size_t *sizes;
+} SharedArenaThread;
+
+static void shared_arena_thread(void *arg) {
+    SharedArenaThread *t = arg;
+    uint64_t state = t->seed;
+    size_t alignments[] = {1, 8, 16, 64, 4*KB};
+    for (size_t i = 0; i < t->count; i++) {
+        state = hash_u64(state);
+        size_t size = 1 + state % 200;
+        size_t align = alignments[(state >> 32) % array_len(alignments)];
+        byte *mem = arena_push_bytes(t->arena, size, align);
+        // the offset is aligned, which is also the address unless the arena uses malloc
+        assert(((uintptr_t)(mem - (byte *)t->arena) & (align - 1)) == 0);
+        for (size_t j = 0; j < size; j++) assert(mem[j] == 0);
+        memset(mem, (int)t->seed, size);
+        t->allocations[i] = mem;
+        t->sizes[i] = size;
+    }
+}
+
+// Threads pushing onto a shared arena at the same time must never get overlapping memory
+void test_arena_shared() {
+    Arena *scratch = arena_init();
+    // a small commit size, so that the threads keep racing to commit more memory
+    Arena *a = arena_init(.type = Arena_Shared, .commit_size = 64*KB, .reserve_size = 1*GB);
+
+    for (int round = 0; round < 2; round++) {
+        Temp tmp = arena_save(a);
+        SharedArenaThread threads[4] = {0};
+        Thread handles[array_len(threads)] = {0};
+        for (size_t i = 0; i < array_len(threads); i++) {
+            threads[i] = (SharedArenaThread){
+                .arena = a, .count = 20000, .seed = i + 1,
+                .allocations = arena_push(scratch, byte *, 20000),
+                .sizes = arena_push(scratch, size_t, 20000),
+            };
+            handles[i] = thread_spawn(shared_arena_thread, &threads[i]);
+        }
+        for (size_t i = 0; i < array_len(threads); i++) {
+            thread_join(handles[i]);
+        }
+
+        for (size_t i = 0; i < array_len(threads); i++) {
+            SharedArenaThread *t = &threads[i];
+            for (size_t n = 0; n < t->count; n++) {
+                assert((byte *)t->allocations[n] >= (byte *)a + tmp.position);
+                assert((byte *)t->allocations[n] + t->sizes[n] <= (byte *)a + a->position);
+                for (size_t j = 0; j < t->sizes[n]; j++) assert(t->allocations[n][j] == (byte)t->seed);
+            }
+        }
+        // the second round reuses the rewound memory, which must be cleared again
+        arena_rewind(tmp);
+        arena_reset(scratch);
+    }
+
+    // allocations are never extended in place
+    int *numbers = arena_push(a, int, 3);
+    int *more = arena_realloc(a, int, numbers, 3, 6);
+    assert(more != numbers);
+
+    arena_free(a);
+    arena_free(scratch);
+}
+
+
+typedef struct {
+    Arena *arena;
+    SpinLock *lock;
+    size_t count;
+    size_t size;
+} ArenaRateThread;
+
+static void arena_rate_thread_shared(void *arg) {
+    ArenaRateThread *t = arg;
+    for (size_t i = 0; i < t->count; i++) {
+        *(volatile byte *)arena_push_bytes(t->arena, t->size, 8, .zeroed=false) = 1;
+    }
+}
+
+static void arena_rate_thread_locked(void *arg) {
+    ArenaRateThread *t = arg;
+    for (size_t i = 0; i < t->count; i++) {
+        spinlock_lock(t->lock);
+        byte *mem = arena_push_bytes(t->arena, t->size, 8, .zeroed=false);
+        spinlock_unlock(t->lock);
+        *(volatile byte *)mem = 1;
+    }
+}
+
+// Throughput of a chained arena which is rewound (or freed) after every "request", each
+// of which pushes enough to need a few blocks, build with ENABLE_PROFILING to get the
+// number of calls to memory_reserve, memory_commit, memory_decommit and memory_release
+// Compare with ARENA_MAX_FREE_BLOCKS defined as 0 to see the cost without reusing blocks
+void profile_arena_chained_rewind() {
+    size_t iterations = 20000;
+    size_t sizes[] = {64, 256, 1*KB, 16*KB};
+    printf("max free blocks: %d\n", ARENA_MAX_FREE_BLOCKS);
+    printf("mode,requests/s,MB pushed/s\n");
+    for (int mode = 0; mode < 2; mode++) {
+        Arena *a = arena_init(.type = Arena_Chained);
+        size_t pushed = 0;
+        begin_profiling();
+        uint64_t start = timer_now();
+        for (size_t i = 0; i < iterations; i++) {
+            Temp tmp = {0};
+            if (mode == 0) tmp = arena_save(a);
+            else a = arena_init(.type = Arena_Chained);
+
+            // about 1 MB per request
+            for (size_t j = 0; j < 256; j++) {
+                size_t size = sizes[(i + j) % array_len(sizes)];
+                *(volatile byte *)arena_push(a, byte, size, .zeroed=false) = 1;
+                pushed += size;
+            }
+
+            if (mode == 0) arena_rewind(tmp);
+            else arena_free(a);
+        }
+        uint64_t elapsed = timer_now() - start;
+        printf("%s,%.0f,%.0f\n", mode == 0? "rewind": "init/free",
+               (double)iterations / ((double)elapsed / NS), (double)pushed / MB / ((double)elapsed / NS));
+        end_profiling_and_print_stats();
+        if (mode == 0) arena_free(a);
+    }
+    arena_release_free_blocks();
+}
+
+// A loop which saves, pushes (and writes to) 2 MB and rewinds, either decommitting everything
+// on every rewind, or keeping the memory committed with `.keep_committed`
+// Build with ARENA_LAZY_DECOMMIT to compare with decommitting the memory lazily instead
+void profile_arena_rewind_page_faults() {
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+    size_t size = 2*MB;
+#ifdef ARENA_LAZY_DECOMMIT
+    printf("lazy decommit: yes\n");
+#else
+    printf("lazy decommit: no\n");
+#endif
+    printf("keep committed (MB),time per iteration (us),page faults per iteration\n");
+    size_t keep_sizes[] = {0, 4*MB};
+    for (size_t k = 0; k < array_len(keep_sizes); k++) {
+        Arena *a = arena_init(.keep_committed = keep_sizes[k]);
+        Tester t = tester_init_with_name("rewind", 2, cpu_freq, size);
+        while (!t.finished) {
+            tester_begin(&t);
+            Temp tmp = arena_save(a);
+            byte *mem = arena_push(a, byte, size, .zeroed=false);
+            for (size_t i = 0; i < size; i += 4*KB) mem[i] = 1;
+            arena_rewind(tmp);
+            tester_end(&t);
+        }
+        printf("%zu,%.1f,%.1f\n", keep_sizes[k] / (size_t)MB,
+               (double)t.stats[StatsTime].min / (double)cpu_freq * 1e6,
+               (double)t.stats[StatsPageFault].total / (double)t.count);
+        arena_free(a);
+    }
+}
+
+// Random reads over a 4 GB arena, with and without huge pages, along with the time taken
+// to commit and fault in all of the memory upfront (with `.populate`)
+// NOTE: Arena_HugePagesExplicit needs huge pages to be preallocated first, eg.
+// `echo 2048 > /proc/sys/vm/nr_hugepages`, otherwise it is the same as Arena_HugePages
+void profile_arena_huge_pages() {
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+    size_t size = 4*GB;
+    size_t count = size / sizeof(uint64_t);
+    size_t reads = 1 << 24;
+    char *names[] = {"none", "transparent", "explicit"};
+
+    printf("huge pages,populate (ms),random read (ns),page faults per read\n");
+    for (int huge_pages = 0; huge_pages < (int)array_len(names); huge_pages++) {
+        uint64_t start = timer_now();
+        Arena *a = arena_init(.reserve_size = size + 2*MB, .commit_size = size + 2*MB,
+                              .huge_pages = huge_pages, .populate = true);
+        uint64_t populate = timer_now() - start;
+        uint64_t *values = arena_push(a, uint64_t, count, .zeroed=false);
+
+        Tester t = tester_init_with_name(names[huge_pages], 2, cpu_freq, reads);
+        volatile uint64_t sink = 0;
+        while (!t.finished) {
+            tester_begin(&t);
+            uint64_t state = 1, sum = 0;
+            for (size_t i = 0; i < reads; i++) {
+                state = hash_u64(state);
+                sum += values[state % count];
+            }
+            sink += sum;
+            tester_end(&t);
+        }
+        printf("%s,%.1f,%.1f,%.3f\n", names[huge_pages], (double)populate / 1e6,
+               (double)t.stats[StatsTime].min / (double)cpu_freq * 1e9 / (double)reads,
+               (double)t.stats[StatsPageFault].total / (double)t.count / (double)reads);
+        arena_free(a);
+    }
+}
+
+#ifdef ARENA_HAS_FILES
+static double min_seconds(Tester *t) {
+    return (double)t->stats[StatsTime].min / (double)t->cpu_freq;
+}
+
+// Time to get a usable string keyed index, by building a HashMap from the keys
+// (what has to be done on every launch without a file arena), or by reopening an index
+// stored in a file arena, and the time taken by lookups in each (which includes the page
+// faults of the first access to the mapped file, but not reading it from the disk)
+void profile_arena_file() {
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+    size_t counts[] = {100000, 1000000, 10000000};
+    Str path = S("build/profile_arena_file.bin");
+    size_t lookups = 1000000;
+
+    printf("keys,file size (MB),rebuild (ms),reopen (ms),rebuilt lookup (ns),reopened lookup (ns)\n");
+    for (size_t c = 0; c < array_len(counts); c++) {
+        size_t count = counts[c];
+        Arena *keys_arena = arena_init(.reserve_size = 4*GB);
+        Str *keys = arena_push(keys_arena, Str, count);
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = strf(keys_arena, "host-%zx.example.com", (size_t)rand_random());
+        }
+        size_t *order = arena_push(keys_arena, size_t, lookups);
+        for (size_t i = 0; i < lookups; i++) {
+            order[i] = rand_random() % count;
+        }
+
+        remove("build/profile_arena_file.bin");
+        Arena *file = arena_open_file(path);
+        Index *index = index_create(file, next_power_of_two(2*count));
+        for (size_t i = 0; i < count; i++) index_put(file, index, keys[i], i);
+        size_t file_size = file->committed;
+        arena_flush(file);
+        arena_free(file);
+
+        Tester rebuild = tester_init_with_name("rebuild", 2, cpu_freq, count);
+        Tester reopen = tester_init_with_name("reopen", 2, cpu_freq, count);
+        Tester rebuilt_lookup = tester_init_with_name("rebuilt lookup", 2, cpu_freq, lookups);
+        Tester reopened_lookup = tester_init_with_name("reopened lookup", 2, cpu_freq, lookups);
+        volatile size_t sink = 0;
+
+        while (!rebuilt_lookup.finished) {
+            Arena *a = arena_init(.reserve_size = 16*GB);
+            tester_begin(&rebuild);
+            HashMap(Str, size_t) map = {0};
+            for (size_t i = 0; i < count; i++) {
+                hashmap_put(a, &map, str_copy(a, keys[i]), i);
+            }
+            tester_end(&rebuild);
+
+            tester_begin(&rebuilt_lookup);
+            size_t sum = 0;
+            for (size_t i = 0; i < lookups; i++) sum += hashmap_get(&map, keys[order[i]]);
+            sink += sum;
+            tester_end(&rebuilt_lookup);
+            arena_free(a);
+        }
+
+        while (!reopened_lookup.finished) {
+            tester_begin(&reopen);
+            Arena *a = arena_open_file(path);
+            tester_end(&reopen);
+
+            tester_begin(&reopened_lookup);
+            Index *index = (Index *)a->data;
+            size_t sum = 0;
+            for (size_t i = 0; i < lookups; i++) sum += index_get(index, keys[order[i]]);
+            sink += sum;
+            tester_end(&reopened_lookup);
+            arena_free(a);
+        }
+
+        printf("%zu,%zu,%.3f,%.3f,%.1f,%.1f\n", count, file_size / (size_t)MB,
+               min_seconds(&rebuild) * 1e3, min_seconds(&reopen) * 1e3,
+               min_seconds(&rebuilt_lookup) * 1e9 / lookups,
+               min_seconds(&reopened_lookup) * 1e9 / lookups);
+        arena_free(keys_arena);
+    }
+    remove("build/profile_arena_file.bin");
+}
+
+typedef struct {
+    uint64_t *values;
+    size_t count;
+    uint64_t sum;       // set by the child
+} SharedPayload;
+
+static uint64_t payload_sum(uint64_t *values, size_t count) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) sum += values[i];
+    return sum;
+}
+
+// Runs in the child process started by profile_arena_shared_memory, summing the
+// values either from a file (and writing the sum to another one), or from a shared arena
+static int payload_child(char *mode, char *arg) {
+    if (strcmp(mode, "payload-file-child") == 0) {
+        Arena *a = arena_init(.reserve_size = 4*GB);
+        Str payload = str_from_file(a, S("build/profile_payload.bin"));
+        uint64_t sum = payload_sum((uint64_t *)payload.data, payload.length / sizeof(uint64_t));
+        bool ok = str_to_file(str_from((char *)&sum, sizeof(sum)), S("build/profile_payload_sum.bin"));
+        arena_free(a);
+        return !ok;
+    }
+    Arena *a = arena_open_shared(atoi(arg));
+    if (!a) return 1;
+    SharedPayload *payload = (SharedPayload *)a->data;
+    payload->sum = payload_sum(payload->values, payload->count);
+    arena_free(a);
+    return 0;
+}
+
+// Time taken to hand a 1 GB payload to a child process and get back a result computed
+// from it, either by writing it to a file which the child reads, or by putting it in a
+// shared memory arena which the child maps. In both cases the payload is already in memory
+// to begin with, and writing it out as is, is the cheapest possible serialization
+void profile_arena_shared_memory() {
+    size_t size = 1*GB;
+    size_t count = size / sizeof(uint64_t);
+    size_t runs = 3;
+    Cmd cmd = {0};
+
+    Arena *a = arena_init(.reserve_size = size + 1*MB);
+    uint64_t *values = arena_push(a, uint64_t, count, .zeroed=false);
+    for (size_t i = 0; i < count; i++) values[i] = hash_u64(i);
+    uint64_t expected = payload_sum(values, count);
+
+    Arena *shared = arena_init_shared_memory(.reserve_size = size + 1*MB);
+    SharedPayload *payload = arena_new(shared, SharedPayload);
+    payload->values = arena_push(shared, uint64_t, count, .zeroed=false);
+    payload->count = count;
+    for (size_t i = 0; i < count; i++) payload->values[i] = hash_u64(i);
+
+    printf("method,time (ms)\n");
+    uint64_t best_file = UINT64_MAX, best_shared = UINT64_MAX;
+    for (size_t run = 0; run < runs; run++) {
+        uint64_t start = timer_now();
+        avow(str_to_file(str_from((char *)values, size), S("build/profile_payload.bin")), "failed to write payload");
+        cmd_push_many(&cmd, S("/proc/self/exe"), S("payload-file-child"), S("-"));
+        avow(cmd_ok(cmd_run(&cmd, .no_log_cmd = true)), "file child failed");
+        Str result = str_from_file(a, S("build/profile_payload_sum.bin"));
+        avow(result.length == sizeof(uint64_t) && *(uint64_t *)result.data == expected, "wrong sum from file child");
+        best_file = min_of(best_file, timer_now() - start);
+        arena_pop(a, char, result.length);
+
+        start = timer_now();
+        payload->sum = 0;
+        cmd_push_many(&cmd, S("/proc/self/exe"), S("payload-shared-child"));
+        cmd_push_arena(&cmd, shared);
+        avow(cmd_ok(cmd_run(&cmd, .no_log_cmd = true)), "shared child failed");
+        avow(payload->sum == expected, "wrong sum from shared child");
+        best_shared = min_of(best_shared, timer_now() - start);
+    }
+    printf("file,%.1f\n", (double)best_file / 1e6);
+    printf("shared arena,%.1f\n", (double)best_shared / 1e6);
+
+    remove("build/profile_payload.bin");
+    remove("build/profile_payload_sum.bin");
+    cmd_free(&cmd);
+    arena_free(shared);
+    arena_free(a);
+}
+#endif
+
+typedef enum {
+    Scratch_Temp,
+    Scratch_FreshLinear,
+    Scratch_FreshChained,
+} ScratchSource;
+
+// One level of a call chain, where each level builds its result in `out`, using scratch memory which
+// is passed down as the output arena of the next level, along with `out` itself (like a parser calling
+// a function which reads a file, which then converts the path to a C string), so that the scratch
+// memory of each level has to come from an arena other than both of those
+static Str nested_scratch(Arena *out, Arena *other, size_t depth, ScratchSource source) {
+    Temp tmp = {0};
+    if (source == Scratch_Temp) tmp = arena_temp_excl(out, other);
+    else if (source == Scratch_FreshLinear) tmp.arena = arena_init();
+    else tmp.arena = arena_init(.type = Arena_Chained);
+
+    char *scratch = arena_push(tmp.arena, char, 256, .zeroed=false);
+    memset(scratch, 'a' + (int)depth, 256);
+    Str inner = depth? nested_scratch(tmp.arena, out, depth - 1, source): str_from(scratch, 256);
+    Str result = str_copy(out, str_take(inner, 128));
+
+    if (source == Scratch_Temp) arena_temp_release(tmp);
+    else arena_free(tmp.arena);
+    return result;
+}
+
+// Cost of a call chain of nested_scratch, with the scratch memory taken from the temporary arenas (which
+// needs 3 of them, more than there used to be), or from an arena created by each call instead
+void profile_arena_nested_scratch() {
+    size_t depths[] = {2, 4, 8};
+    size_t calls = 1 << 18;
+    char *names[] = {"temp arenas", "fresh linear arena", "fresh chained arena"};
+    Arena *out = arena_init();
+    volatile size_t sink = 0;
+
+    printf("depth,scratch memory,time per chain (ns)\n");
+    for (size_t d = 0; d < array_len(depths); d++) {
+        for (int source = 0; source < 3; source++) {
+            uint64_t best = UINT64_MAX;
+            for (int run = 0; run < 5; run++) {
+                uint64_t start = timer_now();
+                for (size_t i = 0; i < calls; i++) {
+                    Temp tmp = arena_save(out);
+                    sink += nested_scratch(out, NULL, depths[d], source).length;
+                    arena_rewind(tmp);
+                }
+                best = min_of(best, timer_now() - start);
+            }
+            printf("%zu,%s,%.1f\n", depths[d], names[source], (double)best / (double)calls);
+        }
+    }
+    arena_temp_print_stats();
+    arena_free(out);
+}
+
+// Scratch memory for a call which usually needs a little, but sometimes needs a lot
+static size_t spill_work(Arena *a, size_t size) {
+    byte *mem = arena_push(a, byte, size, .zeroed=false);
+    for (size_t i = 0; i < size; i += 64) mem[i] = (byte)i;
+    return mem[size / 2];
+}
+
+// Cost per call of getting scratch memory for spill_work, where 99% of the calls need 512 bytes
+// and the rest need 64 KB, with a 1 KB stack buffer which spills, the thread local temporary arena,
+// and malloc (the stack buffer couldn't be used at all before, without making it 64 KB)
+void profile_arena_static_spill() {
+    size_t calls = 1 << 22;
+    size_t *sizes = malloc(calls * sizeof(size_t));
+    for (size_t i = 0; i < calls; i++) sizes[i] = rand_random() % 100 == 0? 64*KB: 512;
+    char *names[] = {"static spill", "temp arena", "malloc"};
+    volatile size_t sink = 0;
+
+    printf("scratch memory,time per call (ns)\n");
+    for (int mode = 0; mode < 3; mode++) {
+        uint64_t best = UINT64_MAX;
+        for (int run = 0; run < 5; run++) {
+            uint64_t start = timer_now();
+            for (size_t i = 0; i < calls; i++) {
+                if (mode == 0) {
+                    byte buffer[1*KB];
+                    Arena *a = arena_init_static_spill(buffer, sizeof(buffer));
+                    sink += spill_work(a, sizes[i]);
+                    arena_free(a);
+                } else if (mode == 1) {
+                    Temp tmp = arena_temp();
+                    sink += spill_work(tmp.arena, sizes[i]);
+                    arena_temp_release(tmp);
+                } else {
+                    byte *mem = malloc(sizes[i]);
+                    for (size_t j = 0; j < sizes[i]; j += 64) mem[j] = (byte)j;
+                    sink += mem[sizes[i] / 2];
+                    free(mem);
+                }
+            }
+            best = min_of(best, timer_now() - start);
+        }
+        printf("%s,%.1f\n", names[mode], (double)best / (double)calls);
+    }
+    free(sizes);
+}
+
+// Total allocation rate of N threads pushing onto a single arena, either a shared
+// one or a linear one behind a lock, and of each thread pushing onto its own arena
+void profile_arena_shared() {
+    size_t count = 1 << 22;
+    size_t size = 32;
+    size_t max_threads = max_of(thread_cpu_count(), (size_t)4);
+
+    printf("cpus: %zu\n", thread_cpu_count());
+    printf("threads,shared (M allocs/s),locked (M allocs/s),per thread (M allocs/s)\n");
+    for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        double rates[3] = {0};
+        for (int mode = 0; mode < 3; mode++) {
+            Arena *shared = arena_init(.type = mode == 0? Arena_Shared: Arena_Linear, .reserve_size = 16*GB);
+            SpinLock lock = {0};
+            ArenaRateThread threads[64] = {0};
+            Thread handles[64] = {0};
+            assert(thread_count <= array_len(threads));
+
+            uint64_t start = timer_now();
+            for (size_t i = 0; i < thread_count; i++) {
+                threads[i] = (ArenaRateThread){
+                    .arena = mode == 2? arena_init(.reserve_size = 4*GB): shared,
+                    .lock = &lock, .count = count, .size = size,
+                };
+                handles[i] = thread_spawn(mode == 1? arena_rate_thread_locked: arena_rate_thread_shared, &threads[i]);
+            }
+            for (size_t i = 0; i < thread_count; i++) {
+                thread_join(handles[i]);
+            }
+            uint64_t elapsed = timer_now() - start;
+            rates[mode] = (double)(thread_count * count) / ((double)elapsed / NS) / 1e6;
+
+            if (mode == 2) {
+                for (size_t i = 0; i < thread_count; i++) arena_free(threads[i].arena);
+            }
+            arena_free(shared);
+        }
+        printf("%zu,%.1f,%.1f,%.1f\n", thread_count, rates[0], rates[1], rates[2]);
+    }
 }
 
 void test_arena() {
     test_arena_functions();
     test_arena_temp();
+    test_arena_partial_commit();
+    test_arena_keep_committed();
+    test_arena_huge_pages();
+    test_arena_stats();
+    test_arena_chained_blocks();
+#if OS_LINUX && !defined(ARENA_USE_MALLOC) && ARENA_MAX_FREE_BLOCKS > 0
+    test_arena_free_blocks_thread_exit();
+#endif
+    test_arena_shared();
+    test_arena_static_spill();
+#ifdef ARENA_HAS_FILES
+    test_arena_file();
+    test_arena_shared_memory();
+#endif
 }
 
-int main() {
+int main(int argc, char **argv) {
+#ifdef ARENA_HAS_FILES
+    // the tests for shared memory arenas run this program again as the child process
+    if (argc > 2 && strcmp(argv[1], "shared-memory-child") == 0) return shared_memory_child(atoi(argv[2]));
+    if (argc > 2 && strncmp(argv[1], "payload-", 8) == 0) return payload_child(argv[1], argv[2]);
+#else
+    unused(argc); unused(argv);
+#endif
+    // profile_arena_chained_rewind();
+    // profile_arena_shared();
+    // profile_arena_rewind_page_faults();
+    // profile_arena_huge_pages();
+    // profile_arena_file();
+    // profile_arena_shared_memory();
+    // profile_arena_static_spill();
+    // profile_arena_nested_scratch();
     test_arena();
     printf("\nExiting Successfully\n");
     return 0;
@@ -0,0 +1,276 @@
+#include <inttypes.h>
+
+#include "migi.h"
+#include "concurrent_hashmap.h"
+#include "migi_thread.h"
+#include "random.h"
+#include "timing.h"
+
+void test_basic() {
+    Arena *a = arena_init();
+    ConcurrentHashMap(Str, int) map = {0};
+
+    assert(concurrent_hashmap_get(&map, S("foo")) == 0);
+    assert(!concurrent_hashmap_del(&map, S("foo")));
+
+    concurrent_hashmap_put(a, &map, S("foo"), 1);
+    concurrent_hashmap_put(a, &map, S("bar"), 2);
+    concurrent_hashmap_put(a, &map, S("baz"), 3);
+    assert(concurrent_hashmap_size(&map) == 3);
+
+    assert(concurrent_hashmap_get(&map, S("foo")) == 1);
+    assert(concurrent_hashmap_get(&map, S("bar")) == 2);
+    assert(concurrent_hashmap_get(&map, S("abcd")) == 0);
+
+    int value = -1;
+    assert(concurrent_hashmap_find(&map, S("baz"), &value) && value == 3);
+    assert(!concurrent_hashmap_find(&map, S("abcd"), &value) && value == 3);
+
+    concurrent_hashmap_put(a, &map, S("foo"), 10);
+    assert(concurrent_hashmap_get(&map, S("foo")) == 10);
+    assert(concurrent_hashmap_size(&map) == 3);
+
+    concurrent_hashmap_set_default(a, &map, S(""), -1);
+    assert(concurrent_hashmap_get(&map, S("abcd")) == -1);
+
+    assert(concurrent_hashmap_del(&map, S("foo")));
+    assert(!concurrent_hashmap_del(&map, S("foo")));
+    assert(concurrent_hashmap_get(&map, S("foo")) == -1);
+    assert(concurrent_hashmap_get(&map, S("bar")) == 2);
+    assert(concurrent_hashmap_get(&map, S("baz")) == 3);
+    assert(concurrent_hashmap_size(&map) == 2);
+
+    int sum = 0;
+    concurrent_hashmap_foreach(&map, pair) {
+        sum += pair->value;
+    }
+    assert(sum == 5);
+
+    arena_free(a);
+}
+
+void test_growth() {
+    Arena *a = arena_init();
+    ConcurrentHashMap(uint64_t, uint64_t) map = {0};
+    size_t count = 100000;
+
+    for (size_t i = 1; i <= count; i++) {
+        concurrent_hashmap_put(a, &map, i, i*3);
+    }
+    for (size_t i = 1; i <= count; i += 2) {
+        assert(concurrent_hashmap_del(&map, i));
+    }
+    assert(concurrent_hashmap_size(&map) == count/2);
+    for (size_t i = 1; i <= count; i++) {
+        uint64_t value = 0;
+        bool found = concurrent_hashmap_find(&map, i, &value);
+        assert(found == (i % 2 == 0));
+        assert(!found || value == i*3);
+    }
+
+    ConcurrentHashMap(uint64_t, uint64_t) reserved = {0};
+    concurrent_hashmap_reserve(a, &reserved, count);
+    size_t capacity = reserved._h.capacity;
+    for (size_t i = 1; i <= count; i++) {
+        concurrent_hashmap_put(a, &reserved, i, i);
+    }
+    assert(reserved._h.capacity == capacity);
+
+    arena_free(a);
+}
+
+
+typedef ConcurrentHashMap(uint64_t, uint64_t) ConcurrentMapIntInt;
+typedef HashMap(uint64_t, uint64_t) MapIntInt;
+
+// Every write stores a new version, along with a checksum of the key and version,
+// so that a reader can tell if it was handed a value that belongs to some other
+// key, or one that was only half written
+typedef struct {
+    uint64_t version;
+    uint64_t check;
+} StressValue;
+
+#define stress_value(key, version) ((StressValue){ (version), hash_u64((key) ^ (version)) })
+#define stress_value_ok(key, value) ((value).check == hash_u64((key) ^ (value).version))
+
+typedef ConcurrentHashMap(uint64_t, StressValue) ConcurrentStressMap;
+
+typedef struct {
+    ConcurrentStressMap *map;
+    Arena *arena;
+    size_t key_count;
+    size_t iterations;
+    uint64_t seed;
+    bool writer;
+    bool *done;
+    size_t hits;
+} StressThread;
+
+static void stress_thread(void *arg) {
+    StressThread *t = arg;
+    uint64_t state = t->seed;
+    if (t->writer) {
+        // fill up the map (growing it a bunch of times along the way),
+        // and then keep deleting and reinserting random keys
+        for (size_t key = 1; key <= t->key_count; key++) {
+            concurrent_hashmap_put(t->arena, t->map, key, stress_value(key, 0));
+        }
+        for (size_t i = 0; i < t->iterations; i++) {
+            state = hash_u64(state);
+            uint64_t key = 1 + state % t->key_count;
+            if (state & (1ull << 63)) {
+                concurrent_hashmap_del(t->map, key);
+            } else {
+                concurrent_hashmap_put(t->arena, t->map, key, stress_value(key, i));
+            }
+        }
+        atomic_store_release(t->done, true);
+    } else {
+        while (!atomic_load_acquire(t->done)) {
+            for (size_t i = 0; i < 1024; i++) {
+                state = hash_u64(state);
+                uint64_t key = 1 + state % t->key_count;
+                StressValue value = {0};
+                if (concurrent_hashmap_find(t->map, key, &value)) {
+                    assertf(stress_value_ok(key, value), "key %"PRIu64" has a bad value (version %"PRIu64")",
+                            key, value.version);
+                    t->hits++;
+                }
+            }
+        }
+    }
+}
+
+// Readers look up random keys while a writer inserts and deletes them
+void test_readers_and_writer() {
+    Arena *a = arena_init();
+    ConcurrentStressMap map = {0};
+    bool done = false;
+
+    StressThread threads[4] = {0};
+    Thread handles[array_len(threads)] = {0};
+    for (size_t i = 0; i < array_len(threads); i++) {
+        threads[i] = (StressThread){
+            .map = &map, .arena = a, .done = &done,
+            .key_count = 50000, .iterations = 200000,
+            .seed = i + 1, .writer = (i == 0),
+        };
+        handles[i] = thread_spawn(stress_thread, &threads[i]);
+    }
+    for (size_t i = 0; i < array_len(threads); i++) {
+        thread_join(handles[i]);
+    }
+
+    size_t size = 0;
+    concurrent_hashmap_foreach(&map, pair) {
+        assert(stress_value_ok(pair->key, pair->value));
+        assert(concurrent_hashmap_get(&map, pair->key).version == pair->value.version);
+        size++;
+    }
+    assert(size == concurrent_hashmap_size(&map));
+    arena_free(a);
+}
+
+
+typedef struct {
+    ConcurrentMapIntInt *map;
+    MapIntInt *locked_map;
+    SpinLock *lock;
+    Arena *arena;
+    size_t key_count;
+    size_t ops;
+    size_t write_percent;
+    uint64_t seed;
+    uint64_t sink;
+} ScalingThread;
+
+static void scaling_thread_concurrent(void *arg) {
+    ScalingThread *t = arg;
+    uint64_t state = t->seed;
+    for (size_t i = 0; i < t->ops; i++) {
+        state = hash_u64(state);
+        uint64_t key = 1 + (state >> 8) % t->key_count;
+        if (state % 100 < t->write_percent) {
+            concurrent_hashmap_put(t->arena, t->map, key, key);
+        } else {
+            t->sink += concurrent_hashmap_get(t->map, key);
+        }
+    }
+}
+
+static void scaling_thread_locked(void *arg) {
+    ScalingThread *t = arg;
+    uint64_t state = t->seed;
+    for (size_t i = 0; i < t->ops; i++) {
+        state = hash_u64(state);
+        uint64_t key = 1 + (state >> 8) % t->key_count;
+        spinlock_lock(t->lock);
+        if (state % 100 < t->write_percent) {
+            hashmap_put(t->arena, t->locked_map, key, key);
+        } else {
+            t->sink += hashmap_get(t->locked_map, key);
+        }
+        spinlock_unlock(t->lock);
+    }
+}
+
+// Total throughput of a fixed number of operations per thread, for 1 to N threads and
+// a few different read/write mixes, compared with a HashMap behind a single lock
+// NOTE: the writes are all updates of existing keys, so that the size stays the same
+void profile_concurrent_hashmap_scaling() {
+    size_t key_count = 1 << 20;
+    size_t ops = 1 << 21;
+    size_t max_threads = max_of(thread_cpu_count(), (size_t)4);
+    size_t write_percents[] = {0, 5, 50};
+
+    Arena *a = arena_init();
+    ConcurrentMapIntInt map = {0};
+    MapIntInt locked_map = {0};
+    SpinLock lock = {0};
+    for (size_t key = 1; key <= key_count; key++) {
+        concurrent_hashmap_put(a, &map, key, key);
+        hashmap_put(a, &locked_map, key, key);
+    }
+
+    printf("cpus: %zu\n", thread_cpu_count());
+    printf("threads,write %%,concurrent (mops/s),locked (mops/s)\n");
+    for (size_t w = 0; w < array_len(write_percents); w++) {
+        for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+            double mops[2] = {0};
+            for (int locked = 0; locked < 2; locked++) {
+                ScalingThread threads[64] = {0};
+                Thread handles[64] = {0};
+                assert(thread_count <= array_len(threads));
+
+                uint64_t start = timer_now();
+                for (size_t i = 0; i < thread_count; i++) {
+                    threads[i] = (ScalingThread){
+                        .map = &map, .locked_map = &locked_map, .lock = &lock, .arena = a,
+                        .key_count = key_count, .ops = ops, .write_percent = write_percents[w],
+                        .seed = i + 1,
+                    };
+                    handles[i] = thread_spawn(locked? scaling_thread_locked: scaling_thread_concurrent, &threads[i]);
+                }
+                for (size_t i = 0; i < thread_count; i++) {
+                    thread_join(handles[i]);
+                }
+                uint64_t elapsed = timer_now() - start;
+                mops[locked] = (double)(thread_count * ops) / ((double)elapsed / NS) / 1e6;
+            }
+            printf("%zu,%zu,%.2f,%.2f\n", thread_count, write_percents[w], mops[0], mops[1]);
+        }
+    }
+    arena_free(a);
+}
+
+
+int main() {
+    // profile_concurrent_hashmap_scaling();
+    test_basic();
+    test_growth();
+    test_readers_and_writer();
+
+    printf("\nexiting successfully\n");
+    return 0;
+}
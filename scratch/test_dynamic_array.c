@@ -2,6 +2,12 @@
 
 // #define DYNAMIC_ARRAY_USE_ARENA
 #include "dynamic_array.h"
+#include "timing.h"
+
+#if OS_LINUX
+    #include <sys/resource.h>
+    #include <sys/wait.h>
+#endif
 
 void test_dynamic_array() {
     Array(int) ints = {0};
@@ -86,8 +92,113 @@ void test_dynamic_array_arena() {
 #endif // ifdef DYNAMIC_ARRAY_USE_ARENA
 }
 
+void test_varray() {
+    VArray(int) ints = {0};
+    varray_push(&ints, 0);
+    int *first = ints.data;
+    for (int i = 1; i < 1000000; i++) {
+        varray_push(&ints, i);
+    }
+    // the items never move
+    assert(ints.data == first);
+    assert(ints.length == 1000000 && ints.capacity >= ints.length);
+    for (int i = 0; i < 1000000; i++) assert(ints.data[i] == i);
+
+    VArray(int) more = { .reserved = 1*MB };
+    varray_reserve(&more, 1000);
+    assert(more.capacity >= 1000 && more.length == 0);
+    for (int i = 0; i < 10; i++) varray_push(&more, -i);
+    varray_extend(&ints, &more);
+    assert(ints.length == 1000010 && ints.data[1000009] == -9);
+
+    assert(array_pop(&ints) == -9);
+    array_swap_remove(&ints, 0);
+    assert(ints.data[0] == -8 && array_last(&ints) == -7);
+    size_t count = 0;
+    array_foreach(&more, i) count++;
+    assert(count == 10);
+
+    // items larger than a page
+    typedef struct { byte bytes[5000]; } Big;
+    VArray(Big) bigs = {0};
+    for (int i = 0; i < 100; i++) {
+        varray_push(&bigs, (Big){0});
+        memset(bigs.data[i].bytes, i, sizeof(Big));
+    }
+    for (int i = 0; i < 100; i++) assert(bigs.data[i].bytes[4999] == (byte)i);
+
+    varray_free(&ints);
+    varray_free(&more);
+    varray_free(&bigs);
+    assert(ints.data == NULL && ints.length == 0);
+}
+
+#if OS_LINUX
+// Pushes `count` items one at a time, in a child process so that its peak RSS can be measured
+static void varray_push_run(bool virtual, size_t count) {
+    uint64_t moves = 0;
+    uint64_t start = timer_now();
+    if (virtual) {
+        VArray(uint64_t) arr = {0};
+        for (size_t i = 0; i < count; i++) varray_push(&arr, i);
+        avow(arr.data[count - 1] == count - 1, "pushed items are lost");
+        varray_free(&arr);
+    } else {
+        Array(uint64_t) arr = {0};
+#ifdef DYNAMIC_ARRAY_USE_ARENA
+        arr.arena = arena_init(.reserve_size = 8*GB);
+#endif
+        uint64_t *prev = NULL;
+        for (size_t i = 0; i < count; i++) {
+            array_push(&arr, i);
+            if (arr.data != prev) {
+                moves++;
+                prev = arr.data;
+#ifdef DYNAMIC_ARRAY_USE_ARENA
+                // anything else allocated on the arena, so the array isn't at its end anymore
+                arena_push(arr.arena, byte, 1);
+#endif
+            }
+        }
+        avow(arr.data[count - 1] == count - 1, "pushed items are lost");
+        array_free(&arr);
+    }
+    uint64_t elapsed = timer_now() - start;
+    printf("%s,%.0f,%.1f,%llu,", virtual? "VArray": "Array", (double)(count*sizeof(uint64_t)) / MB,
+           (double)count / ((double)elapsed / NS) / 1e6, (unsigned long long)moves);
+    fflush(stdout);
+}
+
+// Throughput of pushing 8 byte items one at a time up to 1.5 GB, and the peak RSS of doing so
+// With DYNAMIC_ARRAY_USE_ARENA, something else is pushed onto the arena of the Array(T) after
+// every time it grows, so it has to be copied (and is there twice) every time it grows again
+// NOTE: glibc's realloc moves large blocks with mremap, so the malloc version doesn't copy either
+void profile_varray_push() {
+    size_t sizes[] = {64*MB, 512*MB, 1536*MB};
+    printf("array,size (MB),push (M items/s),moves,peak RSS (MB)\n");
+    for (size_t s = 0; s < array_len(sizes); s++) {
+        for (int virtual = 0; virtual < 2; virtual++) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                varray_push_run(virtual, sizes[s] / sizeof(uint64_t));
+                exit(0);
+            }
+            struct rusage usage = {0};
+            int status = 0;
+            wait4(pid, &status, 0, &usage);
+            printf("%.0f\n", (double)usage.ru_maxrss * KB / MB);
+        }
+    }
+}
+#endif
+
 int main() {
+#if OS_LINUX
+    // profile_varray_push();
+#endif
     test_dynamic_array();
     test_dynamic_array_arena();
+    test_varray();
     return 0;
 }
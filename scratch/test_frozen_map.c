@@ -0,0 +1,272 @@
+#include <inttypes.h>
+
+#include "migi.h"
+#include "frozen_map.h"
+#include "hashmap.h"
+#include "file.h"
+#include "random.h"
+#include "timing.h"
+#include "repetition_tester.h"
+
+void test_str_keys() {
+    Arena *a = arena_init();
+    HashMap(Str, int) map = {0};
+    hashmap_set_default(a, &map, S(""), -1);
+    hashmap_put(a, &map, S("foo"), 1);
+    hashmap_put(a, &map, S("bar"), 2);
+    hashmap_put(a, &map, S("baz"), 3);
+    hashmap_put(a, &map, S(""), 4);
+
+    FrozenMap(Str, int) frozen = {0};
+    hashmap_freeze(a, &map, &frozen);
+    assert(frozen_map_size(&frozen) == 4);
+
+    assert(frozen_map_get(&frozen, S("foo")) == 1);
+    assert(frozen_map_get(&frozen, S("bar")) == 2);
+    assert(frozen_map_get(&frozen, S("baz")) == 3);
+    assert(frozen_map_get(&frozen, S("")) == 4);
+    assert(frozen_map_get(&frozen, S("fo")) == -1);
+    assert(frozen_map_get(&frozen, S("fooo")) == -1);
+    assert(*frozen_map_at(&frozen, S("bar")) == 2);
+    assert(frozen_map_at(&frozen, S("abcd")) == NULL);
+
+    HashMap(char *, double) cmap = {0};
+    hashmap_put(a, &cmap, "pi", 3.14);
+    hashmap_put(a, &cmap, "e", 2.71);
+    FrozenMap(char *, double) cfrozen = {0};
+    hashmap_freeze(a, &cmap, &cfrozen);
+    assert(frozen_map_get(&cfrozen, "pi") == 3.14);
+    assert(frozen_map_get(&cfrozen, "e") == 2.71);
+    assert(frozen_map_at(&cfrozen, "tau") == NULL);
+
+    arena_free(a);
+}
+
+void test_other_keys() {
+    typedef struct {
+        int x, y, z;
+    } Point;
+
+    Arena *a = arena_init();
+    HashMap(Point, Str) map = {0};
+    HashMap(int16_t, uint8_t) small = {0};
+    FrozenMap(Point, Str) frozen = {0};
+    FrozenMap(int16_t, uint8_t) small_frozen = {0};
+
+    // empty maps
+    hashmap_reserve(a, &map, 0);
+    hashmap_reserve(a, &small, 0);
+    hashmap_freeze(a, &map, &frozen);
+    hashmap_freeze(a, &small, &small_frozen);
+    assert(frozen_map_size(&frozen) == 0);
+    assert(frozen_map_at(&frozen, ((Point){1, 2, 3})) == NULL);
+    assert(frozen_map_get(&small_frozen, 5) == 0);
+
+    hashmap_put(a, &map, ((Point){1, 2, 3}), S("a"));
+    hashmap_put(a, &map, ((Point){3, 2, 1}), S("b"));
+    for (int16_t i = -1000; i < 1000; i++) {
+        hashmap_put(a, &small, i, (uint8_t)i);
+    }
+    hashmap_freeze(a, &map, &frozen);
+    hashmap_freeze(a, &small, &small_frozen);
+
+    assert(str_eq(frozen_map_get(&frozen, ((Point){1, 2, 3})), S("a")));
+    assert(str_eq(frozen_map_get(&frozen, ((Point){3, 2, 1})), S("b")));
+    assert(frozen_map_at(&frozen, ((Point){2, 2, 2})) == NULL);
+    for (int16_t i = -1000; i < 1000; i++) {
+        assert(*frozen_map_at(&small_frozen, i) == (uint8_t)i);
+    }
+    assert(frozen_map_at(&small_frozen, 1000) == NULL);
+
+    arena_free(a);
+}
+
+void test_large() {
+    Arena *a = arena_init();
+    HashMap(uint64_t, uint64_t) map = {0};
+    size_t count = 200000;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = rand_random();
+        hashmap_put(a, &map, key, key * 7);
+    }
+
+    FrozenMap(uint64_t, uint64_t) frozen = {0};
+    hashmap_freeze(a, &map, &frozen);
+    assert(frozen_map_size(&frozen) == map.size);
+    hashmap_foreach(&map, pair) {
+        uint64_t *value = frozen_map_at(&frozen, pair->key);
+        assert(value && *value == pair->key * 7);
+    }
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        found += frozen_map_at(&frozen, rand_random()) != NULL;
+    }
+    assert(found == 0);
+
+    arena_free(a);
+}
+
+void test_save_load() {
+    Arena *a = arena_init();
+    HashMap(Str, uint32_t) map = {0};
+    for (uint32_t i = 0; i < 10000; i++) {
+        hashmap_put(a, &map, strf(a, "key_%u", i), i);
+    }
+    FrozenMap(Str, uint32_t) frozen = {0};
+    hashmap_freeze(a, &map, &frozen);
+
+    Str filepath = S("build/test_frozen_map.bin");
+    assert(frozen_map_save(&frozen, filepath));
+
+    FrozenMap(Str, uint32_t) loaded = {0};
+    assert(frozen_map_load(&loaded, filepath));
+    assert(frozen_map_size(&loaded) == 10000);
+    for (uint32_t i = 0; i < 10000; i++) {
+        assert(frozen_map_get(&loaded, strf(a, "key_%u", i)) == i);
+    }
+    assert(frozen_map_at(&loaded, S("key_10000")) == NULL);
+    frozen_map_unload(&loaded);
+
+    // the types have to match the ones that the map was built with
+    FrozenMap(Str, uint64_t) wrong_value = {0};
+    FrozenMap(uint64_t, uint32_t) wrong_key = {0};
+    assert(!frozen_map_load(&wrong_value, filepath));
+    assert(!frozen_map_load(&wrong_key, filepath));
+
+    // and truncated or garbage data is rejected
+    Str bytes = frozen_map_bytes(&frozen);
+    FrozenMap(Str, uint32_t) from_bytes = {0};
+    assert(frozen_map_from_bytes(&from_bytes, bytes));
+    assert(!frozen_map_from_bytes(&from_bytes, str_take(bytes, bytes.length - 1)));
+    assert(!frozen_map_from_bytes(&from_bytes, S("not a frozen map, but long enough to be mistaken for one if only the length was checked..................................................")));
+
+    // as is any header which doesn't add up, on a copy of the map
+    byte *copy = arena_push_bytes(a, bytes.length, 64, .zeroed=false);
+    Str copy_bytes = { .data = (char *)copy, .length = bytes.length };
+    FrozenMapHeader *header = (FrozenMapHeader *)copy;
+    FrozenMapHeader original = *(FrozenMapHeader *)bytes.data;
+    #define assert_corrupt(field, value)                            \
+        memcpy(copy, bytes.data, bytes.length);                     \
+        header->field = (value);                                    \
+        assert(!frozen_map_from_bytes(&from_bytes, copy_bytes));
+
+    memcpy(copy, bytes.data, bytes.length);
+    assert(frozen_map_from_bytes(&from_bytes, copy_bytes));
+    // (size + 1)*pair_size wraps around to a small number
+    assert_corrupt(size, UINT64_MAX / original.pair_size);
+    assert_corrupt(size, original.size + 100);
+    assert_corrupt(pair_size, original.pair_size - 8);
+    assert_corrupt(pair_size, 0);
+    assert_corrupt(value_offset, original.value_offset + 4);
+    assert_corrupt(bucket_count, 0);
+    assert_corrupt(bucket_count, UINT64_MAX / 2);
+    assert_corrupt(displacements, 0);
+    assert_corrupt(pairs, original.pairs + 4);
+    assert_corrupt(strings, original.total_size + 1);
+    assert_corrupt(total_size, UINT64_MAX);
+
+    // a string key pointing past the end of the strings
+    memcpy(copy, bytes.data, bytes.length);
+    FrozenMapStr *key = (FrozenMapStr *)(copy + original.pairs + original.pair_size);
+    key->length = original.total_size;
+    assert(!frozen_map_from_bytes(&from_bytes, copy_bytes));
+    key->length = 1;
+    key->offset = UINT64_MAX;
+    assert(!frozen_map_from_bytes(&from_bytes, copy_bytes));
+    #undef assert_corrupt
+
+    arena_free(a);
+}
+
+
+static double min_seconds(Tester *t) {
+    return (double)t->stats[StatsTime].min / (double)t->cpu_freq;
+}
+
+// Time to go from nothing to a usable map with `count` string keys, either by
+// inserting all the keys with hashmap_put, or by loading a frozen map from a file,
+// and the time taken by lookups afterwards (which includes the page faults
+// of the first access to the mapped file)
+void profile_frozen_map() {
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+    size_t counts[] = {1000, 100000, 1000000, 4000000};
+    Str filepath = S("build/profile_frozen_map.bin");
+
+    printf("keys,put (ms),load (ms),put lookup (ns),frozen lookup (ns)\n");
+    for (size_t c = 0; c < array_len(counts); c++) {
+        size_t count = counts[c];
+        Arena *keys_arena = arena_init();
+        Str *keys = arena_push(keys_arena, Str, count);
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = strf(keys_arena, "host-%zx.example.com", (size_t)rand_random());
+        }
+        size_t *order = arena_push(keys_arena, size_t, count);
+        for (size_t i = 0; i < count; i++) {
+            order[i] = rand_random() % count;
+        }
+
+        {
+            Arena *a = arena_init(.reserve_size = 4*GB);
+            HashMap(Str, size_t) map = {0};
+            for (size_t i = 0; i < count; i++) hashmap_put(a, &map, keys[i], i);
+            FrozenMap(Str, size_t) frozen = {0};
+            hashmap_freeze(a, &map, &frozen);
+            assert(frozen_map_save(&frozen, filepath));
+            arena_free(a);
+        }
+
+        Tester put = tester_init_with_name("put", 2, cpu_freq, count);
+        Tester load = tester_init_with_name("load", 2, cpu_freq, count);
+        Tester put_lookup = tester_init_with_name("put lookup", 2, cpu_freq, count);
+        Tester frozen_lookup = tester_init_with_name("frozen lookup", 2, cpu_freq, count);
+        volatile size_t sink = 0;
+
+        // loading is much faster than the lookups, so only the lookups decide when to stop
+        while (!put_lookup.finished) {
+            Arena *a = arena_init(.reserve_size = 4*GB);
+            HashMap(Str, size_t) map = {0};
+            tester_begin(&put);
+            for (size_t i = 0; i < count; i++) hashmap_put(a, &map, keys[i], i);
+            tester_end(&put);
+
+            tester_begin(&put_lookup);
+            size_t sum = 0;
+            for (size_t i = 0; i < count; i++) sum += hashmap_get(&map, keys[order[i]]);
+            sink += sum;
+            tester_end(&put_lookup);
+            arena_free(a);
+        }
+
+        while (!frozen_lookup.finished) {
+            FrozenMap(Str, size_t) frozen = {0};
+            tester_begin(&load);
+            assert(frozen_map_load(&frozen, filepath));
+            tester_end(&load);
+
+            tester_begin(&frozen_lookup);
+            size_t sum = 0;
+            for (size_t i = 0; i < count; i++) sum += frozen_map_get(&frozen, keys[order[i]]);
+            sink += sum;
+            tester_end(&frozen_lookup);
+            frozen_map_unload(&frozen);
+        }
+
+        printf("%zu,%.3f,%.3f,%.1f,%.1f\n", count,
+               min_seconds(&put) * 1e3, min_seconds(&load) * 1e3,
+               min_seconds(&put_lookup) * 1e9 / count,
+               min_seconds(&frozen_lookup) * 1e9 / count);
+        arena_free(keys_arena);
+    }
+}
+
+
+int main() {
+    // profile_frozen_map();
+    test_str_keys();
+    test_other_keys();
+    test_large();
+    test_save_load();
+
+    printf("\nexiting successfully\n");
+    return 0;
+}
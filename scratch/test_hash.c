@@ -0,0 +1,147 @@
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "migi.h"
+#include "hash.h"
+#include "hashmap.h"
+#include "random.h"
+#include "timing.h"
+#include "repetition_tester.h"
+
+#define assert_u64_eq(a, b)                                                          \
+    do {                                                                             \
+        uint64_t a_ = (a), b_ = (b);                                                 \
+        assertf(a_ == b_, "%s != %s: 0x%016"PRIx64" != 0x%016"PRIx64, #a, #b, a_, b_); \
+    } while (0)
+
+static void fill_pattern(byte *buf, size_t length) {
+    uint64_t state = 0x12345678;
+    for (size_t i = 0; i < length; i++) {
+        state = state*6364136223846793005ull + 1442695040888963407ull;
+        buf[i] = (byte)(state >> 56);
+    }
+}
+
+// Hashes of every prefix of a fixed pattern, folded into a single value. This
+// covers all of the short, medium and striped paths, and must be the same
+// regardless of whether the AVX2 path is enabled or not
+void test_known_answer() {
+    byte buf[2048];
+    fill_pattern(buf, sizeof(buf));
+
+    uint64_t folded = 0;
+    for (size_t i = 0; i <= sizeof(buf); i++) {
+        folded = hash_u64(folded ^ hash_bytes(buf, i));
+    }
+    assert_u64_eq(folded, 0x81c648f491df7ede);
+
+    assert_u64_eq(hash_bytes("", 0), 0xe7646ec811dc2dd6);
+    assert_u64_eq(hash_bytes("a", 1), 0x474af2b9a93f88e8);
+    assert_u64_eq(hash_bytes("hello world", 11), 0x5c149e58dc75cba1);
+}
+
+void test_unaligned() {
+    byte buf[4096 + 8];
+    fill_pattern(buf, sizeof(buf));
+
+    byte copy[4096 + 8];
+    for (size_t length = 0; length <= 4096; length += 7) {
+        uint64_t expected = hash_bytes(buf, length);
+        for (size_t offset = 1; offset < 8; offset++) {
+            memcpy(copy + offset, buf, length);
+            assert_u64_eq(hash_bytes(copy + offset, length), expected);
+        }
+    }
+}
+
+// Different lengths of the same data, and single bit flips should all give different hashes
+void test_distinct() {
+    byte buf[1500];
+    fill_pattern(buf, sizeof(buf));
+
+    Arena *a = arena_init();
+    HashMap(uint64_t, size_t) seen = {0};
+    hashmap_reserve(a, &seen, sizeof(buf) + 1);
+    for (size_t length = 0; length <= sizeof(buf); length++) {
+        uint64_t h = hash_bytes(buf, length);
+        assertf(!hashmap_at(&seen, h), "hash collision between lengths %zu and %zu",
+                *hashmap_at(&seen, h), length);
+        hashmap_put(a, &seen, h, length);
+    }
+
+    size_t lengths[] = {1, 3, 4, 8, 9, 16, 17, 48, 49, 100, 256, 257, 512, 513, 1500};
+    for (size_t i = 0; i < array_len(lengths); i++) {
+        size_t length = lengths[i];
+        uint64_t original = hash_bytes(buf, length);
+        for (size_t bit = 0; bit < length*8; bit++) {
+            buf[bit / 8] ^= (byte)(1 << (bit % 8));
+            uint64_t flipped = hash_bytes(buf, length);
+            buf[bit / 8] ^= (byte)(1 << (bit % 8));
+
+            assertf(flipped != original, "length %zu: flipping bit %zu had no effect", length, bit);
+            // roughly half of the output bits should change
+            int changed = popcount_64(flipped ^ original);
+            assertf(changed > 8 && changed < 56, "length %zu, bit %zu: only %d bits changed", length, bit, changed);
+        }
+    }
+
+    assert(hash_bytes_seed(buf, 32, 1) != hash_bytes_seed(buf, 32, 2));
+    assert(hash_bytes_seed(buf, 1000, 1) != hash_bytes_seed(buf, 1000, 2));
+    arena_free(a);
+}
+
+
+// Throughput of hashing many keys of the same length laid out back to back in
+// a buffer, which is roughly what happens when building a table of strings
+void profile_hash_throughput() {
+    size_t size = 1*MB;
+    byte *buf = malloc(size);
+    rand_fill_bytes(buf, size);
+
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+    size_t lengths[] = {4, 8, 16, 32, 64, 128, 256, 512, 1024, 4096};
+
+    printf("length,hash_bytes (gb/s),hash_fnv_bytes (gb/s)\n");
+    for (size_t i = 0; i < array_len(lengths); i++) {
+        size_t length = lengths[i];
+        size_t key_count = size / length;
+        volatile uint64_t sink = 0;
+
+        Tester fast = tester_init_with_name("hash_bytes", 1, cpu_freq, key_count*length);
+        while (!fast.finished) {
+            tester_begin(&fast);
+            uint64_t h = 0;
+            for (size_t k = 0; k < key_count; k++) {
+                h ^= hash_bytes(buf + k*length, length);
+            }
+            sink ^= h;
+            tester_end(&fast);
+        }
+
+        Tester fnv = tester_init_with_name("hash_fnv_bytes", 1, cpu_freq, key_count*length);
+        while (!fnv.finished) {
+            tester_begin(&fnv);
+            uint64_t h = 0;
+            for (size_t k = 0; k < key_count; k++) {
+                h ^= hash_fnv_bytes(buf + k*length, length);
+            }
+            sink ^= h;
+            tester_end(&fnv);
+        }
+
+        printf("%zu,%.3f,%.3f\n", length,
+               tester_get_min_throughput(&fast, StatsTime, GB),
+               tester_get_min_throughput(&fnv, StatsTime, GB));
+    }
+    free(buf);
+}
+
+int main() {
+    // profile_hash_throughput();
+    test_known_answer();
+    test_unaligned();
+    test_distinct();
+
+    printf("\nexiting successfully\n");
+    return 0;
+}
@@ -1,6 +1,8 @@
 // #define HASHMAP_INIT_CAP 4
 // #define HASHMAP_LOAD_FACTOR 0.25
 // #define HASHMAP_COLLECT_STATS
+// #define HASHMAP_USE_GROUPS
+// #define ENABLE_PROFILING
 #include <inttypes.h>
 
 #include "hashmap.h"
@@ -630,6 +632,26 @@ static void test_reserve() {
     arena_free(str_arena);
 }
 
+// reserving fewer slots than a group must still give a full group for the ctrl array
+static void test_small_reserve() {
+    Arena *a = arena_init();
+    HashMap(int, int) map = {0};
+
+    hashmap_reserve(a, &map, 4);
+#ifdef HASHMAP_USE_GROUPS
+    assertf(map.capacity >= HASHMAP_GROUP_WIDTH, "capacity `%zu` is smaller than a group", map.capacity);
+#endif
+    for (int i = 0; i < 5; i++) {
+        hashmap_put(a, &map, i, i*i);
+    }
+    for (int i = 0; i < 5; i++) {
+        int *v = hashmap_at(&map, i);
+        assert(v && *v == i*i);
+    }
+    assert(!hashmap_at(&map, 5));
+
+    arena_free(a);
+}
 
 typedef struct {
     int x, y;
@@ -687,12 +709,533 @@ void test_cstr_key() {
     arena_free(a);
 }
 
+// Integer and pointer keys of every size go through the specialized search
+void test_int_keys() {
+    Arena *a = arena_init();
+
+    HashMap(int8_t, int) small = {0};
+    for (int i = -128; i < 128; i++) {
+        hashmap_put(a, &small, (int8_t)i, i);
+    }
+    assert(small.hash_fn == hash_int && small.eq_fn == eq_int);
+    assert(small.size == 256);
+    for (int i = -128; i < 128; i++) {
+        assert(hashmap_get(&small, (int8_t)i) == i);
+    }
+
+    HashMap(int64_t, int64_t) big = {0};
+    for (int64_t i = -1000; i < 1000; i++) {
+        hashmap_put(a, &big, i * 1000003, i);
+    }
+    for (int64_t i = -1000; i < 1000; i++) {
+        assert_int_eq(hashmap_get(&big, i * 1000003), i);
+        assert(!hashmap_at(&big, i * 1000003 + 1));
+    }
+    for (int64_t i = -1000; i < 1000; i += 2) {
+        assert_int_eq(hashmap_del(&big, i * 1000003), i);
+    }
+    assert(big.size == 1000);
+    for (int64_t i = -1000; i < 1000; i++) {
+        assert((hashmap_at(&big, i * 1000003) != NULL) == (i % 2 != 0));
+    }
+
+    int values[64];
+    HashMap(int *, size_t) ptrs = {0};
+    for (size_t i = 0; i < array_len(values); i++) {
+        hashmap_put(a, &ptrs, &values[i], i);
+    }
+    assert(ptrs.hash_fn == hash_int);
+    for (size_t i = 0; i < array_len(values); i++) {
+        assert_int_eq(hashmap_get(&ptrs, &values[i]), i);
+    }
+    assert(!hashmap_at(&ptrs, (int *)NULL));
+
+    // enough keys for some of them to share the lower 32 bits of
+    // their hash, which is all that compact entries store
+    size_t count = 1 << 17;
+    uint64_t *keys = arena_push(a, uint64_t, count);
+    HashMap(uint64_t, size_t) many = {0};
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = rand_random();
+        hashmap_put(a, &many, keys[i], i);
+    }
+    for (size_t i = 0; i < count; i++) {
+        assert(keys[hashmap_get(&many, keys[i])] == keys[i]);
+    }
+
+    arena_free(a);
+}
+
+// Lookups must keep working while entries are spread across the old and new tables
+void test_incremental_resize() {
+    Arena *a = arena_init();
+    HashMap(Str, size_t) map = {0};
+
+    size_t count = 5000;
+    Str *keys = arena_push(a, Str, count);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = strf(a, "key_%zu", i);
+    }
+
+    bool resized = false;
+    for (size_t i = 0; i < count; i++) {
+        hashmap_put(a, &map, keys[i], i);
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+        resized = resized || map.old_entries != NULL;
+#endif
+        // deleting every third key also exercises deletions from the old table
+        if (i % 3 == 2) {
+            assert(hashmap_del(&map, keys[i - 1]) == i - 1);
+        }
+        assert(hashmap_get(&map, keys[i]) == i);
+
+        // key `k` is deleted once `k + 1` has been inserted, if `k % 3 == 1`
+        size_t k = rand_random() % (i + 1);
+        bool deleted = k % 3 == 1 && k + 1 <= i;
+        assert(hashmap_get(&map, keys[k]) == (deleted? 0: k));
+    }
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    assert(resized);
+#endif
+    unused(resized);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t *value = hashmap_at(&map, keys[i]);
+        if (i % 3 == 1 && i + 1 < count) {
+            assert(!value);
+        } else {
+            assert(value && *value == i);
+        }
+    }
+    arena_free(a);
+}
+
+void test_get_many() {
+    Arena *a = arena_init();
+    HashMap(Str, int) map = {0};
+
+    size_t count = 1000;
+    Str *keys = arena_push(a, Str, count);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = strf(a, "%zu", i);
+        // only the even keys are inserted
+        if (i % 2 == 0) hashmap_put(a, &map, keys[i], (int)i);
+    }
+    hashmap_set_default(a, &map, S(""), -1);
+
+    // odd number of keys so that the last batch is partially filled
+    size_t lookup_count = count - 1;
+    int *values = arena_push(a, int, lookup_count);
+    hashmap_get_many(&map, keys, lookup_count, values);
+    for (size_t i = 0; i < lookup_count; i++) {
+        assert(values[i] == (i % 2 == 0? (int)i: -1));
+    }
+
+    int **ptrs = arena_push(a, int *, lookup_count);
+    hashmap_at_many(&map, keys, lookup_count, ptrs);
+    for (size_t i = 0; i < lookup_count; i++) {
+        if (i % 2 == 0) {
+            assert(ptrs[i] && *ptrs[i] == (int)i);
+        } else {
+            assert(ptrs[i] == NULL);
+        }
+    }
+
+    HashMap(uint32_t, uint32_t) ints = {0};
+    uint32_t int_keys[100];
+    uint32_t int_values[100];
+    for (uint32_t i = 0; i < 100; i++) {
+        int_keys[i] = i * 7919;
+        hashmap_put(a, &ints, int_keys[i], i);
+    }
+    hashmap_get_many(&ints, int_keys, 100, int_values);
+    for (uint32_t i = 0; i < 100; i++) {
+        assert(int_values[i] == i);
+    }
+    arena_free(a);
+}
+
+// Randomly inserts and deletes keys, checking the hashmap against a plain array
+// This exercises the deletion paths (backshift or tombstones) a lot more than the other tests
+void test_random_churn() {
+    Arena *a = arena_init();
+    HashMap(uint64_t, uint64_t) map = {0};
+
+    size_t key_count = 4096;
+    uint64_t *expected = arena_push(a, uint64_t, key_count);
+
+    for (size_t i = 0; i < 200000; i++) {
+        uint64_t key = 1 + rand_random() % (key_count - 1);
+        // the first operation must be an insertion, since the pairs
+        // array (and hence the default value) doesn't exist until then
+        if (i > 0 && rand_random() % 2 == 0) {
+            uint64_t deleted = hashmap_del(&map, key);
+            assert_int_eq(deleted, expected[key]);
+            expected[key] = 0;
+        } else {
+            hashmap_put(a, &map, key, i + 1);
+            expected[key] = i + 1;
+        }
+    }
+
+    size_t live = 0;
+    for (size_t key = 1; key < key_count; key++) {
+        assert_int_eq(hashmap_get(&map, key), expected[key]);
+        live += expected[key] != 0;
+    }
+    assert(live == map.size);
+    arena_free(a);
+}
+
+// Every pair must be pointed to by its entry, and the entry must be in the slot stored for the pair
+#define assert_pair_slots(hashmap)                                               \
+    for (size_t i = 1; i <= (hashmap)->size; i++) {                              \
+        assert(hashmap__pair_entry(&(hashmap)->_h, i)->index == i);              \
+    }
+
+void test_pair_slots() {
+    Arena *a = arena_init();
+    Arena *str_arena = arena_init();
+    StrMap map = {0};
+
+    size_t key_count = 2048;
+    Str *keys = arena_push(str_arena, Str, key_count);
+    int *expected = arena_push(str_arena, int, key_count);
+    for (size_t i = 0; i < key_count; i++) {
+        keys[i] = strf(str_arena, "a long shared prefix for all of the keys %zu", i);
+    }
+
+    hashmap_set_default(a, &map, S(""), -1);
+    for (int i = 0; i < 100000; i++) {
+        size_t k = rand_random() % key_count;
+        if (rand_random() % 2 == 0) {
+            int deleted = hashmap_del(&map, keys[k]);
+            assert(deleted == (expected[k] != 0? expected[k]: -1));
+            expected[k] = 0;
+        } else {
+            hashmap_put(a, &map, keys[k], i + 1);
+            expected[k] = i + 1;
+        }
+        if (i % 1000 == 0) assert_pair_slots(&map);
+    }
+    assert_pair_slots(&map);
+
+    size_t live = 0;
+    for (size_t k = 0; k < key_count; k++) {
+        assert(hashmap_get(&map, keys[k]) == (expected[k] != 0? expected[k]: -1));
+        live += expected[k] != 0;
+    }
+    assert(live == map.size);
+
+    // deleting everything, which includes deleting the last pair itself
+    for (size_t k = 0; k < key_count; k++) {
+        hashmap_del(&map, keys[k]);
+    }
+    assert(map.size == 0);
+    arena_free(a);
+    arena_free(str_arena);
+}
+
+// Compares the lookup times of the layouts, build with and without
+// HASHMAP_USE_GROUPS to compare the group probing and robin hood paths
+void profile_hashmap_layout() {
+    printf("\n%s\n------------------------------------\n", __FUNCTION__);
+#ifdef HASHMAP_USE_GROUPS
+    printf("Layout: groups\n");
+#else
+    printf("Layout: robin hood\n");
+#endif
+    Arena *a = arena_init(.reserve_size = 4*GB);
+    Arena *str_arena = arena_init(.reserve_size = 4*GB);
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+
+    size_t key_length = 16;
+    printf("size,successful lookup (ns),failed lookup (ns)\n");
+    for (size_t size = 1024; size <= 4*MB; size *= 4) {
+        StrMap map = {0};
+        Str *keys = arena_push(str_arena, Str, size);
+        for (size_t i = 0; i < size; i++) {
+            keys[i] = random_string(str_arena, key_length);
+            hashmap_put(a, &map, keys[i], (int)i);
+        }
+        Str *missing = arena_push(str_arena, Str, size);
+        for (size_t i = 0; i < size; i++) {
+            missing[i] = random_string(str_arena, key_length);
+        }
+
+        size_t found = 0;
+        uint64_t start = read_cpu_timer();
+        for (size_t i = 0; i < size; i++) {
+            found += hashmap_at(&map, keys[rand_random() % size]) != NULL;
+        }
+        uint64_t hit_time = read_cpu_timer() - start;
+
+        start = read_cpu_timer();
+        for (size_t i = 0; i < size; i++) {
+            found += hashmap_at(&map, missing[i]) != NULL;
+        }
+        uint64_t miss_time = read_cpu_timer() - start;
+        assert(found >= size);
+
+        printf("%zu,%.2f,%.2f\n", size,
+               (double)hit_time * NS / ((double)cpu_freq * size),
+               (double)miss_time * NS / ((double)cpu_freq * size));
+        arena_reset(a);
+        arena_reset(str_arena);
+    }
+    arena_free(a);
+    arena_free(str_arena);
+}
+
+// Compares lookups of integer keys using the specialized search against the
+// generic search with the byte hash and memcmp called through function pointers
+void profile_hashmap_int_keys() {
+    printf("\n%s\n------------------------------------\n", __FUNCTION__);
+    Arena *a = arena_init(.reserve_size = 4*GB);
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+
+    printf("size,int (ns),generic (ns),int (M lookups/s),generic (M lookups/s)\n");
+    for (size_t size = 1024; size <= 4*MB; size *= 4) {
+        uint64_t *keys = arena_push(a, uint64_t, size);
+        for (size_t i = 0; i < size; i++) {
+            keys[i] = rand_random();
+        }
+
+        HashMap(uint64_t, uint64_t) fast = {0};
+        HashMap(uint64_t, uint64_t) generic = { .hash_fn = hash_bytes, .eq_fn = eq_bytes };
+        for (size_t i = 0; i < size; i++) {
+            hashmap_put(a, &fast, keys[i], i);
+            hashmap_put(a, &generic, keys[i], i);
+        }
+
+        double ns[2];
+        for (int j = 0; j < 2; j++) {
+            uint64_t sum = 0;
+            uint64_t start = read_cpu_timer();
+            for (size_t i = 0; i < size; i++) {
+                sum += j == 0? hashmap_get(&fast, keys[i]): hashmap_get(&generic, keys[i]);
+            }
+            uint64_t elapsed = read_cpu_timer() - start;
+            assert(sum == size*(size - 1)/2);
+            ns[j] = (double)elapsed * NS / ((double)cpu_freq * size);
+        }
+        printf("%zu,%.2f,%.2f,%.1f,%.1f\n", size, ns[0], ns[1], 1000.0/ns[0], 1000.0/ns[1]);
+        arena_reset(a);
+    }
+    arena_free(a);
+}
+
+// Reports the worst case latency of a single put and get, which
+// is what HASHMAP_INCREMENTAL_RESIZE is meant to improve
+void profile_hashmap_put_latency() {
+    printf("\n%s\n------------------------------------\n", __FUNCTION__);
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    printf("Resize: incremental\n");
+#else
+    printf("Resize: all at once\n");
+#endif
+    Arena *a = arena_init(.reserve_size = 16*GB);
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+
+    size_t count = 16*MB;
+    uint64_t *keys = arena_push(a, uint64_t, count);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = rand_random();
+    }
+
+    HashMap(uint64_t, uint64_t) map = {0};
+    uint64_t put_total = 0, put_max = 0;
+    uint64_t get_total = 0, get_max = 0;
+
+    printf("size,avg put (ns),max put (us),avg get (ns),max get (us)\n");
+    for (size_t i = 0; i < count; i++) {
+        uint64_t start = read_cpu_timer();
+        hashmap_put(a, &map, keys[i], i);
+        uint64_t elapsed = read_cpu_timer() - start;
+        put_total += elapsed;
+        put_max = max_of(put_max, elapsed);
+
+        uint64_t key = keys[rand_random() % (i + 1)];
+        start = read_cpu_timer();
+        uint64_t value = hashmap_get(&map, key);
+        elapsed = read_cpu_timer() - start;
+        get_total += elapsed;
+        get_max = max_of(get_max, elapsed);
+        assert(keys[value] == key);
+
+        if (((i + 1) & i) == 0 && i + 1 >= 1024) {
+            double n = (double)(i + 1);
+            printf("%zu,%.1f,%.1f,%.1f,%.1f\n", i + 1,
+                   (double)put_total * NS / (cpu_freq * n), (double)put_max * 1e6 / cpu_freq,
+                   (double)get_total * NS / (cpu_freq * n), (double)get_max * 1e6 / cpu_freq);
+        }
+    }
+    arena_free(a);
+}
+
+// Memory used by the entries and lookup times with integer keys, build with and
+// without HASHMAP_COMPACT_ENTRIES to compare the 16 and 8 byte entries
+void profile_hashmap_entry_size() {
+    printf("\n%s\n------------------------------------\n", __FUNCTION__);
+    printf("Entry size: %zu bytes\n", sizeof(HashMapEntry));
+    Arena *a = arena_init(.reserve_size = 16*GB);
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+
+    size_t sizes[] = {1000000, 10000000, 40000000};
+    printf("size,capacity,entries (mb),entry bytes per key,hit (ns),miss (ns)\n");
+    for (size_t s = 0; s < array_len(sizes); s++) {
+        size_t size = sizes[s];
+        size_t lookups = min_of(size, 4000000);
+        uint64_t *keys = arena_push(a, uint64_t, size);
+        for (size_t i = 0; i < size; i++) {
+            keys[i] = rand_random();
+        }
+
+        HashMap(uint64_t, uint64_t) map = {0};
+        for (size_t i = 0; i < size; i++) {
+            hashmap_put(a, &map, keys[i], i);
+        }
+
+        uint64_t sum = 0;
+        uint64_t start = read_cpu_timer();
+        for (size_t i = 0; i < lookups; i++) {
+            sum += hashmap_get(&map, keys[rand_random() % size]);
+        }
+        uint64_t hit_time = read_cpu_timer() - start;
+
+        start = read_cpu_timer();
+        for (size_t i = 0; i < lookups; i++) {
+            sum += hashmap_get(&map, rand_random());
+        }
+        uint64_t miss_time = read_cpu_timer() - start;
+        unused(sum);
+
+        size_t entry_bytes = map.capacity * sizeof(HashMapEntry);
+        printf("%zu,%zu,%.1f,%.1f,%.2f,%.2f\n", size, map.capacity,
+               (double)entry_bytes / MB, (double)entry_bytes / size,
+               (double)hit_time * NS / ((double)cpu_freq * lookups),
+               (double)miss_time * NS / ((double)cpu_freq * lookups));
+        arena_reset(a);
+    }
+    arena_free(a);
+}
+
+// Lookup times of hashmap_get_many for different numbers of keys per call, compared
+// to calling hashmap_get for each key, on a hashmap much larger than the cache
+void profile_hashmap_get_many() {
+    printf("\n%s\n------------------------------------\n", __FUNCTION__);
+    Arena *a = arena_init(.reserve_size = 16*GB);
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+
+    size_t size = 32*MB;
+    size_t lookup_count = 4*MB;
+    uint64_t *keys = arena_push(a, uint64_t, size);
+    HashMap(uint64_t, uint64_t) map = {0};
+    for (size_t i = 0; i < size; i++) {
+        keys[i] = rand_random();
+        hashmap_put(a, &map, keys[i], i);
+    }
+    printf("%zu keys, %.0f mb of entries and pairs\n", size,
+           (double)map.capacity * (sizeof(HashMapEntry) + sizeof(*map.pairs)) / MB);
+
+    uint64_t *lookups = arena_push(a, uint64_t, lookup_count);
+    uint64_t *values = arena_push(a, uint64_t, lookup_count);
+    for (size_t i = 0; i < lookup_count; i++) {
+        lookups[i] = keys[rand_random() % size];
+    }
+
+    uint64_t start = read_cpu_timer();
+    for (size_t i = 0; i < lookup_count; i++) {
+        values[i] = hashmap_get(&map, lookups[i]);
+    }
+    double single_ns = (double)(read_cpu_timer() - start) * NS / ((double)cpu_freq * lookup_count);
+    printf("batch size,ns per key,M keys/s\n");
+    printf("hashmap_get,%.2f,%.1f\n", single_ns, 1000.0 / single_ns);
+
+    size_t batch_sizes[] = {1, 2, 4, 8, 16, 32, 64, 256, 1024, 4096};
+    for (size_t b = 0; b < array_len(batch_sizes); b++) {
+        size_t batch = batch_sizes[b];
+        start = read_cpu_timer();
+        for (size_t i = 0; i < lookup_count; i += batch) {
+            hashmap_get_many(&map, lookups + i, min_of(batch, lookup_count - i), values + i);
+        }
+        double ns = (double)(read_cpu_timer() - start) * NS / ((double)cpu_freq * lookup_count);
+        for (size_t i = 0; i < lookup_count; i++) {
+            assert(keys[values[i]] == lookups[i]);
+        }
+        printf("%zu,%.2f,%.1f\n", batch, ns, 1000.0 / ns);
+    }
+    arena_free(a);
+}
+
+// Cost of deleting a key compared to looking one up, with long string keys which only differ
+// at the end, so that every key comparison is expensive. The map is kept at the same size
+// by inserting a new key after every delete, like a table of sessions would.
+void profile_hashmap_churn() {
+    printf("\n%s\n------------------------------------\n", __FUNCTION__);
+    Arena *str_arena = arena_init(.reserve_size = 4*GB);
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+
+    size_t ops = 1*MB;
+    printf("size,get (ns),del (ns),put (ns),del/get\n");
+    for (size_t size = 1024; size <= 1*MB; size *= 32) {
+        Arena *a = arena_init(.reserve_size = 4*GB);
+        HashMap(Str, size_t) map = {0};
+
+        // the live keys are always the ones in [first, first + size)
+        size_t key_count = size + ops;
+        Str *keys = arena_push(str_arena, Str, key_count);
+        for (size_t i = 0; i < key_count; i++) {
+            keys[i] = strf(str_arena, "session:0123456789abcdef0123456789abcdef:%016zx", hash_u64(i));
+        }
+        for (size_t i = 0; i < size; i++) {
+            hashmap_put(a, &map, keys[i], i);
+        }
+
+        uint64_t get_time = 0, del_time = 0, put_time = 0;
+        size_t sum = 0;
+        for (size_t i = 0; i < ops; i++) {
+            // delete the oldest key and replace it with a new one
+            Str lookup = keys[i + rand_random() % size];
+            uint64_t start = read_cpu_timer();
+            sum += hashmap_get(&map, lookup);
+            uint64_t end = read_cpu_timer();
+            get_time += end - start;
+
+            start = read_cpu_timer();
+            sum += hashmap_del(&map, keys[i]);
+            end = read_cpu_timer();
+            del_time += end - start;
+
+            start = read_cpu_timer();
+            hashmap_put(a, &map, keys[i + size], i + size);
+            end = read_cpu_timer();
+            put_time += end - start;
+        }
+        assert(map.size == size && sum > 0);
+
+        double get_ns = (double)get_time * NS / ((double)cpu_freq * ops);
+        double del_ns = (double)del_time * NS / ((double)cpu_freq * ops);
+        double put_ns = (double)put_time * NS / ((double)cpu_freq * ops);
+        printf("%zu,%.1f,%.1f,%.1f,%.2f\n", size, get_ns, del_ns, put_ns, del_ns / get_ns);
+        arena_free(a);
+        arena_reset(str_arena);
+    }
+    arena_free(str_arena);
+}
+
 int main() {
     // frequency_analysis();
     // profile_hashmap_lookup_times();
     // profile_hashmap_deletion_times();
     // profile_search_fail();
     // profile_huge_strings();
+    // profile_hashmap_layout();
+    // profile_hashmap_int_keys();
+    // profile_hashmap_put_latency();
+    // profile_hashmap_entry_size();
+    // profile_hashmap_get_many();
+    // profile_hashmap_churn();
     test_small_hashmap_collision();
     test_basic();
     test_basic_struct_key();
@@ -700,8 +1243,14 @@ int main() {
     test_default_values();
     test_type_safety();
     test_reserve();
+    test_small_reserve();
     test_custom_hash();
     test_cstr_key();
+    test_int_keys();
+    test_incremental_resize();
+    test_get_many();
+    test_random_churn();
+    test_pair_slots();
 
 
     printf("\nexiting successfully\n");
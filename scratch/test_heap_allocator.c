@@ -0,0 +1,279 @@
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "migi.h"
+#include "heap_allocator.h"
+#include "migi_thread.h"
+#include "random.h"
+#include "timing.h"
+
+void test_size_classes() {
+    assert(heap__size_class(0) == 0 && heap__size_class(16) == 0 && heap__size_class(17) == 1);
+    assert(heap__size_class(128) == 7 && heap__size_class(129) == 8);
+    assert(heap__size_class(HEAP_MAX_SMALL_SIZE) == HEAP_CLASS_COUNT - 1);
+    for (size_t size = 1; size <= HEAP_MAX_SMALL_SIZE; size++) {
+        uint32_t size_class = heap__size_class(size);
+        assert(heap__class_size(size_class) >= size);
+        if (size_class > 0) assert(heap__class_size(size_class - 1) < size);
+        // at most 25% is wasted by rounding up (apart from the smallest classes)
+        if (size > 64) assert(heap__class_size(size_class) - size < size / 4 + 1);
+    }
+}
+
+void test_basic() {
+    Heap heap = {0};
+    int *a = heap_alloc(&heap, sizeof(int));
+    double *b = heap_alloc(&heap, 100 * sizeof(double));
+    char *c = heap_alloc(&heap, 1*MB);
+    *a = 42;
+    for (size_t i = 0; i < 100; i++) b[i] = (double)i;
+    memset(c, 'x', 1*MB);
+    assert((uintptr_t)a % 16 == 0 && (uintptr_t)b % 16 == 0 && (uintptr_t)c % 16 == 0);
+    assert(heap_usable_size(a) == 16 && heap_usable_size(b) == 896 && heap_usable_size(c) >= 1*MB);
+
+    // growing within the same block doesn't move it
+    assert(heap_realloc(&heap, a, 16) == a);
+    b = heap_realloc(&heap, b, 1000 * sizeof(double));
+    for (size_t i = 0; i < 100; i++) assert(b[i] == (double)i);
+    c = heap_realloc(&heap, c, 2*MB);
+    assert(c[1*MB - 1] == 'x');
+
+    heap_dealloc(&heap, a);
+    heap_dealloc(&heap, b);
+    heap_dealloc(&heap, c);
+    heap_dealloc(&heap, NULL);
+    heap_free(&heap);
+
+    // freed blocks are handed out again
+    int *first = heap_alloc(&heap, 40);
+    heap_dealloc(&heap, first);
+    assert(heap_alloc(&heap, 48) == first);
+    heap_free(&heap);
+}
+
+// The largest size classes only take what they need, instead of a whole batch of pages
+void test_large_class_refill() {
+    Heap heap = {0};
+    void *a = heap_alloc(&heap, HEAP_MAX_SMALL_SIZE);
+    assertf(heap.page_count == 1, "expected 1 page but got %zu", heap.page_count);
+    assert(MIGI_HEAP_CACHE.counts[heap__size_class(HEAP_MAX_SMALL_SIZE)] == 0);
+
+    void *b = heap_alloc(&heap, 40000);
+    assertf(heap.page_count == 2, "expected 2 pages but got %zu", heap.page_count);
+
+    // small classes are still refilled in batches
+    void *c = heap_alloc(&heap, 16);
+    assert(MIGI_HEAP_CACHE.counts[0] == HEAP_CACHE_SIZE / 2 - 1);
+
+    heap_dealloc(&heap, a);
+    heap_dealloc(&heap, b);
+    heap_dealloc(&heap, c);
+    heap_flush_thread_cache();
+    heap_free(&heap);
+}
+
+// Every allocation is filled with a pattern, which must still be there when it is freed
+void test_churn() {
+    Arena *a = arena_init();
+    Heap heap = { .arena = a };
+    size_t slot_count = 20000;
+    byte **slots = arena_push(a, byte *, slot_count);
+    size_t *sizes = arena_push(a, size_t, slot_count);
+
+    for (size_t i = 0; i < 400000; i++) {
+        size_t slot = rand_random() % slot_count;
+        if (slots[slot]) {
+            for (size_t j = 0; j < sizes[slot]; j++) assert(slots[slot][j] == (byte)(slot + j));
+            heap_dealloc(&heap, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            size_t size = rand_random() % 8 == 0? rand_random() % (80*KB): rand_random() % 256;
+            slots[slot] = heap_alloc(&heap, size);
+            sizes[slot] = size;
+            for (size_t j = 0; j < size; j++) slots[slot][j] = (byte)(slot + j);
+        }
+    }
+    for (size_t slot = 0; slot < slot_count; slot++) heap_dealloc(&heap, slots[slot]);
+
+    // once the thread cache is flushed, every page is empty again
+    heap_flush_thread_cache();
+    assert(heap.page_count > 0 && heap.empty_page_count == heap.page_count);
+    for (size_t i = 0; i < HEAP_CLASS_COUNT; i++) assert(heap.classes[i].pages == NULL);
+
+    // the arena was passed in, so it isn't freed by the heap
+    heap_free(&heap);
+    arena_free(a);
+}
+
+
+typedef struct {
+    Heap *heap;
+    void **handoff;     // allocations made by this thread, to be freed by the next one
+    size_t count;
+    uint64_t seed;
+} HeapThread;
+
+static void heap_thread(void *arg) {
+    HeapThread *t = arg;
+    uint64_t state = t->seed;
+    for (size_t i = 0; i < t->count; i++) {
+        state = hash_u64(state);
+        size_t size = 8 + state % 512;
+        uint64_t *mem = heap_alloc(t->heap, size);
+        *mem = state;
+        t->handoff[i] = mem;
+    }
+    heap_flush_thread_cache();
+}
+
+// Blocks allocated by one thread and freed by others are returned to their pages
+void test_threads() {
+    Heap heap = {0};
+    HeapThread threads[4] = {0};
+    Thread handles[array_len(threads)] = {0};
+    size_t count = 50000;
+    for (size_t i = 0; i < array_len(threads); i++) {
+        threads[i] = (HeapThread){
+            .heap = &heap, .count = count, .seed = i + 1,
+            .handoff = malloc(count * sizeof(void *)),
+        };
+        handles[i] = thread_spawn(heap_thread, &threads[i]);
+    }
+    for (size_t i = 0; i < array_len(threads); i++) {
+        thread_join(handles[i]);
+    }
+
+    for (size_t i = 0; i < array_len(threads); i++) {
+        uint64_t state = threads[i].seed;
+        for (size_t j = 0; j < count; j++) {
+            state = hash_u64(state);
+            assert(*(uint64_t *)threads[i].handoff[j] == state);
+            heap_dealloc(&heap, threads[i].handoff[j]);
+        }
+        free(threads[i].handoff);
+    }
+    heap_flush_thread_cache();
+    assert(heap.empty_page_count == heap.page_count);
+    heap_free(&heap);
+}
+
+
+typedef enum {
+    Churn_Heap,
+    Churn_Malloc,
+} ChurnAllocator;
+
+typedef struct {
+    uint32_t slot;
+    uint32_t size;  // 0 to free the slot
+} ChurnOp;
+
+// A trace of allocations and frees of random slots, with the sizes of a typical
+// long lived cache: mostly small objects, some medium ones and a few large ones
+static ChurnOp *churn_trace(Arena *a, size_t op_count, size_t slot_count) {
+    ChurnOp *ops = arena_push(a, ChurnOp, op_count);
+    bool *live = arena_push(a, bool, slot_count);
+    for (size_t i = 0; i < op_count; i++) {
+        uint32_t slot = (uint32_t)(rand_random() % slot_count);
+        uint32_t size = 0;
+        if (!live[slot]) {
+            uint64_t r = rand_random() % 100;
+            size = (uint32_t)(r < 80? 8 + rand_random() % 120:
+                              r < 98? 128 + rand_random() % 4000:
+                                      4*KB + rand_random() % (60*KB));
+        }
+        live[slot] = !live[slot];
+        ops[i] = (ChurnOp){ slot, size };
+    }
+    return ops;
+}
+
+static void churn_run(ChurnAllocator allocator, Heap *heap, ChurnOp *ops, size_t op_count, void **slots) {
+    for (size_t i = 0; i < op_count; i++) {
+        ChurnOp op = ops[i];
+        if (op.size) {
+            byte *mem = allocator == Churn_Heap? heap_alloc(heap, op.size): malloc(op.size);
+            mem[0] = 1;
+            slots[op.slot] = mem;
+        } else {
+            if (allocator == Churn_Heap) heap_dealloc(heap, slots[op.slot]);
+            else free(slots[op.slot]);
+            slots[op.slot] = NULL;
+        }
+    }
+}
+
+typedef struct {
+    ChurnAllocator allocator;
+    Heap *heap;
+    ChurnOp *ops;
+    size_t op_count;
+    void **slots;
+} ChurnThread;
+
+static void churn_thread(void *arg) {
+    ChurnThread *t = arg;
+    churn_run(t->allocator, t->heap, t->ops, t->op_count, t->slots);
+    heap_flush_thread_cache();
+}
+
+// Throughput of the same alloc/free trace with a heap and with malloc, run by 1 to N threads
+// at once (each with its own slots)
+void profile_heap_churn() {
+    size_t op_count = 1 << 22;
+    size_t slot_count = 1 << 16;
+    size_t max_threads = max_of(thread_cpu_count(), (size_t)4);
+    Arena *a = arena_init(.reserve_size = 4*GB);
+    ChurnOp *ops = churn_trace(a, op_count, slot_count);
+
+    printf("cpus: %zu\n", thread_cpu_count());
+    printf("threads,heap (M ops/s),malloc (M ops/s)\n");
+    for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        double rates[2] = {0};
+        for (int allocator = 0; allocator < 2; allocator++) {
+            Heap heap = {0};
+            ChurnThread threads[64] = {0};
+            Thread handles[64] = {0};
+            assert(thread_count <= array_len(threads));
+            for (size_t i = 0; i < thread_count; i++) {
+                threads[i] = (ChurnThread){
+                    .allocator = allocator, .heap = &heap, .ops = ops, .op_count = op_count,
+                    .slots = arena_push(a, void *, slot_count),
+                };
+            }
+
+            uint64_t start = timer_now();
+            for (size_t i = 0; i < thread_count; i++) {
+                handles[i] = thread_spawn(churn_thread, &threads[i]);
+            }
+            for (size_t i = 0; i < thread_count; i++) {
+                thread_join(handles[i]);
+            }
+            uint64_t elapsed = timer_now() - start;
+            rates[allocator] = (double)(thread_count * op_count) / ((double)elapsed / NS) / 1e6;
+
+            for (size_t i = 0; i < thread_count; i++) {
+                for (size_t j = 0; j < slot_count; j++) {
+                    if (allocator == Churn_Heap) heap_dealloc(&heap, threads[i].slots[j]);
+                    else free(threads[i].slots[j]);
+                }
+            }
+            heap_free(&heap);
+        }
+        printf("%zu,%.1f,%.1f\n", thread_count, rates[Churn_Heap], rates[Churn_Malloc]);
+    }
+    arena_free(a);
+}
+
+
+int main() {
+    // profile_heap_churn();
+    test_size_classes();
+    test_basic();
+    test_large_class_refill();
+    test_churn();
+    test_threads();
+
+    printf("\nexiting successfully\n");
+    return 0;
+}
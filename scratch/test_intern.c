@@ -0,0 +1,263 @@
+#include <inttypes.h>
+
+#include "migi.h"
+#include "intern.h"
+#include "hashmap.h"
+#include "migi_lexer.h"
+#include "migi_thread.h"
+#include "random.h"
+#include "timing.h"
+#include "repetition_tester.h"
+
+void test_basic() {
+    Interner in = {0};
+    assert(intern_find(&in, S("foo")) == 0);
+
+    InternId foo = intern(&in, S("foo"));
+    InternId bar = intern(&in, S("bar"));
+    InternId empty = intern(&in, S(""));
+    assert(foo != 0 && bar != 0 && empty != 0);
+    assert(foo != bar && foo != empty && bar != empty);
+
+    // the same string always gets the same id, no matter where it comes from
+    char buf[] = "foo";
+    assert(intern(&in, str_from(buf, 3)) == foo);
+    assert(intern_find(&in, S("bar")) == bar);
+    assert(intern_find(&in, S("baz")) == 0);
+    assert(intern_find(&in, S("fo")) == 0);
+    assert(in.count == 3);
+
+    Str canonical = intern_str(&in, foo);
+    assert(str_eq(canonical, S("foo")));
+    assert(canonical.data != buf);
+    assert(canonical.data[canonical.length] == 0);
+    assert(interned_eq(canonical, intern_canonical(&in, str_from(buf, 3))));
+    assert(!interned_eq(canonical, intern_canonical(&in, S("bar"))));
+    assert(intern_str(&in, empty).length == 0);
+
+    assert(intern_hash(&in, foo) == str_hash(S("foo")));
+    assert(intern_hash(&in, empty) == str_hash(S("")));
+
+    intern_free(&in);
+    assert(in.count == 0 && intern_find(&in, S("foo")) == 0);
+}
+
+void test_growth() {
+    Arena *a = arena_init();
+    Arena *strings = arena_init();
+    Interner in = { .arena = a };
+
+    // enough to fill up several blocks, and grow the table a bunch of times
+    size_t count = 200000;
+    Str *keys = arena_push(strings, Str, count);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = strf(strings, "identifier_%zu", i);
+        assert(intern(&in, keys[i]) == i + 1);
+    }
+    Str first = intern_str(&in, 1);
+    for (size_t i = 0; i < count; i++) {
+        InternId id = intern(&in, keys[i]);
+        assert(id == i + 1);
+        assert(str_eq(intern_str(&in, id), keys[i]));
+        assert(intern_hash(&in, id) == str_hash(keys[i]));
+    }
+    // the canonical strings never move
+    assert(first.data == intern_str(&in, 1).data);
+    assert(intern_find(&in, S("identifier_200000")) == 0);
+
+    // the arena was passed in, so it isn't freed by the interner
+    intern_free(&in);
+    arena_free(strings);
+    arena_free(a);
+}
+
+void test_lexer() {
+    // the same identifier at different places in the source is the same string
+    Interner in = {0};
+    Lexer lexer = { .string = S("foo bar foo(baz)"), .interner = &in };
+    Token tokens[5] = {0};
+    for (size_t i = 0; i < array_len(tokens); i++) {
+        tokens[i] = next_token(&lexer);
+    }
+    assert(tokens[0].type == Tok_Identifier && tokens[2].type == Tok_Identifier);
+    assert(tokens[0].id == tokens[2].id && tokens[0].id != tokens[1].id);
+    assert(interned_eq(tokens[0].string, tokens[2].string));
+    assert(str_eq(tokens[4].string, S("baz")));
+    assert(tokens[4].id == intern_find(&in, S("baz")));
+    intern_free(&in);
+}
+
+
+typedef struct {
+    ConcurrentInterner *ci;
+    Str *keys;
+    size_t key_count;
+    InternId *ids;
+    uint64_t seed;
+} InternThread;
+
+static void intern_thread(void *arg) {
+    InternThread *t = arg;
+    // every thread goes through the same keys in a different order
+    uint64_t state = t->seed;
+    for (size_t n = 0; n < t->key_count; n++) {
+        state = hash_u64(state);
+        size_t i = state % t->key_count;
+        InternId id = concurrent_intern(t->ci, t->keys[i]);
+        if (t->ids[i] != 0) assert(t->ids[i] == id);
+        t->ids[i] = id;
+    }
+    for (size_t i = 0; i < t->key_count; i++) {
+        t->ids[i] = concurrent_intern(t->ci, t->keys[i]);
+    }
+}
+
+// Threads interning the same strings at the same time must all end up with the same ids
+void test_concurrent() {
+    Arena *a = arena_init();
+    static ConcurrentInterner ci = {0};
+    size_t key_count = 50000;
+    Str *keys = arena_push(a, Str, key_count);
+    for (size_t i = 0; i < key_count; i++) {
+        keys[i] = strf(a, "key_%zu", i);
+    }
+
+    InternThread threads[4] = {0};
+    Thread handles[array_len(threads)] = {0};
+    for (size_t i = 0; i < array_len(threads); i++) {
+        threads[i] = (InternThread){
+            .ci = &ci, .keys = keys, .key_count = key_count, .seed = i + 1,
+            .ids = arena_push(a, InternId, key_count),
+        };
+        handles[i] = thread_spawn(intern_thread, &threads[i]);
+    }
+    for (size_t i = 0; i < array_len(threads); i++) {
+        thread_join(handles[i]);
+    }
+
+    for (size_t i = 0; i < key_count; i++) {
+        InternId id = threads[0].ids[i];
+        assert(id != 0);
+        for (size_t t = 1; t < array_len(threads); t++) {
+            assert(threads[t].ids[i] == id);
+        }
+        assert(concurrent_intern_find(&ci, keys[i]) == id);
+        assert(str_eq(concurrent_intern_str(&ci, id), keys[i]));
+        assert(concurrent_intern_hash(&ci, id) == str_hash(keys[i]));
+    }
+    assert(concurrent_intern_find(&ci, S("key_50000")) == 0);
+
+    size_t total = 0;
+    for (size_t i = 0; i < INTERN_SHARD_COUNT; i++) {
+        total += ci.shards[i].interner.count;
+    }
+    assert(total == key_count);
+
+    concurrent_intern_free(&ci);
+    arena_free(a);
+}
+
+
+static double min_seconds(Tester *t) {
+    return (double)t->stats[StatsTime].min / (double)t->cpu_freq;
+}
+
+// A symbol table lookup, keyed either by the identifier string (hashing and comparing the
+// contents every time), or by its interned id, along with the cost of interning itself
+// The identifiers are copies, like the ones a lexer would produce from the source
+void profile_intern() {
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+    size_t distinct_counts[] = {100, 10000, 1000000};
+    size_t lookups = 1 << 22;
+
+    printf("distinct,intern (ns),str map lookup (ns),id map lookup (ns),str compare (ns),id compare (ns)\n");
+    for (size_t c = 0; c < array_len(distinct_counts); c++) {
+        size_t distinct = distinct_counts[c];
+        Arena *a = arena_init(.reserve_size = 4*GB);
+
+        Str *names = arena_push(a, Str, distinct);
+        for (size_t i = 0; i < distinct; i++) {
+            names[i] = strf(a, "some_identifier_name_%zu", (size_t)rand_random());
+        }
+        Str *source = arena_push(a, Str, lookups);
+        for (size_t i = 0; i < lookups; i++) {
+            Str name = names[rand_random() % distinct];
+            source[i] = str_from(arena_copy(a, char, name.data, name.length), name.length);
+        }
+
+        Interner in = { .arena = a };
+        HashMap(Str, size_t) str_map = {0};
+        HashMap(InternId, size_t) id_map = {0};
+        for (size_t i = 0; i < distinct; i++) {
+            hashmap_put(a, &str_map, names[i], i);
+            hashmap_put(a, &id_map, intern(&in, names[i]), i);
+        }
+        InternId *ids = arena_push(a, InternId, lookups);
+        Str *canonical = arena_push(a, Str, lookups);
+
+        Tester interning = tester_init_with_name("intern", 2, cpu_freq, lookups);
+        Tester str_lookup = tester_init_with_name("str lookup", 2, cpu_freq, lookups);
+        Tester id_lookup = tester_init_with_name("id lookup", 2, cpu_freq, lookups);
+        Tester str_compare = tester_init_with_name("str compare", 2, cpu_freq, lookups);
+        Tester id_compare = tester_init_with_name("id compare", 2, cpu_freq, lookups);
+        volatile size_t sink = 0;
+
+        while (!interning.finished) {
+            tester_begin(&interning);
+            for (size_t i = 0; i < lookups; i++) ids[i] = intern(&in, source[i]);
+            tester_end(&interning);
+        }
+        for (size_t i = 0; i < lookups; i++) canonical[i] = intern_str(&in, ids[i]);
+
+        while (!str_lookup.finished) {
+            tester_begin(&str_lookup);
+            size_t sum = 0;
+            for (size_t i = 0; i < lookups; i++) sum += hashmap_get(&str_map, source[i]);
+            sink += sum;
+            tester_end(&str_lookup);
+        }
+        while (!id_lookup.finished) {
+            tester_begin(&id_lookup);
+            size_t sum = 0;
+            for (size_t i = 0; i < lookups; i++) sum += hashmap_get(&id_map, ids[i]);
+            sink += sum;
+            tester_end(&id_lookup);
+        }
+
+        // comparing each identifier with the previous one
+        while (!str_compare.finished) {
+            tester_begin(&str_compare);
+            size_t equal = 0;
+            for (size_t i = 1; i < lookups; i++) equal += str_eq(source[i], source[i - 1]);
+            sink += equal;
+            tester_end(&str_compare);
+        }
+        while (!id_compare.finished) {
+            tester_begin(&id_compare);
+            size_t equal = 0;
+            for (size_t i = 1; i < lookups; i++) equal += interned_eq(canonical[i], canonical[i - 1]);
+            sink += equal;
+            tester_end(&id_compare);
+        }
+
+        printf("%zu,%.1f,%.1f,%.1f,%.2f,%.2f\n", distinct,
+               min_seconds(&interning) * 1e9 / lookups,
+               min_seconds(&str_lookup) * 1e9 / lookups,
+               min_seconds(&id_lookup) * 1e9 / lookups,
+               min_seconds(&str_compare) * 1e9 / lookups,
+               min_seconds(&id_compare) * 1e9 / lookups);
+        arena_free(a);
+    }
+}
+
+
+int main() {
+    // profile_intern();
+    test_basic();
+    test_growth();
+    test_lexer();
+    test_concurrent();
+
+    printf("\nexiting successfully\n");
+    return 0;
+}
@@ -1,6 +1,269 @@
+#include <stdlib.h>
+
 #include "pool_allocator.h"
+#include "migi_thread.h"
+#include "hash.h"
+#include "random.h"
+#include "timing.h"
+#include "repetition_tester.h"
+
+static double pool_churn_rate(size_t live, size_t ops, bool single_chunk) {
+    typedef struct { uint64_t a, b, c; } Item;
+    Arena *a = arena_init(.reserve_size = 4*GB);
+    PoolAlloc(Item) p = { .capacity = single_chunk? live: 0 };
+    Item **items = arena_push(a, Item *, live);
+    for (size_t i = 0; i < live; i++) items[i] = pool_alloc(a, &p);
+
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < 5; run++) {
+        uint64_t state = 1;
+        uint64_t start = timer_now();
+        for (size_t i = 0; i < ops; i++) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            size_t slot = (state >> 33) % live;
+            unused(pool_dealloc(&p, items[slot]));
+            items[slot] = pool_alloc(a, &p);
+            items[slot]->a = i;
+        }
+        best = min_of(best, timer_now() - start);
+    }
+    arena_free(a);
+    return (double)ops / ((double)best / NS) / 1e6;
+}
+
+// Throughput of a steady churn of frees and allocations of random items, after growing the
+// pool to `live` items from the default first chunk, compared to a pool which had a single
+// chunk large enough for all of them from the start (the only option before pools could grow)
+// The throughput goes down for both as the items stop fitting in the caches
+void profile_pool_growth() {
+    size_t lives[] = {128, 1 << 12, 1 << 16, 1 << 20, 1 << 22};
+    size_t ops = 1 << 24;
+
+    printf("live items,chunks,grown (M ops/s),single chunk (M ops/s)\n");
+    for (size_t l = 0; l < array_len(lives); l++) {
+        size_t live = lives[l];
+        size_t chunks = log2_64(max_of(live / POOL_ALLOC_DEFAULT_CAP, (size_t)1)) + 1;
+        printf("%zu,%zu,%.1f,%.1f\n", live, chunks,
+               pool_churn_rate(live, ops, false), pool_churn_rate(live, ops, true));
+    }
+}
+
+// Time taken by pool_foreach over a pool of 1M entities (64 bytes each)
+// with only some of them still allocated, per allocated entity and in total
+void profile_pool_foreach() {
+    typedef struct { uint64_t id; float position[3], velocity[3]; byte rest[32]; } Entity;
+    size_t count = 1 << 20;
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+    int occupancies[] = {1, 10, 90};
+
+    printf("occupancy (%%),per entity (ns),total (us)\n");
+    for (size_t o = 0; o < array_len(occupancies); o++) {
+        Arena *a = arena_init(.reserve_size = 4*GB);
+        PoolAlloc(Entity) p = { .capacity = count };
+        Entity **entities = arena_push(a, Entity *, count);
+        for (size_t i = 0; i < count; i++) {
+            entities[i] = pool_alloc(a, &p);
+            entities[i]->id = i;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (rand_random() % 100 >= (uint64_t)occupancies[o]) unused(pool_dealloc(&p, entities[i]));
+        }
+
+        Tester t = tester_init_with_name("foreach", 2, cpu_freq, p.length);
+        volatile uint64_t sink = 0;
+        while (!t.finished) {
+            tester_begin(&t);
+            uint64_t sum = 0;
+            pool_foreach(&p, entity) sum += entity->id;
+            sink += sum;
+            tester_end(&t);
+        }
+        double seconds = (double)t.stats[StatsTime].min / (double)cpu_freq;
+        printf("%d,%.2f,%.1f\n", occupancies[o], seconds * 1e9 / (double)p.length, seconds * 1e6);
+        arena_free(a);
+    }
+}
+
+typedef struct { uint64_t id, check; } Message;
+typedef ConcurrentPoolAlloc(Message) MessageConcurrentPool;
+typedef PoolAlloc(Message) MessagePool;
+
+// A single producer, single consumer queue for handing items from one thread to another
+#define PIPE_SIZE 1024
+typedef struct {
+    _Alignas(64) size_t head;   // written by the consumer
+    _Alignas(64) size_t tail;   // written by the producer
+    Message *items[PIPE_SIZE];
+} Pipe;
+
+static void pipe_push(Pipe *pipe, Message *item) {
+    while (pipe->tail - atomic_load_acquire(&pipe->head) == PIPE_SIZE) thread_yield();
+    pipe->items[pipe->tail % PIPE_SIZE] = item;
+    atomic_store_release(&pipe->tail, pipe->tail + 1);
+}
+
+static Message *pipe_pop(Pipe *pipe) {
+    while (atomic_load_acquire(&pipe->tail) == pipe->head) thread_yield();
+    Message *item = pipe->items[pipe->head % PIPE_SIZE];
+    atomic_store_release(&pipe->head, pipe->head + 1);
+    return item;
+}
+
+typedef enum {
+    Pool_Concurrent,
+    Pool_Locked,        // a PoolAlloc behind a lock
+    Pool_Malloc,
+} PoolKind;
+
+typedef struct {
+    PoolKind kind;
+    MessageConcurrentPool *cpool;
+    MessagePool *pool;
+    Arena *arena;
+    SpinLock *lock;
+    Pipe *pipe;
+    size_t count;
+} PoolThread;
+
+static Message *pool_thread_alloc(PoolThread *t) {
+    switch (t->kind) {
+        case Pool_Concurrent: return concurrent_pool_alloc(t->cpool);
+        case Pool_Malloc:     return calloc(1, sizeof(Message));
+        case Pool_Locked: {
+            spinlock_lock(t->lock);
+            Message *item = pool_alloc(t->arena, t->pool);
+            spinlock_unlock(t->lock);
+            return item;
+        }
+    }
+    return NULL;
+}
+
+static void pool_thread_dealloc(PoolThread *t, Message *item) {
+    switch (t->kind) {
+        case Pool_Concurrent: concurrent_pool_dealloc(t->cpool, item); break;
+        case Pool_Malloc:     free(item); break;
+        case Pool_Locked: {
+            spinlock_lock(t->lock);
+            unused(pool_dealloc(t->pool, item));
+            spinlock_unlock(t->lock);
+        } break;
+    }
+}
+
+static void pool_producer(void *arg) {
+    PoolThread *t = arg;
+    for (size_t i = 0; i < t->count; i++) {
+        Message *item = pool_thread_alloc(t);
+        assert(item->id == 0 && item->check == 0);
+        *item = (Message){ .id = i, .check = hash_u64(i) };
+        pipe_push(t->pipe, item);
+    }
+    if (t->kind == Pool_Concurrent) concurrent_pool_flush_thread_cache();
+}
+
+static void pool_consumer(void *arg) {
+    PoolThread *t = arg;
+    for (size_t i = 0; i < t->count; i++) {
+        Message *item = pipe_pop(t->pipe);
+        avow(item->id == i && item->check == hash_u64(i), "corrupted item");
+        pool_thread_dealloc(t, item);
+    }
+    if (t->kind == Pool_Concurrent) concurrent_pool_flush_thread_cache();
+}
+
+// Runs `pairs` producers, each allocating items which are freed by their own consumer
+// Returns the time taken in nanoseconds
+static uint64_t pool_producer_consumer(PoolKind kind, size_t pairs, size_t count) {
+    MessageConcurrentPool cpool = {0};
+    MessagePool pool = {0};
+    SpinLock lock = {0};
+    Arena *a = arena_init();
+    Pipe *pipes = arena_push(a, Pipe, pairs);
+    PoolThread *threads = arena_push(a, PoolThread, 2*pairs);
+    Thread *handles = arena_push(a, Thread, 2*pairs);
+    for (size_t i = 0; i < 2*pairs; i++) {
+        threads[i] = (PoolThread){
+            .kind = kind, .cpool = &cpool, .pool = &pool, .arena = a, .lock = &lock,
+            .pipe = &pipes[i / 2], .count = count,
+        };
+    }
+
+    uint64_t start = timer_now();
+    for (size_t i = 0; i < 2*pairs; i++) {
+        handles[i] = thread_spawn(i % 2 == 0? pool_producer: pool_consumer, &threads[i]);
+    }
+    for (size_t i = 0; i < 2*pairs; i++) {
+        thread_join(handles[i]);
+    }
+    uint64_t elapsed = timer_now() - start;
+
+    // every item came back, so nothing new has to be carved out
+    if (kind == Pool_Concurrent) {
+        size_t capacity = cpool.pool.capacity;
+        Message **items = arena_push(a, Message *, capacity);
+        for (size_t i = 0; i < capacity; i++) items[i] = concurrent_pool_alloc(&cpool);
+        avow(cpool.pool.capacity == capacity, "items were lost");
+        for (size_t i = 0; i < capacity; i++) concurrent_pool_dealloc(&cpool, items[i]);
+        concurrent_pool_free(&cpool);
+    }
+    arena_free(a);
+    return elapsed;
+}
+
+void test_concurrent_pool() {
+    ConcurrentPoolAlloc(Message) p = {0};
+    Message *a = concurrent_pool_alloc(&p);
+    Message *b = concurrent_pool_alloc(&p);
+    assert(a && b && a != b);
+    assert(p.pool.capacity == POOL_ALLOC_DEFAULT_CAP);
+    concurrent_pool_dealloc(&p, a);
+    concurrent_pool_dealloc(&p, NULL);
+    // freed items are handed out again by the same thread
+    assert(concurrent_pool_alloc(&p) == a);
+
+    // going through more than a few magazines worth of items grows the pool
+    size_t count = 4*POOL_ALLOC_DEFAULT_CAP;
+    Message **items = malloc(count * sizeof(Message *));
+    for (size_t i = 0; i < count; i++) {
+        items[i] = concurrent_pool_alloc(&p);
+        items[i]->id = i;
+    }
+    assert(p.pool.capacity >= count + 2);
+    for (size_t i = 0; i < count; i++) assert(items[i]->id == i);
+    for (size_t i = 0; i < count; i++) concurrent_pool_dealloc(&p, items[i]);
+    size_t capacity = p.pool.capacity;
+    for (size_t i = 0; i < count; i++) items[i] = concurrent_pool_alloc(&p);
+    assert(p.pool.capacity == capacity);
+    free(items);
+    concurrent_pool_free(&p);
+
+    // items allocated by one thread and freed by another are reused
+    pool_producer_consumer(Pool_Concurrent, 2, 200000);
+}
+
+// Producer threads allocating messages and handing them to consumer threads which free them,
+// with a concurrent pool, a pool shared behind a lock, and malloc
+void profile_concurrent_pool() {
+    size_t count = 1 << 21;
+    size_t max_pairs = max_of(thread_cpu_count() / 2, (size_t)4);
+    printf("cpus: %zu\n", thread_cpu_count());
+    printf("pairs,concurrent pool (M items/s),locked pool (M items/s),malloc (M items/s)\n");
+    for (size_t pairs = 1; pairs <= max_pairs; pairs *= 2) {
+        double rates[3] = {0};
+        for (int kind = 0; kind < 3; kind++) {
+            uint64_t best = UINT64_MAX;
+            for (int run = 0; run < 3; run++) best = min_of(best, pool_producer_consumer(kind, pairs, count));
+            rates[kind] = (double)(pairs * count) / ((double)best / NS) / 1e6;
+        }
+        printf("%zu,%.1f,%.1f,%.1f\n", pairs, rates[Pool_Concurrent], rates[Pool_Locked], rates[Pool_Malloc]);
+    }
+}
 
 int main() {
+    // profile_concurrent_pool();
+    // profile_pool_foreach();
+    // profile_pool_growth();
     Temp tmp = arena_temp();
     Arena *a = tmp.arena;
 
@@ -105,6 +368,54 @@ int main() {
         pool_reset(&p);
     }
 
+    {
+        // the pool grows past its first chunk, without moving the existing items
+        PoolAlloc(size_t) p = {.capacity = 16};
+        size_t count = 1000;
+        size_t **nums = arena_push(a, size_t *, count);
+        for (size_t i = 0; i < count; i++) {
+            nums[i] = pool_alloc(a, &p);
+            *nums[i] = i;
+        }
+        assert(p.length == count);
+        assert(p.chunk_count == 6 && p.chunks[0]->capacity == 16 && p.chunks[1]->capacity == 32);
+        assert(p.capacity == 16 + 32 + 64 + 128 + 256 + 512);
+        for (size_t i = 0; i < count; i++) assert(*nums[i] == i);
+
+        for (size_t i = 0; i < count; i += 2) unused(pool_dealloc(&p, nums[i]));
+        size_t seen = 0, sum = 0;
+        pool_foreach(&p, num) {
+            assert(*num % 2 == 1);
+            seen++;
+            sum += *num;
+        }
+        assert(seen == count / 2 && sum == (count / 2) * (count / 2));
+
+        // breaking out of the loop stops it in all the chunks
+        seen = 0;
+        pool_foreach(&p, num) {
+            if (*num > 100) break;
+            seen++;
+        }
+        assert(seen == 50);
+
+        // freed items are reused before the pool grows again
+        size_t capacity = p.capacity;
+        for (size_t i = 0; i < count / 2; i++) pool_alloc(a, &p);
+        assert(p.capacity == capacity && p.length == count);
+
+        // resetting keeps the chunks
+        pool_reset(&p);
+        assert(p.length == 0 && p.capacity == capacity);
+        pool_foreach(&p, num) { unused(num); assert(false); }
+        size_t *first = pool_alloc(a, &p);
+        assert((byte *)first > p.chunks[0]->items && (byte *)first < p.chunks[0]->items + 64);
+        for (size_t i = 0; i < count; i++) pool_alloc(a, &p);
+        assert(p.capacity == capacity);
+        pool_reset(&p);
+    }
+
     arena_temp_release(tmp);
+    test_concurrent_pool();
     return 0;
 }
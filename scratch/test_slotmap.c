@@ -0,0 +1,194 @@
+#include "migi.h"
+#include "slotmap.h"
+#include "pool_allocator.h"
+#include "hashmap.h"
+#include "random.h"
+#include "timing.h"
+#include "repetition_tester.h"
+
+void test_basic() {
+    Arena *a = arena_init();
+    SlotMap(Str) sm = {0};
+    assert(slotmap_at(&sm, (SlotHandle){0}) == NULL);
+
+    SlotHandle foo = slotmap_insert(a, &sm, S("foo"));
+    SlotHandle bar = slotmap_insert(a, &sm, S("bar"));
+    SlotHandle baz = slotmap_insert(a, &sm, S("baz"));
+    assert(sm.length == 3);
+    assert(str_eq(*slotmap_at(&sm, foo), S("foo")));
+    assert(str_eq(*slotmap_at(&sm, bar), S("bar")));
+    assert(str_eq(*slotmap_at(&sm, baz), S("baz")));
+    // a zeroed handle never refers to anything
+    assert(!slotmap_contains(&sm, (SlotHandle){0}));
+
+    // the last value is moved into the place of the removed one
+    assert(slotmap_remove(&sm, foo));
+    assert(!slotmap_remove(&sm, foo));
+    assert(sm.length == 2 && str_eq(sm.values[0], S("baz")));
+    assert(slotmap_at(&sm, foo) == NULL && !slotmap_contains(&sm, foo));
+    assert(str_eq(*slotmap_at(&sm, baz), S("baz")));
+    assert(str_eq(*slotmap_at(&sm, bar), S("bar")));
+
+    // the slot is reused, but the old handle still doesn't match it
+    SlotHandle qux = slotmap_insert(a, &sm, S("qux"));
+    assert(qux.index == foo.index && qux.generation != foo.generation);
+    assert(slotmap_at(&sm, foo) == NULL);
+    assert(str_eq(*slotmap_at(&sm, qux), S("qux")));
+
+    size_t seen = 0;
+    slotmap_foreach(&sm, value) {
+        SlotHandle h = slotmap_handle(&sm, value);
+        assert(slotmap_at(&sm, h) == value);
+        seen++;
+    }
+    assert(seen == 3);
+
+    slotmap_clear(&sm);
+    assert(sm.length == 0);
+    assert(!slotmap_contains(&sm, bar) && !slotmap_contains(&sm, baz) && !slotmap_contains(&sm, qux));
+    SlotHandle again = slotmap_insert(a, &sm, S("again"));
+    assert(str_eq(*slotmap_at(&sm, again), S("again")) && sm.slot_count == 3);
+
+    slotmap_free(&sm);
+    arena_free(a);
+}
+
+// Random inserts and removals, checked against a plain array of what should be in the slotmap
+void test_churn() {
+    Arena *a = arena_init();
+    SlotMap(uint64_t) sm = {0};
+    size_t count = 10000;
+    SlotHandle *handles = arena_push(a, SlotHandle, count);
+    SlotHandle *stale = arena_push(a, SlotHandle, count);
+    bool *live = arena_push(a, bool, count);
+    size_t live_count = 0;
+
+    for (size_t n = 0; n < 200000; n++) {
+        size_t i = rand_random() % count;
+        if (live[i]) {
+            assert(slotmap_remove(&sm, handles[i]));
+            stale[i] = handles[i];
+            live[i] = false;
+            live_count--;
+        } else {
+            handles[i] = slotmap_insert(a, &sm, (uint64_t)i);
+            live[i] = true;
+            live_count++;
+        }
+    }
+    assert(sm.length == live_count);
+    for (size_t i = 0; i < count; i++) {
+        if (live[i]) assert(*slotmap_at(&sm, handles[i]) == i);
+        if (stale[i].generation != 0) assert(slotmap_at(&sm, stale[i]) == NULL);
+    }
+    size_t seen = 0;
+    slotmap_foreach(&sm, value) {
+        assert(live[*value]);
+        assert(slotmap_handle(&sm, value).index == handles[*value].index);
+        seen++;
+    }
+    assert(seen == live_count);
+
+    slotmap_free(&sm);
+    arena_free(a);
+}
+
+
+typedef struct { uint64_t id; float position[3], velocity[3]; byte rest[32]; } Entity;
+
+static double min_ns(Tester *t, size_t count) {
+    return (double)t->stats[StatsTime].min / (double)t->cpu_freq * 1e9 / (double)count;
+}
+
+// Entities referred to by ids, either stored in a slotmap with handles as the ids, or in a pool
+// with a hashmap from ids to the entities to check whether an id is still valid (which is what
+// we did before). A quarter of the entities are destroyed, and the lookups use random ids from
+// all the ones ever handed out, so a quarter of them are stale.
+// Also, iterating over all the live entities (a linear scan for the slotmap, and pool_foreach
+// for the pool).
+void profile_slotmap() {
+    uint64_t cpu_freq = estimate_cpu_timer_freq();
+    size_t counts[] = {1 << 10, 1 << 16, 1 << 20};
+    size_t lookups = 1 << 22;
+
+    printf("entities,slotmap lookup (ns),pool+hashmap lookup (ns),slotmap iterate (ns),pool iterate (ns)\n");
+    for (size_t c = 0; c < array_len(counts); c++) {
+        size_t count = counts[c];
+        Arena *a = arena_init(.reserve_size = 4*GB);
+
+        SlotMap(Entity) sm = {0};
+        PoolAlloc(Entity) pool = {0};
+        HashMap(uint64_t, Entity *) ids = {0};
+        SlotHandle *handles = arena_push(a, SlotHandle, count);
+        for (size_t i = 0; i < count; i++) {
+            handles[i] = slotmap_insert(a, &sm, ((Entity){ .id = i }));
+            Entity *e = pool_alloc(a, &pool);
+            e->id = i;
+            hashmap_put(a, &ids, (uint64_t)i, e);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (rand_random() % 4 == 0) {
+                slotmap_remove(&sm, handles[i]);
+                unused(pool_dealloc(&pool, hashmap_del(&ids, (uint64_t)i)));
+            }
+        }
+        size_t *picks = arena_push(a, size_t, lookups);
+        for (size_t i = 0; i < lookups; i++) picks[i] = rand_random() % count;
+
+        Tester sm_lookup = tester_init_with_name("slotmap lookup", 2, cpu_freq, lookups);
+        Tester pool_lookup = tester_init_with_name("pool lookup", 2, cpu_freq, lookups);
+        Tester sm_iterate = tester_init_with_name("slotmap iterate", 2, cpu_freq, sm.length);
+        Tester pool_iterate = tester_init_with_name("pool iterate", 2, cpu_freq, pool.length);
+        volatile uint64_t sink = 0;
+
+        while (!sm_lookup.finished) {
+            tester_begin(&sm_lookup);
+            uint64_t sum = 0;
+            for (size_t i = 0; i < lookups; i++) {
+                Entity *e = slotmap_at(&sm, handles[picks[i]]);
+                if (e) sum += e->id;
+            }
+            sink += sum;
+            tester_end(&sm_lookup);
+        }
+        while (!pool_lookup.finished) {
+            tester_begin(&pool_lookup);
+            uint64_t sum = 0;
+            for (size_t i = 0; i < lookups; i++) {
+                Entity *e = hashmap_get(&ids, (uint64_t)picks[i]);
+                if (e) sum += e->id;
+            }
+            sink += sum;
+            tester_end(&pool_lookup);
+        }
+        while (!sm_iterate.finished) {
+            tester_begin(&sm_iterate);
+            uint64_t sum = 0;
+            slotmap_foreach(&sm, e) sum += e->id;
+            sink += sum;
+            tester_end(&sm_iterate);
+        }
+        while (!pool_iterate.finished) {
+            tester_begin(&pool_iterate);
+            uint64_t sum = 0;
+            pool_foreach(&pool, e) sum += e->id;
+            sink += sum;
+            tester_end(&pool_iterate);
+        }
+
+        printf("%zu,%.2f,%.2f,%.2f,%.2f\n", count,
+               min_ns(&sm_lookup, lookups), min_ns(&pool_lookup, lookups),
+               min_ns(&sm_iterate, sm.length), min_ns(&pool_iterate, pool.length));
+        arena_free(a);
+    }
+}
+
+
+int main() {
+    // profile_slotmap();
+    test_basic();
+    test_churn();
+
+    printf("\nexiting successfully\n");
+    return 0;
+}
@@ -7,6 +7,7 @@
 
 #include "migi_core.h"
 #include "migi_math.h"
+#include "migi_thread.h"
 
 // TODO: Add a memory debugger mode which puts blocks of poisoned regions between each allocation to catch overflows
 // The only issue is that it should be configurable on a per allocation basis, since certain functions (eg. sb_push)
@@ -18,8 +19,14 @@
     #define arena__reserve(size)        (malloc((size)))
     #define arena__commit(mem, size)    (unused((mem)), unused((size)))
     #define arena__decommit(mem, size)  (unused((mem)), unused((size)))
+    #define arena__decommit_lazy(mem, size) (unused((mem)), unused((size)))
     #define arena__release(mem, size)   (free((mem)))
 
+    // huge pages and populating are up to malloc
+    #define arena__reserve_huge(size, use_hugetlb)  (unused((use_hugetlb)), malloc((size)))
+    #define arena__commit_populate(mem, size)       (unused((mem)), unused((size)))
+    #define arena__huge_page_size()                 (16)
+
     // NOTE: On GCC/Clang, `align_of(max_align_t)` is 16 (probably due
     // to `long double`), however MSVC doesnt define max_align_t, but the
     // maximum possible alignment is 8 (due to `double`).
@@ -31,36 +38,156 @@
     #define arena__reserve(size)        memory_reserve(size)
     #define arena__commit(mem, size)    memory_commit(mem, size)
     #define arena__decommit(mem, size)  memory_decommit(mem, size)
+    #define arena__decommit_lazy(mem, size) memory_decommit_lazy(mem, size)
     #define arena__release(mem, size)   memory_release(mem, size)
     #define arena__alignment()          memory_page_size()
+
+    #define arena__reserve_huge(size, use_hugetlb)  memory_reserve_huge(size, use_hugetlb)
+    #define arena__commit_populate(mem, size)       memory_commit_populate(mem, size)
+    #define arena__huge_page_size()                 MEMORY_HUGE_PAGE_SIZE
+#endif
+
+// File arenas need memory mapped files, which are only implemented on Linux
+#if !defined(ARENA_USE_MALLOC) && !OS_WINDOWS
+    #define ARENA_HAS_FILES
+#endif
+
+#ifdef ARENA_HAS_FILES
+    #define arena__commit_file(file, offset, size)  memory_commit_file(file, offset, size)
+    #define arena__release_file(arena)              (memory_close_file((arena)->file), memory_release((arena), (arena)->reserved))
+#else
+    // file arenas can't be created, so nothing is ever done with a file
+    #define arena__commit_file(file, offset, size)  (unused((file)), unused((offset)), unused((size)))
+    #define arena__release_file(arena)              (unused((arena)))
 #endif
 
 #ifndef ARENA_DEFAULT_RESERVE_SIZE
     #define ARENA_DEFAULT_RESERVE_SIZE 256*MB
 #endif
 
+// Only address space, since file arenas are never moved once created
+#ifndef ARENA_DEFAULT_FILE_RESERVE_SIZE
+    #define ARENA_DEFAULT_FILE_RESERVE_SIZE 64*GB
+#endif
+
+// Shared memory arenas are mapped one after another from this address, which is far away from where
+// Linux puts everything else (on x86-64 and ARM64 with 48 bit addresses), so that the same address is
+// almost always free in child processes as well. Any address is used if all of those are taken
+#ifndef ARENA_SHARED_MEMORY_BASE
+    #define ARENA_SHARED_MEMORY_BASE 0x200000000000ull
+#endif
+
 #ifndef ARENA_DEFAULT_COMMIT_SIZE
     #define ARENA_DEFAULT_COMMIT_SIZE 1*MB
 #endif
 
+// Memory below this size is never decommitted by popping or rewinding the arena
+// (in addition to the part of the last commit_size chunk which is still in use), so that
+// code which keeps saving, pushing and rewinding doesn't pay for a decommit and then page
+// faults and a commit every single time. Can be set per arena with `.keep_committed`
+#ifndef ARENA_DEFAULT_KEEP_COMMITTED
+    #define ARENA_DEFAULT_KEEP_COMMITTED 0
+#endif
+
+// The thread local temporary arenas are almost always used like that, so they keep more
+#ifndef ARENA_TEMP_KEEP_COMMITTED
+    #define ARENA_TEMP_KEEP_COMMITTED 4*MB
+#endif
+
+// Defaults for the temporary arenas, which can be changed for each thread with arena_temp_set_options
+#ifndef ARENA_TEMP_RESERVE_SIZE
+    #define ARENA_TEMP_RESERVE_SIZE ARENA_DEFAULT_RESERVE_SIZE
+#endif
+
+// Most code only needs 2 temporary arenas (one for the result and one for scratch memory), but a
+// function which is passed more than one of them needs another, so more are created when required,
+// up to this many per thread. arena_temp_excluding returns an empty Temp if all of them conflict
+#ifndef ARENA_TEMP_MAX_COUNT
+    #define ARENA_TEMP_MAX_COUNT 8
+#endif
+
+// Define ARENA_LAZY_DECOMMIT to never decommit memory, and instead let the OS take back the
+// pages above the kept region whenever it needs to (see memory_decommit_lazy). Popping or
+// rewinding is then a single madvise, and no page faults happen if the pages weren't taken
+// in the meantime, but the memory is counted as used by the process until they are.
+// The memory stays part of the committed region, so zeroed pushes still clear it as usual
+
+// Chained arenas start with a small block, and each new block is twice as large as the
+// previous one, up to ARENA_CHAINED_MAX_BLOCK_SIZE (unless a single allocation needs more)
+#ifndef ARENA_CHAINED_FIRST_BLOCK_SIZE
+    #define ARENA_CHAINED_FIRST_BLOCK_SIZE 64*KB
+#endif
+
+#ifndef ARENA_CHAINED_MAX_BLOCK_SIZE
+    #define ARENA_CHAINED_MAX_BLOCK_SIZE ARENA_DEFAULT_RESERVE_SIZE
+#endif
+
+// Number of blocks of chained arenas which are kept around for reuse by each thread,
+// instead of being released back to the OS when they are popped, rewound, reset or freed
+// Define as 0 to always release the blocks
+#ifndef ARENA_MAX_FREE_BLOCKS
+    #define ARENA_MAX_FREE_BLOCKS 16
+#endif
+
+// The kept blocks are decommitted down to their first commit_size chunk (or keep_committed), so
+// that reusing them usually doesn't need any system calls, and at most this many bytes of them
+// stay committed per thread. Blocks which would go over it are released instead
+#ifndef ARENA_MAX_FREE_BYTES
+    #define ARENA_MAX_FREE_BYTES 32*MB
+#endif
+
 
 // NOTE: The default type is Linear
+//
+// A Shared arena is a linear arena which any number of threads can push onto at the same time.
+// The position is advanced with an atomic add (or a compare and swap for alignments larger than
+// ARENA_SHARED_ALIGN), and threads which go past the committed region commit it themselves,
+// with another compare and swap publishing the new committed size.
+// Every allocation is rounded up to ARENA_SHARED_ALIGN bytes, so that the position always stays
+// aligned to it, and allocations are never extended in place by arena_realloc.
+// NOTE: only pushing is thread-safe, arena_save can be called at any time, but popping, rewinding,
+// resetting and freeing must only be done while no other thread is using the arena
+//
+// A File arena is a linear arena stored in a file (see arena_open_file), which is not available on Windows
 typedef enum {
     Arena_Linear = 0,
     Arena_Chained,
     Arena_Static,
+    Arena_Shared,
+    Arena_File,
 } ArenaType;
 
+#define ARENA_SHARED_ALIGN 16
+
+// Large arenas which are accessed all over the place (eg. big hash tables) spend a lot of
+// time on TLB misses with 4 KB pages, which huge pages (of MEMORY_HUGE_PAGE_SIZE) avoid.
+// With huge pages, the reservation is aligned to the huge page size, and the reserve and commit
+// sizes are rounded up to it, so that every commit is made up of whole huge pages.
+// Arena_HugePagesExplicit uses the preallocated pool of huge pages (MAP_HUGETLB on Linux), and falls
+// back to transparent huge pages (MADV_HUGEPAGE) if the pool doesn't have enough free pages
+typedef enum {
+    Arena_NoHugePages = 0,
+    Arena_HugePages,
+    Arena_HugePagesExplicit,
+} ArenaHugePages;
+
 typedef struct Arena Arena;
 struct Arena {
-    ArenaType type;
+    uint8_t type;                   // ArenaType
+    uint8_t huge_pages;             // ArenaHugePages
+    bool populate;
+    bool spill;                     // static arena which spills into chained blocks
+    uint32_t keep_committed_kb;     // see ARENA_DEFAULT_KEEP_COMMITTED
 
     size_t position;
     size_t committed;
     size_t reserved;
 
     size_t commit_size;
-    size_t reserve_size;
+    union {
+        size_t reserve_size;
+        int file;               // file descriptor of a file arena
+    };
 
     Arena *prev;
     Arena *current;
@@ -71,6 +198,9 @@ typedef struct {
     size_t commit_size;
     size_t reserve_size;
     size_t type;
+    size_t keep_committed;  // rounded up to commit_size, and stored in KB (so at most 4 TB)
+    size_t huge_pages;      // ArenaHugePages
+    bool populate;          // fault in memory as soon as it is committed, rather than on first access
 } ArenaOptions;
 
 typedef struct {
@@ -79,25 +209,163 @@ typedef struct {
     size_t position;
 } Temp;
 
-#define arena_init(...)                             \
-    arena__init((ArenaOptions){                     \
-        .commit_size = ARENA_DEFAULT_COMMIT_SIZE,   \
-        .reserve_size = ARENA_DEFAULT_RESERVE_SIZE, \
-        .type = Arena_Linear,                       \
-        __VA_ARGS__                                 \
+// Define ARENA_STATS to keep track of how each arena is used, which can then be printed with
+// arena_print_stats. The stats are kept in a global table (so the header stays the same), which is
+// updated under a lock on every push, pop, realloc, commit and decommit. The push, copy and realloc
+// macros also record the file and line they are called from, in order to report the bytes
+// allocated by each call site (allocations made by calling the functions directly show up as "?")
+// When it isn't defined, none of this exists and nothing is done
+#ifdef ARENA_STATS
+    // NOTE: arenas beyond this many at once aren't tracked
+    #ifndef ARENA_STATS_MAX_ARENAS
+        #define ARENA_STATS_MAX_ARENAS 256
+    #endif
+    // Per arena, the bytes from any call sites beyond this many are only counted in the total
+    #ifndef ARENA_STATS_MAX_CALLSITES
+        #define ARENA_STATS_MAX_CALLSITES 64
+    #endif
+    static_assert((ARENA_STATS_MAX_ARENAS & (ARENA_STATS_MAX_ARENAS - 1)) == 0, "ARENA_STATS_MAX_ARENAS must be a power of 2");
+    static_assert((ARENA_STATS_MAX_CALLSITES & (ARENA_STATS_MAX_CALLSITES - 1)) == 0, "ARENA_STATS_MAX_CALLSITES must be a power of 2");
+
+    typedef struct {
+        const char *file;
+        int line;
+        size_t bytes;
+        size_t count;
+    } ArenaCallsite;
+
+    typedef struct {
+        Arena *arena;               // the first block of the arena
+        size_t peak;                // highest number of bytes in use at once, across all blocks
+        size_t commits;             // number of commit and decommit calls, including the
+        size_t decommits;           // initial commit of each block
+        size_t alignment_waste;     // bytes skipped over to align allocations
+        size_t blocks;              // blocks of a chained arena
+        size_t peak_blocks;
+        size_t allocations;
+        size_t bytes;               // bytes pushed in total, including those added by realloc
+        ArenaCallsite callsites[ARENA_STATS_MAX_CALLSITES];
+    } ArenaStats;
+
+    SpinLock MIGI_ARENA_STATS_LOCK = {0};
+    ArenaStats MIGI_ARENA_STATS[ARENA_STATS_MAX_ARENAS] = {0};
+    threadvar const char *MIGI_ARENA_CALLSITE_FILE = NULL;
+    threadvar int MIGI_ARENA_CALLSITE_LINE = 0;
+
+    #define arena__callsite() (MIGI_ARENA_CALLSITE_FILE = __FILE__, MIGI_ARENA_CALLSITE_LINE = __LINE__),
+#else
+    #define arena__callsite()
+#endif
+
+// Prints the stats of an arena (only the current usage if ARENA_STATS isn't defined)
+static void arena_print_stats(Arena *arena);
+
+// NOTE: the default reserve size depends on the type of the arena, ARENA_DEFAULT_RESERVE_SIZE for
+// linear arenas and ARENA_CHAINED_FIRST_BLOCK_SIZE for chained ones
+#define arena_init(...)                                 \
+    arena__init((ArenaOptions){                         \
+        .commit_size = ARENA_DEFAULT_COMMIT_SIZE,       \
+        .type = Arena_Linear,                           \
+        .keep_committed = ARENA_DEFAULT_KEEP_COMMITTED, \
+        __VA_ARGS__                                     \
     }, NULL, 0)
 
 static Arena *arena_init_static(void *backing_buffer, size_t backing_buffer_size);
+
+// Same as arena_init_static, except that once the buffer is full, the arena continues in blocks of
+// memory from the OS, like a chained arena (starting at ARENA_CHAINED_FIRST_BLOCK_SIZE), instead of
+// running out of memory. Popping or rewinding back into the buffer releases those blocks again
+static Arena *arena_init_static_spill(void *backing_buffer, size_t backing_buffer_size);
 static void arena_free(Arena *arena);
 
+// Opens a file arena, creating the file if it doesn't exist
+//
+// The file is mapped into memory, and everything pushed onto the arena is written back to it by the OS,
+// so opening the file again later (from the same or another process) gives back the same contents,
+// without reading or rebuilding any of it. Committing memory grows the file, and popping or
+// rewinding never shrinks it. The header of the arena is at the start of the file, so the first
+// allocation is always at `arena->data`, which is where the root of whatever is stored should go.
+// Only `commit_size` and `reserve_size` are used from the options, and the reserve size
+// is the largest the file can grow to until it is opened again with a larger one
+//
+// The memory is mapped at a different address every time, so anything within the arena must refer to
+// the rest of it with relative pointers (see RelPtr) or offsets, rather than plain pointers
+// Returns NULL if the file couldn't be opened, or isn't a file arena
+// NOTE: Not available on Windows or with ARENA_USE_MALLOC (see ARENA_HAS_FILES),
+// and the file must not be opened by two processes at once
+#ifdef ARENA_HAS_FILES
+#define arena_open_file(path, ...)                          \
+    arena__open_file((path), (ArenaOptions){                \
+        .commit_size = ARENA_DEFAULT_COMMIT_SIZE,           \
+        .reserve_size = ARENA_DEFAULT_FILE_RESERVE_SIZE,    \
+        __VA_ARGS__                                         \
+    })
+
+// Blocks until the contents of a file arena are on the disk
+// arena_free doesn't wait for that, although the OS still writes everything out eventually
+static void arena_flush(Arena *arena);
+
+// Creates a file arena in memory which can be shared with child processes (see cmd_push_arena)
+// Everything else is the same as with arena_open_file
+#define arena_init_shared_memory(...)                       \
+    arena__init_shared_memory((ArenaOptions){               \
+        .commit_size = ARENA_DEFAULT_COMMIT_SIZE,           \
+        .reserve_size = ARENA_DEFAULT_FILE_RESERVE_SIZE,    \
+        __VA_ARGS__                                         \
+    })
+
+// Maps a file arena which was created by the parent process, given the file descriptor that it
+// was inherited through. The arena is mapped at the same address as in the parent, so everything
+// within it (including plain pointers) can be used as is, by both processes, without any copying
+// Returns NULL if the file isn't a file arena, or the address is already in use in this process
+// NOTE: only one of the processes should use the arena at a time (eg. the parent waits on the child)
+// Both can push onto it, since all of the header is shared, apart from the mapping itself
+static Arena *arena_open_shared(int file);
+#endif
+
+// A pointer stored as the distance from itself to what it points to, so that it stays valid
+// wherever the memory holding both of them is mapped (or copied) to, like in a file arena
+// NOTE: it can't point to itself, since a distance of 0 means NULL
+#define RelPtr(type)    \
+    union {             \
+        type *_type;    \
+        int64_t offset; \
+    }
+
+#define relptr_get(rel) ((type_of((rel)->_type))relptr__get(&(rel)->offset))
+#define relptr_set(rel, ptr) relptr__set(&(rel)->offset, check_type(type_of(*(rel)->_type), (ptr)))
+
+static void *relptr__get(int64_t *offset) {
+    return *offset? (void *)((uintptr_t)offset + (uintptr_t)*offset): NULL;
+}
+
+static void relptr__set(int64_t *offset, void *ptr) {
+    *offset = ptr? (int64_t)((uintptr_t)ptr - (uintptr_t)offset): 0;
+}
+
+// Str with a relative pointer to the data
+typedef struct {
+    RelPtr(char) data;
+    size_t length;
+} RelStr;
+
+static Str relstr_get(RelStr *rel) {
+    return (Str){ relptr_get(&rel->data), rel->length };
+}
+
+static void relstr_set(RelStr *rel, Str str) {
+    relptr_set(&rel->data, str.data);
+    rel->length = str.length;
+}
+
 #define arena_new(arena, type) \
-    (type *)arena_push_bytes_opt((arena), sizeof(type), align_of(type), (ArenaPushOpt){ .zeroed=true })
+    (arena__callsite() (type *)arena_push_bytes_opt((arena), sizeof(type), align_of(type), (ArenaPushOpt){ .zeroed=true }))
 
 #define arena_push(arena, type, length, ...) \
-    (type *)arena_push_bytes_opt((arena), (length)*sizeof(type), align_of(type), (ArenaPushOpt){ .zeroed=true, __VA_ARGS__})
+    (arena__callsite() (type *)arena_push_bytes_opt((arena), (length)*sizeof(type), align_of(type), (ArenaPushOpt){ .zeroed=true, __VA_ARGS__}))
 
 #define arena_push_bytes(arena, size, align, ...) \
-    arena_push_bytes_opt((arena), (size), (align), (ArenaPushOpt){ .zeroed=true, __VA_ARGS__})
+    (arena__callsite() arena_push_bytes_opt((arena), (size), (align), (ArenaPushOpt){ .zeroed=true, __VA_ARGS__}))
 
 #define arena_pop(arena, type, length) \
     arena_pop_bytes((arena), (length)*sizeof(type));
@@ -111,12 +379,12 @@ static void *arena_push_bytes_opt(Arena *arena, size_t size, size_t align, Arena
 static void arena_pop_bytes(Arena *arena, size_t size);
 
 #define arena_realloc(arena, type, old, old_length, new_length) \
-    (type *)arena_realloc_bytes((arena), (old), (old_length)*sizeof(type), (new_length)*sizeof(type), align_of(type))
+    (arena__callsite() (type *)arena_realloc_bytes((arena), (old), (old_length)*sizeof(type), (new_length)*sizeof(type), align_of(type)))
 
 static void *arena_realloc_bytes(Arena *arena, void *old, size_t old_size, size_t new_size, size_t align);
 
 #define arena_copy(arena, type, mem, length) \
-    (type *)arena_copy_bytes((arena), (void *)(mem), (length)*sizeof(type), align_of(type))
+    (arena__callsite() (type *)arena_copy_bytes((arena), (void *)(mem), (length)*sizeof(type), align_of(type)))
 
 static void *arena_copy_bytes(Arena *arena, void *mem, size_t size, size_t align);
 
@@ -136,11 +404,56 @@ static void arena_rewind(Temp checkpoint);
 
 // Thread local global arenas
 // Each is alternated between being the "main" and "temporary" storage
-// 2 arenas are enough for most cases
-threadvar Arena *MIGI_GLOBAL_TEMP_ARENAS[2] = {0};
+// They are created when first needed, so usually only the first 2 ever exist
+threadvar Arena *MIGI_GLOBAL_TEMP_ARENAS[ARENA_TEMP_MAX_COUNT] = {0};
 static Temp arena_temp_excluding(Arena **conflicts, size_t conflicts_length);
 static void arena_temp_release(Temp c);
 
+// Options used for the temporary arenas of the current thread, when they are created
+threadvar ArenaOptions MIGI_ARENA_TEMP_OPTIONS = {
+    .commit_size = ARENA_DEFAULT_COMMIT_SIZE,
+    .reserve_size = ARENA_TEMP_RESERVE_SIZE,
+    .type = Arena_Linear,
+    .keep_committed = ARENA_TEMP_KEEP_COMMITTED,
+};
+
+// Highest number of bytes used in each temporary arena of the current thread, as seen by
+// arena_temp_release, and the number of times that all of them conflicted
+threadvar size_t MIGI_ARENA_TEMP_HIGH_WATER[ARENA_TEMP_MAX_COUNT] = {0};
+threadvar size_t MIGI_ARENA_TEMP_EXHAUSTED = 0;
+
+// Sets the options of the temporary arenas of the current thread (eg. a smaller reserve size for
+// threads which only need a little scratch memory), which apply to the arenas created afterwards
+#define arena_temp_set_options(...)                     \
+    (MIGI_ARENA_TEMP_OPTIONS = (ArenaOptions){          \
+        .commit_size = ARENA_DEFAULT_COMMIT_SIZE,       \
+        .reserve_size = ARENA_TEMP_RESERVE_SIZE,        \
+        .type = Arena_Linear,                           \
+        .keep_committed = ARENA_TEMP_KEEP_COMMITTED,    \
+        __VA_ARGS__                                     \
+    })
+
+// Prints how many temporary arenas the current thread has, and the high-water mark of each
+static void arena_temp_print_stats();
+
+// Frees the temporary arenas of the current thread, and resets their high-water marks
+// NOTE: must not be called while any of them is in use, and the arenas
+// are not freed automatically when a thread exits
+static void arena_temp_free();
+
+// Blocks of chained arenas waiting to be reused, linked through their `prev`
+threadvar Arena *MIGI_ARENA_FREE_BLOCKS = NULL;
+threadvar size_t MIGI_ARENA_FREE_BLOCKS_COUNT = 0;
+threadvar size_t MIGI_ARENA_FREE_BLOCKS_BYTES = 0;  // committed memory of the free blocks
+threadvar bool MIGI_ARENA_FREE_BLOCKS_HOOKED = false;
+
+// Release all the free blocks kept by the current thread
+// This is done automatically when a thread which kept any blocks exits (see ThreadExitHook),
+// so it only needs to be called to give back the memory earlier
+static void arena_release_free_blocks();
+
+ThreadExitHook MIGI_ARENA_FREE_BLOCKS_EXIT_HOOK = { .fn = arena_release_free_blocks };
+
 
 // Convenience macros
 // MSVC doesnt support empty compound literals, so these need to be separate
@@ -158,26 +471,331 @@ static void arena_temp_release(Temp c);
         sizeof((Arena *[]){ __VA_ARGS__ }) / sizeof(Arena *))
 
 
+// Takes the first free block which is at least `reserve_size` bytes, with the same kind of pages
+static Arena *arena__take_free_block(size_t reserve_size, size_t huge_pages, bool populate) {
+    for (Arena **link = &MIGI_ARENA_FREE_BLOCKS; *link; link = &(*link)->prev) {
+        Arena *block = *link;
+        if (block->reserved >= reserve_size && block->huge_pages == huge_pages && block->populate == populate) {
+            *link = block->prev;
+            MIGI_ARENA_FREE_BLOCKS_COUNT--;
+            MIGI_ARENA_FREE_BLOCKS_BYTES -= block->committed;
+            memory_unpoison(block, sizeof(Arena));
+            return block;
+        }
+    }
+    return NULL;
+}
+
+// Puts a block of a chained arena on the free list, or releases it if the list is full
+static void arena__release_block(Arena *block) {
+#if ARENA_MAX_FREE_BLOCKS > 0
+    if (block->type == Arena_Chained && MIGI_ARENA_FREE_BLOCKS_COUNT < ARENA_MAX_FREE_BLOCKS) {
+        size_t keep = max_of(block->commit_size, (size_t)block->keep_committed_kb * KB);
+        keep = clamp_top(keep, block->committed);
+        size_t committed = block->committed;
+#ifndef ARENA_LAZY_DECOMMIT
+        committed = keep;
+#endif
+        if (MIGI_ARENA_FREE_BLOCKS_BYTES + committed <= ARENA_MAX_FREE_BYTES) {
+            if (block->committed > keep) {
+#ifdef ARENA_LAZY_DECOMMIT
+                arena__decommit_lazy((byte *)block + keep, block->committed - keep);
+#else
+                arena__decommit((byte *)block + keep, block->committed - keep);
+                block->committed = keep;
+#endif
+            }
+            if (!MIGI_ARENA_FREE_BLOCKS_HOOKED) {
+                thread_exit_hook_arm(&MIGI_ARENA_FREE_BLOCKS_EXIT_HOOK);
+                MIGI_ARENA_FREE_BLOCKS_HOOKED = true;
+            }
+            block->prev = MIGI_ARENA_FREE_BLOCKS;
+            MIGI_ARENA_FREE_BLOCKS = block;
+            MIGI_ARENA_FREE_BLOCKS_COUNT++;
+            MIGI_ARENA_FREE_BLOCKS_BYTES += block->committed;
+            memory_poison((byte *)block + sizeof(Arena), block->committed - sizeof(Arena));
+            return;
+        }
+    }
+#endif
+    // NOTE: If the memory is not unpoisoned before being released,
+    // then ASan still thinks it owns the memory, and if it is later
+    // mapped to some other process (most likely the C runtime itself
+    // during cleanup/shutdown), it will trip up ASan.
+    memory_unpoison(block, block->reserved);
+    arena__release(block, block->reserved);
+}
+
+static void arena_release_free_blocks() {
+    while (MIGI_ARENA_FREE_BLOCKS) {
+        Arena *block = MIGI_ARENA_FREE_BLOCKS;
+        MIGI_ARENA_FREE_BLOCKS = block->prev;
+        memory_unpoison(block, block->reserved);
+        arena__release(block, block->reserved);
+    }
+    MIGI_ARENA_FREE_BLOCKS_COUNT = 0;
+    MIGI_ARENA_FREE_BLOCKS_BYTES = 0;
+}
+
+#ifdef ARENA_STATS
+
+static size_t arena__stats_index(Arena *arena) {
+    return (size_t)(((uintptr_t)arena * 0x9E3779B97F4A7C15ull) >> 32) & (ARENA_STATS_MAX_ARENAS - 1);
+}
+
+// NOTE: must be called with the lock held, returns NULL if the arena isn't tracked
+static ArenaStats *arena__stats_find(Arena *arena) {
+    for (size_t i = arena__stats_index(arena), n = 0; n < ARENA_STATS_MAX_ARENAS; i = (i + 1) & (ARENA_STATS_MAX_ARENAS - 1), n++) {
+        if (MIGI_ARENA_STATS[i].arena == arena) return &MIGI_ARENA_STATS[i];
+        if (!MIGI_ARENA_STATS[i].arena) return NULL;
+    }
+    return NULL;
+}
+
+// NOTE: must be called with the lock held
+static void arena__stats_remove_locked(Arena *arena) {
+    ArenaStats *stats = arena__stats_find(arena);
+    if (!stats) return;
+
+    // shift back the entries after it, so that the probe sequences stay unbroken
+    size_t hole = stats - MIGI_ARENA_STATS;
+    for (size_t i = (hole + 1) & (ARENA_STATS_MAX_ARENAS - 1); MIGI_ARENA_STATS[i].arena; i = (i + 1) & (ARENA_STATS_MAX_ARENAS - 1)) {
+        size_t home = arena__stats_index(MIGI_ARENA_STATS[i].arena);
+        if (((i - home) & (ARENA_STATS_MAX_ARENAS - 1)) >= ((i - hole) & (ARENA_STATS_MAX_ARENAS - 1))) {
+            MIGI_ARENA_STATS[hole] = MIGI_ARENA_STATS[i];
+            hole = i;
+        }
+    }
+    mem_clear(&MIGI_ARENA_STATS[hole]);
+}
+
+static void arena__stats_init(Arena *arena, bool committed) {
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    // the memory of a freed arena may have been reused for this one
+    arena__stats_remove_locked(arena);
+    for (size_t i = arena__stats_index(arena), n = 0; n < ARENA_STATS_MAX_ARENAS; i = (i + 1) & (ARENA_STATS_MAX_ARENAS - 1), n++) {
+        if (!MIGI_ARENA_STATS[i].arena) {
+            MIGI_ARENA_STATS[i] = (ArenaStats){
+                .arena = arena,
+                .commits = committed,
+                .blocks = 1,
+                .peak_blocks = 1,
+            };
+            break;
+        }
+    }
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+}
+
+static void arena__stats_free(Arena *arena) {
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    arena__stats_remove_locked(arena);
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+}
+
+// A new block starts out being tracked like an arena of its own, which is merged into its arena
+static void arena__stats_add_block(Arena *arena, Arena *block) {
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    ArenaStats *block_stats = arena__stats_find(block);
+    size_t commits = block_stats? block_stats->commits: 0;
+    arena__stats_remove_locked(block);
+
+    ArenaStats *stats = arena__stats_find(arena);
+    if (stats) {
+        stats->commits += commits;
+        stats->blocks++;
+        stats->peak_blocks = max_of(stats->peak_blocks, stats->blocks);
+    }
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+}
+
+static void arena__stats_release_blocks(Arena *arena) {
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    ArenaStats *stats = arena__stats_find(arena);
+    if (stats) {
+        stats->blocks = 0;
+        for (Arena *block = arena->current; block; block = block->prev) stats->blocks++;
+    }
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+}
+
+static void arena__stats_commit(Arena *arena, size_t commits, size_t decommits) {
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    ArenaStats *stats = arena__stats_find(arena);
+    if (stats) {
+        stats->commits += commits;
+        stats->decommits += decommits;
+    }
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+}
+
+// Records `size` bytes allocated by the call site set by the last macro, if any
+static void arena__stats_push(Arena *arena, size_t size, size_t alignment_waste, bool new_allocation) {
+    const char *file = MIGI_ARENA_CALLSITE_FILE;
+    int line = MIGI_ARENA_CALLSITE_LINE;
+    MIGI_ARENA_CALLSITE_FILE = NULL;
+    MIGI_ARENA_CALLSITE_LINE = 0;
+
+    size_t used = 0;
+    for (Arena *block = arena->current; block; block = block->prev) {
+        used += atomic_load_relaxed(&block->position) - sizeof(Arena);
+    }
+
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    ArenaStats *stats = arena__stats_find(arena);
+    if (stats) {
+        stats->peak = max_of(stats->peak, used);
+        stats->alignment_waste += alignment_waste;
+        stats->allocations += new_allocation;
+        stats->bytes += size;
+
+        uintptr_t key = (uintptr_t)file ^ ((uintptr_t)line * 0x9E3779B97F4A7C15ull);
+        for (size_t i = (key >> 32) & (ARENA_STATS_MAX_CALLSITES - 1), n = 0; n < ARENA_STATS_MAX_CALLSITES;
+             i = (i + 1) & (ARENA_STATS_MAX_CALLSITES - 1), n++) {
+            ArenaCallsite *site = &stats->callsites[i];
+            if (site->count == 0 && site->bytes == 0) {
+                site->file = file;
+                site->line = line;
+            }
+            if (site->file == file && site->line == line) {
+                site->bytes += size;
+                site->count += new_allocation;
+                break;
+            }
+        }
+    }
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+}
+
+static void arena_print_stats(Arena *arena) {
+    static const char *type_names[] = {
+        [Arena_Linear]  = "linear",
+        [Arena_Chained] = "chained",
+        [Arena_Static]  = "static",
+        [Arena_Shared]  = "shared",
+        [Arena_File]    = "file",
+    };
+
+    size_t used = 0, committed = 0, reserved = 0;
+    for (Arena *block = arena->current; block; block = block->prev) {
+        used += block->position - sizeof(Arena);
+        committed += block->committed;
+        reserved += block->reserved;
+    }
+
+    spinlock_lock(&MIGI_ARENA_STATS_LOCK);
+    ArenaStats *found = arena__stats_find(arena);
+    ArenaStats stats = found? *found: (ArenaStats){0};
+    spinlock_unlock(&MIGI_ARENA_STATS_LOCK);
+
+    printf("%s arena %p:\n", type_names[arena->type], (void *)arena);
+    printf("    used: %zu bytes (peak %zu), committed: %zu, reserved: %zu\n", used, stats.peak, committed, reserved);
+    if (!found) {
+        printf("    (not tracked, increase ARENA_STATS_MAX_ARENAS)\n");
+        return;
+    }
+    printf("    commits: %zu, decommits: %zu\n", stats.commits, stats.decommits);
+    printf("    allocations: %zu (%zu bytes), alignment waste: %zu bytes\n",
+           stats.allocations, stats.bytes, stats.alignment_waste);
+    if (arena->type == Arena_Chained) {
+        printf("    blocks: %zu (peak %zu)\n", stats.blocks, stats.peak_blocks);
+    }
+
+    // call sites by the number of bytes allocated, largest first
+    ArenaCallsite sites[ARENA_STATS_MAX_CALLSITES] = {0};
+    size_t site_count = 0;
+    for (size_t i = 0; i < ARENA_STATS_MAX_CALLSITES; i++) {
+        if (stats.callsites[i].count == 0 && stats.callsites[i].bytes == 0) continue;
+        ArenaCallsite site = stats.callsites[i];
+        size_t j = site_count++;
+        for (; j > 0 && sites[j - 1].bytes < site.bytes; j--) sites[j] = sites[j - 1];
+        sites[j] = site;
+    }
+    size_t site_bytes = 0;
+    for (size_t i = 0; i < site_count; i++) {
+        printf("    %s:%d: %zu bytes in %zu allocations\n",
+               sites[i].file? sites[i].file: "?", sites[i].line, sites[i].bytes, sites[i].count);
+        site_bytes += sites[i].bytes;
+    }
+    if (site_bytes < stats.bytes) {
+        printf("    other call sites: %zu bytes\n", stats.bytes - site_bytes);
+    }
+}
+
+#else
+
+#define arena__stats_init(arena, committed) unused((committed))
+#define arena__stats_free(arena)
+#define arena__stats_add_block(arena, block)
+#define arena__stats_release_blocks(arena)
+#define arena__stats_commit(arena, commits, decommits)
+#define arena__stats_push(arena, size, alignment_waste, new_allocation) unused((alignment_waste))
+
+static void arena_print_stats(Arena *arena) {
+    size_t used = 0, committed = 0, reserved = 0;
+    for (Arena *block = arena->current; block; block = block->prev) {
+        used += block->position - sizeof(Arena);
+        committed += block->committed;
+        reserved += block->reserved;
+    }
+    printf("arena %p:\n", (void *)arena);
+    printf("    used: %zu bytes, committed: %zu, reserved: %zu\n", used, committed, reserved);
+    printf("    (define ARENA_STATS for more)\n");
+}
+
+#endif // ARENA_STATS
+
+// Commits the memory of a block from `start` to `end` (both offsets from the start of the block)
+static void arena__commit_range(Arena *block, size_t start, size_t end) {
+    if (block->type == Arena_File) arena__commit_file(block->file, start, end - start);
+    else if (block->populate) arena__commit_populate((byte *)block + start, end - start);
+    else arena__commit((byte *)block + start, end - start);
+}
+
 static Arena *arena__init(ArenaOptions opt, void *backing_buffer, size_t backing_buffer_size) {
     byte *mem = backing_buffer;
     size_t reserved = backing_buffer_size;
     size_t committed = backing_buffer_size;
     size_t reserve_size = backing_buffer_size;
     size_t commit_size = backing_buffer_size;
+    size_t keep_committed = 0;
+    bool fresh = false;
 
     // backing buffer was not provided
     if (!mem) {
-        // align to page size or max_align_t if using malloc
-        size_t align = arena__alignment();
+        if (opt.reserve_size == 0) {
+            opt.reserve_size = (opt.type == Arena_Chained)
+                ? ARENA_CHAINED_FIRST_BLOCK_SIZE
+                : ARENA_DEFAULT_RESERVE_SIZE;
+        }
+        // align to page size (or huge page size) or max_align_t if using malloc
+        size_t align = opt.huge_pages? arena__huge_page_size(): arena__alignment();
         reserve_size = align_up_pow2(opt.reserve_size, align);
         // commit_size must not be greater than reserve_size
         commit_size = clamp_top(align_up_pow2(opt.commit_size, align), reserve_size);
-
-        mem = arena__reserve(reserve_size);
-        reserved = reserve_size;
-        arena__commit(mem, commit_size);
-        memory_poison(mem + sizeof(Arena), commit_size - sizeof(Arena));
-        committed = commit_size;
+        keep_committed = align_up_pow2(opt.keep_committed, commit_size);
+        avow(keep_committed / KB <= UINT32_MAX, "%s: keep_committed is too large", __func__);
+
+        Arena *free_block = (opt.type == Arena_Chained)
+            ? arena__take_free_block(reserve_size, opt.huge_pages, opt.populate)
+            : NULL;
+        if (free_block) {
+            // the block keeps all of its memory committed
+            mem = (byte *)free_block;
+            reserved = free_block->reserved;
+            reserve_size = reserved;
+            committed = free_block->committed;
+        } else {
+            mem = opt.huge_pages
+                ? arena__reserve_huge(reserve_size, opt.huge_pages == Arena_HugePagesExplicit)
+                : arena__reserve(reserve_size);
+            reserved = reserve_size;
+            if (opt.populate) arena__commit_populate(mem, commit_size);
+            else arena__commit(mem, commit_size);
+            fresh = true;
+            memory_poison(mem + sizeof(Arena), commit_size - sizeof(Arena));
+            committed = commit_size;
+        }
     }
 
     // ensures that the contents are always aligned properly (64 should always be aligned)
@@ -193,11 +811,15 @@ static Arena *arena__init(ArenaOptions opt, void *backing_buffer, size_t backing
     arena->reserved = reserved;
     arena->committed = committed;
 
-    // TODO: Change the default reserve sizes depending on if the arena is chained or linear.
     arena->commit_size  = commit_size;
     arena->reserve_size = reserve_size;
+    arena->keep_committed_kb = (uint32_t)(keep_committed / KB);
 
-    arena->type = opt.type;
+    arena->type = (uint8_t)opt.type;
+    arena->huge_pages = (uint8_t)opt.huge_pages;
+    arena->populate = opt.populate;
+    arena->spill = false;
+    arena__stats_init(arena, fresh);
     return arena;
 }
 
@@ -205,16 +827,158 @@ static Arena *arena_init_static(void *backing_buffer, size_t backing_buffer_size
     return arena__init((ArenaOptions){.type = Arena_Static}, backing_buffer, backing_buffer_size);
 }
 
+static Arena *arena_init_static_spill(void *backing_buffer, size_t backing_buffer_size) {
+    Arena *arena = arena_init_static(backing_buffer, backing_buffer_size);
+    arena->spill = true;
+    return arena;
+}
+
+#ifdef ARENA_HAS_FILES
+// Creates a file arena in an empty file, or maps the existing one in it
+// The memory is mapped at the first free multiple of the reserve size from `base` if it isn't NULL
+static Arena *arena__init_file(int file, size_t length, ArenaOptions opt, void *base) {
+    size_t align = arena__alignment();
+    size_t reserve_size = align_up_pow2(max_of(opt.reserve_size, length), align);
+    size_t commit_size = clamp_top(align_up_pow2(opt.commit_size, align), reserve_size);
+    Arena *arena = NULL;
+    for (size_t i = 0; base && !arena && i < 64; i++) {
+        arena = memory_reserve_file(file, reserve_size, (byte *)base + i*reserve_size);
+    }
+    if (!arena) arena = memory_reserve_file(file, reserve_size, NULL);
+
+    if (length == 0) {
+        arena__commit_file(file, 0, commit_size);
+        arena->type = Arena_File;
+        arena->position = sizeof(Arena);
+        arena->committed = commit_size;
+    } else {
+        // a file which is not a file arena, or was cut short (it is always grown by whole commits)
+        if (length < sizeof(Arena) || arena->type != Arena_File || arena->committed != length ||
+            arena->position < sizeof(Arena) || arena->position > length) {
+            memory_close_file(file);
+            memory_release(arena, reserve_size);
+            return NULL;
+        }
+    }
+
+    // the rest of the header may be left over from a different mapping
+    arena->huge_pages = Arena_NoHugePages;
+    arena->populate = false;
+    arena->spill = false;
+    arena->keep_committed_kb = 0;
+    arena->reserved = reserve_size;
+    arena->commit_size = commit_size;
+    arena->file = file;
+    arena->prev = NULL;
+    arena->current = arena;
+    arena__stats_init(arena, length == 0);
+    return arena;
+}
+
+static Arena *arena__open_file(Str path, ArenaOptions opt) {
+    Temp tmp = arena_temp();
+    char *cpath = arena_push(tmp.arena, char, path.length + 1);
+    memcpy(cpath, path.data, path.length);
+    size_t length = 0;
+    int file = memory_open_file(cpath, &length);
+    arena_temp_release(tmp);
+    if (file == -1) return NULL;
+    return arena__init_file(file, length, opt, NULL);
+}
+
+static Arena *arena__init_shared_memory(ArenaOptions opt) {
+    int file = memory_create_shared("migi_arena");
+    avow(file != -1, "%s: failed to create shared memory: %s", __func__, strerror(errno));
+    return arena__init_file(file, 0, opt, (void *)(uintptr_t)ARENA_SHARED_MEMORY_BASE);
+}
+
+static Arena *arena_open_shared(int file) {
+    size_t length = 0;
+    if (!memory_file_length(file, &length) || length < sizeof(Arena)) return NULL;
+
+    // the header has to be read first, to know where the arena goes
+    size_t page_size = arena__alignment();
+    Arena *mapped = memory_reserve_file(file, page_size, NULL);
+    Arena header = *mapped;
+    memory_release(mapped, page_size);
+    if (header.type != Arena_File || header.file != file || header.committed != length ||
+        !header.current || (uintptr_t)header.current % page_size != 0) {
+        return NULL;
+    }
+
+    Arena *arena = memory_reserve_file(file, header.reserved, header.current);
+    if (!arena) return NULL;
+    arena__stats_init(arena, false);
+    return arena;
+}
+
+static void arena_flush(Arena *arena) {
+    assertf(arena->type == Arena_File, "%s: not a file arena", __func__);
+    memory_sync_file(arena->file, arena, arena->committed);
+}
+#endif
+
+static void *arena__push_shared(Arena *arena, size_t size, size_t align, ArenaPushOpt opt) {
+    size_t alloc_start = 0;
+    size_t alignment_waste = align_up_pow2(size, ARENA_SHARED_ALIGN) - size;
+    if (align <= ARENA_SHARED_ALIGN) {
+        alloc_start = atomic_add(&arena->position, align_up_pow2(size, ARENA_SHARED_ALIGN));
+    } else {
+        size_t position = atomic_load_relaxed(&arena->position);
+        do {
+            alloc_start = align_up_pow2(position, align);
+        } while (!atomic_cas(&arena->position, &position, align_up_pow2(alloc_start + size, ARENA_SHARED_ALIGN)));
+        alignment_waste += alloc_start - position;
+    }
+    size_t alloc_end = alloc_start + size;
+    avow(alloc_end <= arena->reserved, "%s: out of memory", __func__);
+
+    // Every thread which needs more memory commits it, since committing the same
+    // pages twice is harmless, but only the largest committed size is published
+    size_t committed = atomic_load_acquire(&arena->committed);
+    size_t dirty_end = min_of(alloc_end, committed);
+    while (alloc_end > committed) {
+        size_t new_committed = clamp_top(align_up_pow2(alloc_end, arena->commit_size), arena->reserved);
+        arena__commit_range(arena, committed, new_committed);
+        arena__stats_commit(arena, 1, 0);
+        if (atomic_cas(&arena->committed, &committed, new_committed)) break;
+    }
+
+    // NOTE: the memory past the position isn't poisoned, since the poisoning
+    // of a commit could then race with another thread unpoisoning its allocation
+    byte *mem = (byte *)arena + alloc_start;
+    memory_unpoison(mem, size);
+
+#ifndef ARENA_USE_MALLOC
+    // Memory past the committed region was never used since the arena was
+    // last rewound, even if another thread committed it in the meantime
+    if (opt.zeroed && dirty_end > alloc_start) mem_clear_array(mem, dirty_end - alloc_start);
+#else
+    unused(dirty_end);
+    if (opt.zeroed) mem_clear_array(mem, size);
+#endif
+    arena__stats_push(arena, size, alignment_waste, true);
+    return mem;
+}
+
 static void *arena_push_bytes_opt(Arena *arena, size_t size, size_t align, ArenaPushOpt opt) {
+    if (arena->type == Arena_Shared) return arena__push_shared(arena, size, align, opt);
+
     Arena *current = arena->current;
     size_t alloc_start = align_up_pow2(current->position, align);
     size_t alloc_end = alloc_start + size;
 
-    // allocate new block for chained arena if it doesn't fit
-    if (current->type == Arena_Chained && alloc_end > current->reserved) {
-        // increase the reservation if the allocation size is bigger
+    // allocate new block for chained arena (or a static arena which spills) if it doesn't fit
+    if ((current->type == Arena_Chained || current->spill) && alloc_end > current->reserved) {
+        // blocks grow geometrically, and the reservation is increased if the allocation size is bigger
         size_t commit_size = current->commit_size;
-        size_t reserve_size = current->reserve_size;
+        size_t reserve_size = max_of(current->reserve_size,
+                                     min_of(current->reserve_size * 2, (size_t)ARENA_CHAINED_MAX_BLOCK_SIZE));
+        if (current->spill) {
+            // the buffer is usually small, and wasn't committed in chunks
+            commit_size = ARENA_DEFAULT_COMMIT_SIZE;
+            reserve_size = max_of(reserve_size, (size_t)ARENA_CHAINED_FIRST_BLOCK_SIZE);
+        }
         size_t effective_size = sizeof(Arena) + size;
         if (effective_size > reserve_size) {
             reserve_size = align_up_pow2(effective_size, align);
@@ -223,23 +987,29 @@ static void *arena_push_bytes_opt(Arena *arena, size_t size, size_t align, Arena
         Arena *next = arena__init((ArenaOptions){
             .commit_size = commit_size,
             .reserve_size = reserve_size,
-            .type = current->type
+            .type = Arena_Chained,
+            .keep_committed = (size_t)current->keep_committed_kb * KB,
+            .huge_pages = current->huge_pages,
+            .populate = current->populate,
         }, NULL, 0);
         next->prev = current;
         current = next;
         arena->current = current;
+        arena__stats_add_block(arena, next);
 
         // update allocation offsets for the new block
         alloc_start = align_up_pow2(current->position, align);
         alloc_end = alloc_start + size;
     }
 
-    bool committed = false;
+    // everything past the committed region is fresh memory
+    size_t dirty_end = min_of(alloc_end, current->committed);
+
     // commit memory if needed
     if (current->type != Arena_Static && alloc_end > current->committed) {
         size_t new_committed = clamp_top(align_up_pow2(alloc_end, current->commit_size), current->reserved);
-        arena__commit((byte *)current + current->committed, new_committed - current->committed);
-        committed = true;
+        arena__commit_range(current, current->committed, new_committed);
+        arena__stats_commit(arena, 1, 0);
         current->committed = new_committed;
         memory_poison((byte *)current + current->position, current->committed - current->position);
     }
@@ -249,17 +1019,19 @@ static void *arena_push_bytes_opt(Arena *arena, size_t size, size_t align, Arena
     memory_unpoison(mem, size);
 
 #ifndef ARENA_USE_MALLOC
-    // If memory was just committed the OS has already cleared it,
-    // so there is no need to clear it again
-    if (opt.zeroed && !committed) mem_clear_array(mem, size);
+    // If memory was just committed the OS has already cleared it, so only the
+    // part which was committed before (and may have been used already) is cleared
+    if (opt.zeroed && dirty_end > alloc_start) mem_clear_array(mem, dirty_end - alloc_start);
 #else
     // Commit operation in malloc mode doesnt do anything,
     // so the memory must always be cleared unless zeroed is false
-    unused(committed);
+    unused(dirty_end);
     if (opt.zeroed) mem_clear_array(mem, size);
 #endif
 
+    size_t alignment_waste = alloc_start - current->position;
     current->position = alloc_end;
+    arena__stats_push(arena, size, alignment_waste, true);
     return mem;
 }
 
@@ -270,6 +1042,30 @@ static void *arena_copy_bytes(Arena *arena, void *mem, size_t size, size_t align
     return memcpy(arena_push_bytes_opt(arena, size, align, (ArenaPushOpt){.zeroed=false}), mem, size);
 }
 
+// Decommits the memory of a block past `new_position`, except for what it must keep committed
+// NOTE: must be called before the position is moved back
+static void arena__decommit_excess(Arena *arena, Arena *current, size_t new_position) {
+    unused(arena);
+    if (current->type == Arena_Static || current->type == Arena_File) return;
+    size_t keep = max_of(align_up_pow2(new_position, current->commit_size),
+                         (size_t)current->keep_committed_kb * KB);
+#ifdef ARENA_LAZY_DECOMMIT
+    // Nothing past the commit chunk of the position was used since the last decommit,
+    // so that is as far as the pages need to be given back
+    size_t used_end = clamp_top(align_up_pow2(current->position, current->commit_size), current->committed);
+    if (used_end > keep) {
+        arena__decommit_lazy((byte *)current + keep, used_end - keep);
+        arena__stats_commit(arena, 0, 1);
+    }
+#else
+    if (current->committed > keep) {
+        arena__decommit((byte *)current + keep, current->committed - keep);
+        arena__stats_commit(arena, 0, 1);
+        current->committed = keep;
+    }
+#endif
+}
+
 // TODO: try adding a arena_pop_to_bytes which pops to a certain index
 // from the beginning of the arena
 static void arena_pop_bytes(Arena *arena, size_t size) {
@@ -280,21 +1076,17 @@ static void arena_pop_bytes(Arena *arena, size_t size) {
 
             Arena *temp = current;
             current = current->prev;
-            arena__release(temp, temp->reserved);
+            arena__release_block(temp);
         }
         arena->current = current;
+        arena__stats_release_blocks(arena);
     }
 
     // account for overflow during pop
     size_t new_position = current->position - size;
     new_position = clamp(new_position, sizeof(Arena), current->position);
 
-    // decommit excess region
-    if (current->type != Arena_Static) {
-        size_t new_committed = align_up_pow2(new_position, current->commit_size);
-        arena__decommit((byte *)current + new_committed, current->committed - new_committed);
-        current->committed = new_committed;
-    }
+    arena__decommit_excess(arena, current, new_position);
     memory_poison((byte *)current + new_position, current->position - new_position);
     current->position = new_position;
 }
@@ -308,16 +1100,18 @@ static void *arena_realloc_bytes(Arena *arena, void *old, size_t old_size, size_
     // extend previous allocation if it was the same as `old`
     // TODO: maybe see if there are other ways to do this, since comparing the pointers 
     // after adding new_size may potentially overflow the LHS and lead to UB
-    if (old_size <= current->position) {
+    if (current->type != Arena_Shared && old_size <= current->position) {
         size_t old_offset = current->position - old_size;
         if ((byte *)current + old_offset == old && old_offset + new_size <= current->reserved) {
             current->position += new_size - old_size;
 
             if (current->position > current->committed) {
                 size_t new_committed = align_up_pow2(current->position, current->commit_size);
-                arena__commit((byte *)current + current->committed, new_committed - current->committed);
+                arena__commit_range(current, current->committed, new_committed);
+                arena__stats_commit(arena, 1, 0);
                 current->committed = new_committed;
             }
+            arena__stats_push(arena, new_size - old_size, 0, false);
             return old;
         }
     }
@@ -333,28 +1127,33 @@ static void arena_reset(Arena *arena) {
     while (current->prev) {
         Arena *temp = current;
         current = current->prev;
-        arena__release(temp, temp->reserved);
+        arena__release_block(temp);
     }
     current->position = sizeof(Arena);
     arena->current = current;
+    arena__stats_release_blocks(arena);
 }
 
 static void arena_free(Arena *arena) {
+    arena__stats_free(arena);
     Arena *current = arena->current;
     // no need to free the static arena as the buffer was provided by the user
-    if (current->type == Arena_Static) {
+    if (arena->type == Arena_Static) {
+        while (current != arena) {
+            Arena *temp = current;
+            current = current->prev;
+            arena__release_block(temp);
+        }
         memory_unpoison((byte *)current, current->reserved);
         mem_clear_array((byte *)current, current->reserved);
+    } else if (current->type == Arena_File) {
+        memory_unpoison((byte *)current, current->reserved);
+        arena__release_file(current);
     } else {
         while (current) {
             Arena *temp = current;
             current = current->prev;
-            // NOTE: If the memory is not unpoisoned before being released,
-            // then ASan still thinks it owns the memory, and if it is later
-            // mapped to some other process (most likely the C runtime itself
-            // during cleanup/shutdown), it will trip up ASan.
-            memory_unpoison(temp, temp->reserved);
-            arena__release(temp, temp->reserved);
+            arena__release_block(temp);
         }
     }
 }
@@ -363,7 +1162,7 @@ static Temp arena_save(Arena *arena) {
     return (Temp) {
         .arena = arena,
         .current = arena->current,
-        .position = arena->current->position
+        .position = atomic_load_acquire(&arena->current->position)
     };
 }
 
@@ -378,17 +1177,13 @@ static void arena_rewind(Temp tmp) {
     while (current && current != tmp.current) {
         Arena *temp = current;
         current = current->prev;
-        arena__release(temp, temp->reserved);
+        arena__release_block(temp);
     }
     tmp.arena->current = current;
+    arena__stats_release_blocks(tmp.arena);
 
     size_t new_position = tmp.position;
-    // decommit excess region
-    if (current->type != Arena_Static) {
-        size_t new_committed = align_up_pow2(new_position, current->commit_size);
-        arena__decommit((byte *)current + new_committed, current->committed - new_committed);
-        current->committed = new_committed;
-    }
+    arena__decommit_excess(tmp.arena, current, new_position);
     current->position = new_position;
 }
 
@@ -398,7 +1193,8 @@ static Temp arena_temp_excluding(Arena **conflicts, size_t conflicts_length) {
     for (int64_t i = 0; i < (int64_t)array_len(MIGI_GLOBAL_TEMP_ARENAS); i++) {
         bool has_conflict = false;
         for (size_t j = 0; j < conflicts_length; j++) {
-            if (MIGI_GLOBAL_TEMP_ARENAS[i] == conflicts[j]) {
+            // arenas which weren't created yet never conflict, even with NULL
+            if (MIGI_GLOBAL_TEMP_ARENAS[i] && MIGI_GLOBAL_TEMP_ARENAS[i] == conflicts[j]) {
                 has_conflict = true;
                 break;
             }
@@ -410,20 +1206,58 @@ static Temp arena_temp_excluding(Arena **conflicts, size_t conflicts_length) {
     }
 
     if (index == -1) {
+        MIGI_ARENA_TEMP_EXHAUSTED++;
         return (Temp){0};
     }
 
     Arena **selected = &MIGI_GLOBAL_TEMP_ARENAS[index];
     if (!*selected) {
-        *selected = arena_init();
+        *selected = arena__init(MIGI_ARENA_TEMP_OPTIONS, NULL, 0);
     }
 
     return arena_save(*selected);
 }
 
 
+static size_t arena__used(Arena *arena) {
+    size_t used = 0;
+    for (Arena *block = arena->current; block; block = block->prev) {
+        used += block->position - sizeof(Arena);
+    }
+    return used;
+}
+
 static void arena_temp_release(Temp t) {
+    for (size_t i = 0; i < ARENA_TEMP_MAX_COUNT; i++) {
+        if (MIGI_GLOBAL_TEMP_ARENAS[i] == t.arena) {
+            MIGI_ARENA_TEMP_HIGH_WATER[i] = max_of(MIGI_ARENA_TEMP_HIGH_WATER[i], arena__used(t.arena));
+            break;
+        }
+    }
     arena_rewind(t);
 }
 
+static void arena_temp_print_stats() {
+    size_t count = 0;
+    while (count < ARENA_TEMP_MAX_COUNT && MIGI_GLOBAL_TEMP_ARENAS[count]) count++;
+    printf("temporary arenas: %zu (at most %d)\n", count, ARENA_TEMP_MAX_COUNT);
+    for (size_t i = 0; i < count; i++) {
+        Arena *arena = MIGI_GLOBAL_TEMP_ARENAS[i];
+        printf("    %zu: high-water: %zu bytes, committed: %zu, reserved: %zu\n",
+               i, MIGI_ARENA_TEMP_HIGH_WATER[i], arena->current->committed, arena->current->reserved);
+    }
+    if (MIGI_ARENA_TEMP_EXHAUSTED) {
+        printf("    ran out of temporary arenas %zu times, increase ARENA_TEMP_MAX_COUNT\n", MIGI_ARENA_TEMP_EXHAUSTED);
+    }
+}
+
+static void arena_temp_free() {
+    for (size_t i = 0; i < ARENA_TEMP_MAX_COUNT; i++) {
+        if (MIGI_GLOBAL_TEMP_ARENAS[i]) arena_free(MIGI_GLOBAL_TEMP_ARENAS[i]);
+        MIGI_GLOBAL_TEMP_ARENAS[i] = NULL;
+        MIGI_ARENA_TEMP_HIGH_WATER[i] = 0;
+    }
+    MIGI_ARENA_TEMP_EXHAUSTED = 0;
+}
+
 #endif // MIGI_ARENA_H
@@ -6,6 +6,7 @@
 #include "arena.h"
 #include "migi_list.h"
 #include "string_builder.h"
+#include "intern.h"
 
 // Maximum number of options supported
 // Can be changed by #defining the constant before including the header
@@ -13,6 +14,11 @@
     #define CLI_MAX_OPTIONS 256
 #endif
 
+// Maximum number of option names, including aliases
+#ifndef CLI_MAX_NAMES
+    #define CLI_MAX_NAMES (2*CLI_MAX_OPTIONS)
+#endif
+
 typedef enum {
     CliArg_None,
     CliArg_Str,
@@ -48,18 +54,12 @@ typedef struct {
     };
 } CliArg;
 
-typedef struct {
-    Str arg_name;
-    uint32_t arg_index;
-} CliSlot;
-
 typedef struct {
     CliArg *args;
     uint32_t args_length;
 
-    CliSlot *slots;
-    uint32_t slots_length;
-    int exp;
+    Interner names;         // names and aliases of all the options
+    uint32_t *name_args;    // index of the option for each name, by its id in `names`
 
     StrList pos_args;     // positional arguments (anything that wasnt parsed as part of the regular parsing process)
     StrList meta_args;    // arguments following a `--`, usually passed to the program being called by this program
@@ -240,9 +240,8 @@ threadvar Cli global_cli = {0};
 
 
 static void cli__init(Arena *arena, Cli *cli) {
-    cli->exp = 3;
-    for (; (1 << cli->exp) - (1 << (cli->exp - 3)) < CLI_MAX_OPTIONS; cli->exp++) {}
-    cli->slots = arena_push(arena, CliSlot, 1LL << cli->exp);
+    cli->names = (Interner){ .arena = arena };
+    cli->name_args = arena_push(arena, uint32_t, CLI_MAX_NAMES + 1);
     cli->args = arena_push(arena, CliArg, CLI_MAX_OPTIONS);
 }
 
@@ -257,30 +256,13 @@ static void clic_free(Cli *cli) {
     mem_clear(cli);
 }
 
-static int32_t cli__iter_step(uint64_t hash, int exp, int32_t index) {
-    uint32_t mask = ((uint32_t)1 << exp) - 1;
-    uint32_t step = (uint32_t)(hash >> (64 - exp)) | 1;
-    return (index + step) & mask;
-}
-
 static void cli__insert(Arena *arena, Cli *cli, Str key, uint32_t value) {
-    if (cli->slots == NULL) {
+    if (cli->name_args == NULL) {
         cli__init(arena, cli);
     }
-    assertf(cli->slots_length + 1 < (uint32_t)(1 << cli->exp), "cli__insert: option table capacity exceeded!");
-
-    uint64_t hash = str_hash(key);
-    for (uint32_t i = (uint32_t)hash;;) {
-        i = cli__iter_step(hash, cli->exp, i);
-        if (cli->slots[i].arg_name.length == 0) {
-            cli->slots[i] = (CliSlot){
-                .arg_name = key,
-                .arg_index = value
-            };
-            cli->slots_length += 1;
-            break;
-        }
-    }
+    InternId id = intern(&cli->names, key);
+    assertf(id <= CLI_MAX_NAMES, "cli__insert: option table capacity exceeded!");
+    cli->name_args[id] = value;
 }
 
 static int32_t cli__push_arg(Arena *arena, Cli *cli, CliArg arg) {
@@ -288,22 +270,14 @@ static int32_t cli__push_arg(Arena *arena, Cli *cli, CliArg arg) {
         cli__init(arena, cli);
     }
 
-    assertf(cli->slots_length < CLI_MAX_OPTIONS, "cli__push_arg: args array capacity exceeded!");
+    assertf(cli->args_length < CLI_MAX_OPTIONS, "cli__push_arg: args array capacity exceeded!");
     cli->args[cli->args_length++] = arg;
     return cli->args_length - 1;
 }
 
 static uint32_t *cli__lookup(Cli *cli, Str key) {
-    uint64_t hash = str_hash(key);
-    for (uint32_t i = (uint32_t)hash;;) {
-        i = cli__iter_step(hash, cli->exp, i);
-        if (cli->slots[i].arg_name.length == 0) {
-            return NULL;
-        }
-        if (str_eq(key, cli->slots[i].arg_name)) {
-            return &cli->slots[i].arg_index;
-        }
-    }
+    InternId id = intern_find(&cli->names, key);
+    return id? &cli->name_args[id]: NULL;
 }
 
 
@@ -576,7 +550,7 @@ static bool cli_parse_args_opt(int argc, char **argv, CliParseOpt opt) {
     Arena *cli_arena = opt.cli->arena;
     if (!cli_arena) cli_arena = arena_init();
 
-    if (opt.cli->slots == NULL) {
+    if (opt.cli->name_args == NULL) {
         cli__init(cli_arena, opt.cli);
     }
 
@@ -0,0 +1,323 @@
+#ifndef MIGI_CONCURRENT_HASHMAP_H
+#define MIGI_CONCURRENT_HASHMAP_H
+
+// A hashmap which can be read from any number of threads while other threads write to it
+//
+// It uses the same robin hood entries, pairs array and arena allocation as HashMap, but:
+// - Readers never take a lock or write to shared memory. Every write happens inside a
+//   window where the sequence number `seq` is odd (a seqlock), and readers copy out the
+//   pair that they are looking at, then check that `seq` didn't change in the meantime,
+//   retrying the lookup if it did. The value is returned by copy, since a pointer into
+//   the pairs array could be invalidated by a writer right after the lookup returned.
+// - Readers are not lock-free though: they wait while a write is in progress, and keep
+//   retrying for as long as writes keep landing in the middle of their lookup, so a
+//   steady stream of writes (or a writer that gets descheduled) stalls every reader.
+// - Readers copy the header, entries and pairs with relaxed atomic loads, while the writers
+//   change them in place with the plain stores of HashMap. Mixing the two is still a data race
+//   as far as the C11 memory model goes (and ThreadSanitizer reports it), the same as any other
+//   seqlock over plain data. It works in practice since the loads can't tear or be merged
+//   and whatever they read during a write is thrown away once `seq` is checked.
+// - Writers are serialized by a single lock. Robin hood insertion and backshift deletion
+//   can move entries over an unbounded range of slots, and deletion also moves the last
+//   pair into the hole, so there is no fixed set of slots that a striped lock could cover.
+// - Growing is copy-on-grow (RCU style): the new entries and pairs are built off to the
+//   side while readers keep using the old ones, and are then published with a single
+//   write window. The old arrays are never freed or written to again, since they live on
+//   the arena, so a reader still probing them only sees stale data, which it then retries.
+//
+// NOTE: the arena passed to the writers must not be used by any other thread,
+// and it must not be reset or freed while any thread is still using the hashmap
+
+#include "migi_core.h"
+#include "migi_thread.h"
+#include "hashmap.h"
+
+#if defined(HASHMAP_USE_GROUPS) || defined(HASHMAP_INCREMENTAL_RESIZE)
+    #error "ConcurrentHashMap only supports the default robin hood layout"
+#endif
+
+#define CONCURRENT_HASHMAP__HEADER \
+    HashMapHeader _h;              \
+    uint64_t seq;                  \
+    SpinLock lock;
+
+typedef struct {
+    CONCURRENT_HASHMAP__HEADER
+    void *pairs;
+} ConcurrentHashMapHeader;
+
+#define ConcurrentHashMap(k, v)         \
+    union {                             \
+        ConcurrentHashMapHeader _c;     \
+        struct {                        \
+            CONCURRENT_HASHMAP__HEADER  \
+            struct {                    \
+                k key;                  \
+                v value;                \
+            } *pairs;                   \
+        };                              \
+    }
+
+
+// Takes the writer lock and makes readers retry until concurrent_hashmap__write_end
+static void concurrent_hashmap__write_begin(ConcurrentHashMapHeader *c) {
+    spinlock_lock(&c->lock);
+    atomic_store_relaxed(&c->seq, c->seq + 1);
+    atomic_fence_release();
+}
+
+static void concurrent_hashmap__write_end(ConcurrentHashMapHeader *c) {
+    atomic_store_release(&c->seq, c->seq + 1);
+    spinlock_unlock(&c->lock);
+}
+
+// Copies `size` bytes that a writer may be changing at the same time, using relaxed
+// atomic loads of the widest unit that both `src` and `size` are aligned to
+static void concurrent_hashmap__load_bytes(void *dest, const void *src, size_t size) {
+    byte *d = dest;
+    if (((uintptr_t)src | size) % sizeof(uint64_t) == 0) {
+        for (const uint64_t *s = src; size > 0; s++, d += sizeof(*s), size -= sizeof(*s)) {
+            uint64_t word = atomic_load_relaxed(s);
+            memcpy(d, &word, sizeof(word));
+        }
+    } else if (((uintptr_t)src | size) % sizeof(uint32_t) == 0) {
+        for (const uint32_t *s = src; size > 0; s++, d += sizeof(*s), size -= sizeof(*s)) {
+            uint32_t word = atomic_load_relaxed(s);
+            memcpy(d, &word, sizeof(word));
+        }
+    } else {
+        for (const byte *s = src; size > 0; s++, d++, size--) {
+            *d = atomic_load_relaxed(s);
+        }
+    }
+}
+
+// Waits for any write in progress to finish and returns the sequence number to validate against
+static uint64_t concurrent_hashmap__read_begin(ConcurrentHashMapHeader *c) {
+    uint64_t seq = atomic_load_acquire(&c->seq);
+    while (seq & 1) {
+        cpu_relax();
+        seq = atomic_load_acquire(&c->seq);
+    }
+    return seq;
+}
+
+// Returns true if nothing was written since concurrent_hashmap__read_begin returned `seq`
+static bool concurrent_hashmap__read_valid(ConcurrentHashMapHeader *c, uint64_t seq) {
+    atomic_fence_acquire();
+    return atomic_load_relaxed(&c->seq) == seq;
+}
+
+
+// Grows into new arrays if required (or if `at_least` is more than the capacity),
+// and publishes them once they are ready, so that readers are never blocked on the rehash
+// NOTE: the writer lock must be held
+static void concurrent_hashmap__grow(Arena *a, ConcurrentHashMapHeader *c, HashMapGeneric g, size_t at_least) {
+    TIME_FUNCTION;
+    bool full = c->_h.size >= (size_t)(c->_h.capacity * HASHMAP_LOAD_FACTOR);
+    bool reserve = at_least > 0 && (size_t)(at_least * (1 + HASHMAP_LOAD_FACTOR)) > c->_h.capacity;
+    if (!full && !reserve && c->_h.capacity > 0) return;
+
+    HashMapHeader next = c->_h;
+    void *next_pairs = hashmap__grow(a, &next, g, c->pairs, at_least);
+
+    atomic_store_relaxed(&c->seq, c->seq + 1);
+    atomic_fence_release();
+    c->_h = next;
+    atomic_store_relaxed(&c->pairs, next_pairs);
+    atomic_store_release(&c->seq, c->seq + 1);
+}
+
+// Returns the index of the pair for `key`, which is inserted if not present
+// The key and value must then be written before calling concurrent_hashmap__write_end
+static size_t concurrent_hashmap__put_begin(Arena *a, ConcurrentHashMapHeader *c, HashMapGeneric g, void *key) {
+    TIME_FUNCTION;
+    spinlock_lock(&c->lock);
+    concurrent_hashmap__grow(a, c, g, 0);
+
+    atomic_store_relaxed(&c->seq, c->seq + 1);
+    atomic_fence_release();
+    c->pairs = hashmap__put(a, &c->_h, g, c->pairs, key);
+    return c->_h._temp_index;
+}
+
+static void concurrent_hashmap__reserve_begin(Arena *a, ConcurrentHashMapHeader *c, HashMapGeneric g, size_t amount) {
+    spinlock_lock(&c->lock);
+    concurrent_hashmap__grow(a, c, g, amount);
+
+    atomic_store_relaxed(&c->seq, c->seq + 1);
+    atomic_fence_release();
+}
+
+// Copies the pair for `key` into `pair_out`, or the default pair if it is not present
+// Returns true if the key was found
+static bool concurrent_hashmap__get(ConcurrentHashMapHeader *c, HashMapGeneric g, void *key, void *pair_out) {
+    TIME_FUNCTION;
+    while (true) {
+        uint64_t seq = concurrent_hashmap__read_begin(c);
+        HashMapHeader h;
+        concurrent_hashmap__load_bytes(&h, &c->_h, sizeof(h));
+        byte *pairs = atomic_load_relaxed(&c->pairs);
+        if (!concurrent_hashmap__read_valid(c, seq)) continue;
+
+        if (h.capacity == 0) {
+            memset(pair_out, 0, g.elem_size);
+            return false;
+        }
+
+        uint64_t hash = hashmap__hash_key(&h, g, key);
+        bool int_search = hashmap__use_int_search(&h, g);
+        bool retry = false;
+        size_t found = 0;
+
+        // same as the robin hood search in hashmap__index_of_hashed, except that only
+        // the pairs with a matching hash are looked at, and they are first copied out
+        // and validated, since the key might be half written (or not written at all yet)
+        size_t i = hash & (h.capacity - 1);
+        for (size_t dist = 0; dist < h.capacity; dist++) {
+            HashMapEntry entry = {
+                .hash = atomic_load_relaxed(&h.entries[i].hash),
+                .index = atomic_load_relaxed(&h.entries[i].index),
+            };
+            if (entry.index == 0) break;
+
+            if (entry.hash == (HashMapEntryField)hash && entry.index <= h.capacity) {
+                concurrent_hashmap__load_bytes(pair_out, pairs + entry.index*g.elem_size, g.elem_size);
+                if (!concurrent_hashmap__read_valid(c, seq)) {
+                    retry = true;
+                    break;
+                }
+                bool equal = int_search
+                    ? hashmap__int_key(key, g.key_size) == hashmap__int_key(pair_out, g.key_size)
+                    : h.eq_fn(key, pair_out, g.key_size);
+                if (equal) {
+                    found = entry.index;
+                    break;
+                }
+            }
+
+            size_t cur_desired = entry.hash & (h.capacity - 1);
+            size_t cur_dist = (i + h.capacity - cur_desired) & (h.capacity - 1);
+            if (cur_dist < dist) break;
+
+            i = (i + 1) & (h.capacity - 1);
+        }
+        if (retry) continue;
+
+        if (found == 0) {
+            concurrent_hashmap__load_bytes(pair_out, pairs, g.elem_size);
+        }
+        // a miss also has to be validated, as the entries may have been shifted around
+        if (!concurrent_hashmap__read_valid(c, seq)) continue;
+        return found != 0;
+    }
+}
+
+static void *concurrent_hashmap__get_pair(ConcurrentHashMapHeader *c, HashMapGeneric g, void *key, void *pair_out) {
+    concurrent_hashmap__get(c, g, key, pair_out);
+    return pair_out;
+}
+
+static bool concurrent_hashmap__find(ConcurrentHashMapHeader *c, HashMapGeneric g, void *key, void *pair_out,
+                                     void *value_out, size_t value_offset, size_t value_size) {
+    bool found = concurrent_hashmap__get(c, g, key, pair_out);
+    if (found) memcpy(value_out, (byte *)pair_out + value_offset, value_size);
+    return found;
+}
+
+static bool concurrent_hashmap__del(ConcurrentHashMapHeader *c, HashMapGeneric g, void *key) {
+    TIME_FUNCTION;
+    concurrent_hashmap__write_begin(c);
+    bool found = false;
+    if (c->_h.capacity > 0) {
+        hashmap__del(&c->_h, g, c->pairs, key);
+        size_t index = c->_h._temp_index;
+        if (index != 0) {
+            // move the last pair into the hole left by the deleted one
+            byte *pairs = c->pairs;
+            memcpy(pairs + index*g.elem_size, pairs + (c->_h.size + 1)*g.elem_size, g.elem_size);
+            found = true;
+        }
+    }
+    concurrent_hashmap__write_end(c);
+    return found;
+}
+
+
+// Reserve space for insertion of `count` elements into the hashmap without growing
+#define concurrent_hashmap_reserve(arena, hashmap, amount)                                     \
+    (void)(                                                                                    \
+        concurrent_hashmap__reserve_begin((arena), &(hashmap)->_c, hashmap__generic((hashmap)), \
+                                          (amount)),                                           \
+        concurrent_hashmap__write_end(&(hashmap)->_c)                                          \
+    )
+
+
+// Insert a new key-value pair if key doesn't exist, update the old value otherwise
+// Blocks while any other thread is writing to the hashmap
+#define concurrent_hashmap_put(arena, hashmap, k, v)                                                 \
+    (void)(                                                                                          \
+        (hashmap)->_h._temp_index = concurrent_hashmap__put_begin((arena), &(hashmap)->_c,           \
+                                    hashmap__generic((hashmap)), address_of((hashmap)->pairs->key, k)), \
+        (hashmap)->pairs[(hashmap)->_h._temp_index].key = (k),                                       \
+        (hashmap)->pairs[(hashmap)->_h._temp_index].value = (v),                                     \
+        concurrent_hashmap__write_end(&(hashmap)->_c)                                                \
+    )
+
+
+// Set the default key and value of the hashmap
+#define concurrent_hashmap_set_default(arena, hashmap, k, v)                                   \
+    (void)(                                                                                    \
+        concurrent_hashmap__reserve_begin((arena), &(hashmap)->_c, hashmap__generic((hashmap)), 0), \
+        (hashmap)->pairs[0].key = (k),                                                         \
+        (hashmap)->pairs[0].value = (v),                                                       \
+        concurrent_hashmap__write_end(&(hashmap)->_c)                                          \
+    )
+
+
+// Get (a copy of) the value for the specified key
+// Returns the default value if key is not present
+#define concurrent_hashmap_get(hashmap, k)                                                         \
+    (check_type_value(type_of((hashmap)->pairs->key), (k)),                                        \
+    ((type_of((hashmap)->pairs))concurrent_hashmap__get_pair(&(hashmap)->_c,                       \
+        hashmap__generic((hashmap)), address_of((hashmap)->pairs->key, k),                         \
+        &(type_of(*(hashmap)->pairs)){0}))->value)
+
+
+// Copy the value for the specified key into `out_value`
+// Returns false (and leaves `out_value` untouched) if the key is not present
+#define concurrent_hashmap_find(hashmap, k, out_value)                                             \
+    (check_type_value(type_of((hashmap)->pairs->key), (k)),                                        \
+    (void)(check_type(type_of((hashmap)->pairs->value), (out_value))),                             \
+    concurrent_hashmap__find(&(hashmap)->_c, hashmap__generic((hashmap)),                          \
+        address_of((hashmap)->pairs->key, k), &(type_of(*(hashmap)->pairs)){0},                    \
+        (out_value), offsetof(type_of(*(hashmap)->pairs), value), sizeof(*(out_value))))
+
+
+// Delete a key-value pair if it exists
+// Returns true if the key was present
+#define concurrent_hashmap_del(hashmap, k)                                                         \
+    (check_type_value(type_of((hashmap)->pairs->key), (k)),                                        \
+    concurrent_hashmap__del(&(hashmap)->_c, hashmap__generic((hashmap)),                           \
+                            address_of((hashmap)->pairs->key, k)))
+
+
+// Number of key-value pairs in the hashmap at the time of the call
+#define concurrent_hashmap_size(hashmap) (atomic_load_relaxed(&(hashmap)->_h.size))
+
+
+// Iterate over each key-value pair (except for the default pair) in the hashmap
+// NOTE: this is not safe against concurrent writers, and should only be
+// used once all the writers are done (or while holding the writer lock)
+#define concurrent_hashmap_foreach(hashmap, pair)                   \
+    for (type_of((hashmap)->pairs) pair = (hashmap)->pairs + 1;     \
+        pair <= (hashmap)->pairs + (hashmap)->_h.size;              \
+        pair++)
+
+
+// Clear hashmap state, doesn't free keys or values,
+// since those are separately allocated on an arena
+#define concurrent_hashmap_free(hashmap) (mem_clear((hashmap)))
+
+
+#endif // MIGI_CONCURRENT_HASHMAP_H
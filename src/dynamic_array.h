@@ -104,6 +104,81 @@ do {                                                       \
 
 #endif // defined(DYNAMIC_ARRAY_USE_ARENA)
 
+
+// Dynamic array which reserves a huge amount of address space up front (64 GB by default)
+// and only commits pages of it as it grows, like Deque, so growing never moves or copies
+// the items, pointers into it stay valid, and there is never a second copy of it in memory
+// The reservation can be set by initializing `reserved` (in bytes) before the first push
+//
+// NOTE: array_pop, array_last, array_swap_remove and array_foreach work on it as well
+#include "migi_memory.h"
+
+#ifndef VARRAY_DEFAULT_RESERVE
+    #define VARRAY_DEFAULT_RESERVE 64*GB
+#endif
+
+// Smallest amount of memory that is committed at once, after which it doubles
+#ifndef VARRAY_MIN_COMMIT
+    #define VARRAY_MIN_COMMIT 64*KB
+#endif
+
+#define VArray(T)        \
+    struct {             \
+        T *data;         \
+        size_t length;   \
+        size_t capacity; \
+        size_t reserved; \
+    }
+
+#define varray_reserve(arr, len)                                                                     \
+do {                                                                                                 \
+    size_t new_length = (arr)->length + (len);                                                       \
+    if (new_length > (arr)->capacity) {                                                              \
+        (arr)->data = varray__grow((arr)->data, &(arr)->capacity, &(arr)->reserved,                  \
+                                   sizeof((arr)->data[0]), new_length);                              \
+    }                                                                                                \
+} while(0)
+
+#define varray_push(array, item)               \
+do {                                           \
+    varray_reserve((array), 1);                \
+    (array)->data[(array)->length++] = (item); \
+} while (0)
+
+#define varray_extend(array, items)                        \
+do {                                                       \
+    varray_reserve((array), (items)->length);              \
+    memcpy((array)->data + (array)->length, (items)->data, \
+            sizeof((items)->data[0]) * (items)->length);   \
+    (array)->length += (items)->length;                    \
+} while (0)
+
+#define varray_free(array)                                              \
+    ((array)->data? memory_release((array)->data, (array)->reserved): (void)0, \
+    mem_clear((array)))
+
+// Commits enough memory for `new_length` items, doubling the committed memory each time
+static void *varray__grow(void *data, size_t *capacity, size_t *reserved, size_t elem_size, size_t new_length) {
+    if (data == NULL) {
+        if (*reserved == 0) *reserved = VARRAY_DEFAULT_RESERVE;
+        *reserved = align_up_page_size(*reserved);
+        data = memory_reserve(*reserved);
+    }
+    avow(new_length <= *reserved / elem_size,
+         "varray_reserve: reserved virtual address space of %zu bytes exhausted", *reserved);
+
+    // rounding up can land below what was committed if the items are larger than a page,
+    // in which case some pages are just committed again
+    size_t committed = align_up_page_size(*capacity * elem_size);
+    size_t new_committed = max_of(committed * 2, (size_t)VARRAY_MIN_COMMIT);
+    new_committed = align_up_page_size(max_of(new_committed, new_length * elem_size));
+    new_committed = min_of(new_committed, *reserved);
+
+    memory_commit((byte *)data + committed, new_committed - committed);
+    *capacity = new_committed / elem_size;
+    return data;
+}
+
 #define array_pop(array)                                                 \
     (assertf((array)->length > 0, "array_pop: remove from empty array"), \
      (array)->data[--(array)->length])
@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #endif
 
 // TODO: Divide the functions like filesystem.h rather than using #if's inside the functions
@@ -62,6 +63,21 @@ static Str str_from_file(Arena *arena, Str filepath);
 static bool str_to_file(Str string, Str filepath);
 static bool strlist_to_file(StrList list, Str filepath);
 
+
+// A read-only view of an entire file, which is paged in by the OS as it is accessed
+typedef struct {
+    Str contents;
+    bool ok;
+#if OS_WINDOWS
+    HANDLE mapping;
+#endif
+} FileMapping;
+
+// Map a file into memory without reading it
+// NOTE: the mapping must not be written to, and stays valid even after the file is deleted
+static FileMapping file_map(Str filepath);
+static void file_unmap(FileMapping mapping);
+
 // Only defined if string_builder was also included
 #ifdef MIGI_STRING_BUILDER_H
 
@@ -380,6 +396,55 @@ static bool strlist_to_file(StrList list, Str filepath) {
     return ok;
 }
 
+static FileMapping file_map(Str filepath) {
+    FileMapping mapping = {0};
+    File file = file_open(filepath);
+    if (file == FILE_ERROR) {
+        return mapping;
+    }
+
+    Temp tmp = arena_temp();
+    int64_t length = file_length(file);
+    if (length < 0) {
+        migi_log(Log_Error, "Failed to get the length of file '%.*s': %.*s",
+                SArg(filepath), SArg(str_last_error(tmp.arena)));
+    } else if (length == 0) {
+        // empty files cannot be mapped
+        mapping.ok = true;
+    } else {
+#if OS_WINDOWS
+        mapping.mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        void *data = mapping.mapping? MapViewOfFile(mapping.mapping, FILE_MAP_READ, 0, 0, 0): NULL;
+        if (mapping.mapping && !data) CloseHandle(mapping.mapping);
+        bool mapped = data != NULL;
+#else
+        void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+        bool mapped = data != MAP_FAILED;
+#endif
+        if (mapped) {
+            mapping.contents = str_from(data, length);
+            mapping.ok = true;
+        } else {
+            migi_log(Log_Error, "Failed to map file '%.*s': %.*s",
+                    SArg(filepath), SArg(str_last_error(tmp.arena)));
+        }
+    }
+
+    arena_temp_release(tmp);
+    file_close(file);
+    return mapping;
+}
+
+static void file_unmap(FileMapping mapping) {
+    if (mapping.contents.length == 0) return;
+#if OS_WINDOWS
+    UnmapViewOfFile(mapping.contents.data);
+    CloseHandle(mapping.mapping);
+#else
+    munmap((void *)mapping.contents.data, mapping.contents.length);
+#endif
+}
+
 #ifdef MIGI_STRING_BUILDER_H
 
 static void sb_push_file(StrBuilder *sb, Str filename) {
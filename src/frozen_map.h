@@ -0,0 +1,441 @@
+#ifndef MIGI_FROZEN_MAP_H
+#define MIGI_FROZEN_MAP_H
+
+// A read-only map built once from a HashMap, using a minimal perfect hash function
+//
+// Every key maps to a distinct slot in an array of exactly `size` pairs, so a lookup is one
+// hash, one read of a small displacement table and one read of the pair, which is then
+// compared with the key. The perfect hash is built using "hash and displace" (CHD)
+// http://cmph.sourceforge.net/papers/esa09.pdf
+// Keys are split into buckets of FROZEN_MAP_BUCKET_SIZE keys on average, and each bucket
+// gets a displacement which moves all of its keys into free slots at once. Buckets are
+// placed largest first, while the table is still mostly empty.
+//
+// The whole map is a single block of memory with only relative offsets in it, so it can be
+// written to a file as is, and then used directly from a read-only mapping of that file,
+// without any parsing or rehashing on startup. String keys are copied into the block as well.
+//
+// NOTE: the custom hash and equality functions of the source HashMap are not used, since
+// the frozen map has to be usable without them: strings are compared by their contents,
+// integers by value, and any other key by its bytes. Values are copied byte for byte,
+// so they should not contain pointers if the map is to be saved and loaded in another process.
+// The file format uses the byte order of the machine that built it (little endian everywhere
+// that migi supports).
+
+#include "migi_core.h"
+#include "hash.h"
+#include "hashmap.h"
+#include "file.h"
+
+// Average number of keys in a bucket, larger buckets make the displacement table smaller,
+// but take longer to place
+#ifndef FROZEN_MAP_BUCKET_SIZE
+    #define FROZEN_MAP_BUCKET_SIZE 4
+#endif
+
+// Number of displacements tried for a bucket, before starting over with another seed
+#ifndef FROZEN_MAP_MAX_DISPLACEMENT
+    #define FROZEN_MAP_MAX_DISPLACEMENT (1u << 24)
+#endif
+
+#define FROZEN_MAP_MAGIC   0x315A52464947494Dull   // "MIGIFRZ1"
+#define FROZEN_MAP_VERSION 1
+
+// All the offsets are from the start of the header
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t key_type;      // HashMapKeyType
+    uint64_t key_size;      // size of the original key type
+    uint64_t value_size;
+    uint64_t pair_size;
+    uint64_t value_offset;  // offset of the value in a pair
+    uint64_t seed;
+    uint64_t size;          // number of keys, which is also the number of slots
+    uint64_t bucket_count;
+    uint64_t displacements; // uint32_t[bucket_count]
+    uint64_t pairs;         // pair[size + 1], the first one being the default pair
+    uint64_t strings;       // contents of string keys
+    uint64_t total_size;
+    uint64_t reserved[3];
+} FrozenMapHeader;
+
+static_assert(sizeof(FrozenMapHeader) == 128, "FrozenMapHeader must be 128 bytes");
+
+// String keys are stored as an offset into the strings section of the map
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} FrozenMapStr;
+
+typedef struct {
+    FrozenMapHeader *header;
+    uint32_t *displacements;
+    byte *pairs;
+    byte *strings;
+    FileMapping mapping;    // only set if the map was loaded from a file
+} FrozenMapView;
+
+// `_key` and `_value` are never set, and only exist to hold the types
+#define FrozenMap(k, v)     \
+    struct {                \
+        FrozenMapView _f;   \
+        k *_key;            \
+        v *_value;          \
+    }
+
+typedef struct {
+    HashMapKeyType key_type;
+    size_t key_size;
+    size_t value_size;
+    size_t value_align;
+} FrozenMapLayout;
+
+#define frozen_map__layout(frozen)                                      \
+    (FrozenMapLayout){                                                  \
+        .key_type    = hashmap__key_type(*(frozen)->_key),              \
+        .key_size    = sizeof(*(frozen)->_key),                         \
+        .value_size  = sizeof(*(frozen)->_value),                       \
+        .value_align = align_of(type_of(*(frozen)->_value)),            \
+    }
+
+
+static bool frozen_map__is_str(HashMapKeyType key_type) {
+    return key_type == HashMapKey_Str || key_type == HashMapKey_CStr;
+}
+
+static Str frozen_map__key_str(HashMapKeyType key_type, void *key) {
+    if (key_type == HashMapKey_Str) return *(Str *)key;
+    char *cstr = *(char **)key;
+    return str_from(cstr, strlen(cstr));
+}
+
+static uint64_t frozen_map__hash(HashMapKeyType key_type, void *key, size_t key_size, uint64_t seed) {
+    switch (key_type) {
+        case HashMapKey_Int: return hash_u64(hashmap__int_key(key, key_size) ^ seed);
+        case HashMapKey_Other: return hash_bytes_seed(key, key_size, seed);
+        default: {
+            Str str = frozen_map__key_str(key_type, key);
+            return hash_bytes_seed((void *)str.data, str.length, seed);
+        }
+    }
+}
+
+// The high bits of the hash pick the bucket, and all of the hash along with the displacement picks the slot
+static size_t frozen_map__bucket(uint64_t hash, uint64_t bucket_count) {
+    return (size_t)(((hash >> 32) * bucket_count) >> 32);
+}
+
+static size_t frozen_map__slot(uint64_t hash, uint32_t displacement, uint64_t size) {
+    return (size_t)(hash_u64(hash ^ (displacement * 0x9E3779B97F4A7C15ull)) % size);
+}
+
+static size_t frozen_map__key_field_size(HashMapKeyType key_type, size_t key_size) {
+    return frozen_map__is_str(key_type)? sizeof(FrozenMapStr): key_size;
+}
+
+// The value comes right after the key, and pairs are aligned for both the value and FrozenMapStr
+static size_t frozen_map__value_offset(FrozenMapLayout layout) {
+    return align_up_pow2(frozen_map__key_field_size(layout.key_type, layout.key_size), layout.value_align);
+}
+
+static size_t frozen_map__pair_size(FrozenMapLayout layout) {
+    size_t pair_align = max_of(layout.value_align, align_of(FrozenMapStr));
+    return align_up_pow2(frozen_map__value_offset(layout) + layout.value_size, pair_align);
+}
+
+
+// Finds a displacement for every bucket such that all the keys land in distinct slots
+// Returns false if some bucket couldn't be placed, in which case another seed has to be tried
+static bool frozen_map__place(uint64_t *hashes, size_t size, size_t bucket_count,
+                              uint32_t *displacements, uint32_t *key_slots, Arena *scratch) {
+    TIME_FUNCTION;
+    // counting sort of the keys by bucket
+    uint32_t *bucket_start = arena_push(scratch, uint32_t, bucket_count + 1);
+    for (size_t i = 0; i < size; i++) {
+        bucket_start[frozen_map__bucket(hashes[i], bucket_count) + 1]++;
+    }
+    uint32_t max_bucket = 0;
+    for (size_t b = 0; b < bucket_count; b++) {
+        max_bucket = max_of(max_bucket, bucket_start[b + 1]);
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    uint32_t *keys = arena_push(scratch, uint32_t, size, .zeroed=false);
+    uint32_t *fill = arena_copy(scratch, uint32_t, bucket_start, bucket_count);
+    for (size_t i = 0; i < size; i++) {
+        keys[fill[frozen_map__bucket(hashes[i], bucket_count)]++] = (uint32_t)i;
+    }
+
+    // counting sort of the buckets by their size, largest first
+    uint32_t *size_start = arena_push(scratch, uint32_t, max_bucket + 2);
+    for (size_t b = 0; b < bucket_count; b++) {
+        size_start[max_bucket - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+    }
+    for (size_t s = 0; s <= max_bucket; s++) {
+        size_start[s + 1] += size_start[s];
+    }
+    uint32_t *order = arena_push(scratch, uint32_t, bucket_count, .zeroed=false);
+    for (size_t b = 0; b < bucket_count; b++) {
+        order[size_start[max_bucket - (bucket_start[b + 1] - bucket_start[b])]++] = (uint32_t)b;
+    }
+
+    bool *taken = arena_push(scratch, bool, size);
+    uint32_t *slots = arena_push(scratch, uint32_t, max_bucket + 1, .zeroed=false);
+    for (size_t o = 0; o < bucket_count; o++) {
+        uint32_t b = order[o];
+        uint32_t *bucket_keys = keys + bucket_start[b];
+        size_t count = bucket_start[b + 1] - bucket_start[b];
+        if (count == 0) break;
+
+        bool placed = false;
+        for (uint32_t d = 0; d < FROZEN_MAP_MAX_DISPLACEMENT && !placed; d++) {
+            size_t k = 0;
+            for (; k < count; k++) {
+                size_t slot = frozen_map__slot(hashes[bucket_keys[k]], d, size);
+                if (taken[slot]) break;
+                // keys of the same bucket can't be in the same slot either
+                taken[slot] = true;
+                slots[k] = (uint32_t)slot;
+            }
+            placed = k == count;
+            if (!placed) {
+                for (size_t j = 0; j < k; j++) taken[slots[j]] = false;
+            } else {
+                displacements[b] = d;
+                for (size_t j = 0; j < count; j++) key_slots[bucket_keys[j]] = slots[j];
+            }
+        }
+        if (!placed) return false;
+    }
+    return true;
+}
+
+
+// Builds the frozen map from the pairs of a HashMap into a single allocation on the arena
+static FrozenMapHeader *hashmap__freeze(Arena *a, HashMapHeader *h, HashMapGeneric g, void *pairs,
+                                        size_t src_value_offset, FrozenMapLayout layout) {
+    TIME_FUNCTION;
+    size_t size = h->size;
+    avow(size < UINT32_MAX, "%s: too many keys to freeze: %zu", __func__, size);
+    bool is_str = frozen_map__is_str(g.key_type);
+
+    size_t value_offset = frozen_map__value_offset(layout);
+    size_t pair_size    = frozen_map__pair_size(layout);
+    size_t bucket_count = size / FROZEN_MAP_BUCKET_SIZE + 1;
+
+    size_t strings_size = 0;
+    if (is_str) {
+        for (size_t i = 1; i <= size; i++) {
+            strings_size += frozen_map__key_str(g.key_type, (byte *)pairs + i*g.elem_size).length;
+        }
+    }
+
+    FrozenMapHeader header = {
+        .magic        = FROZEN_MAP_MAGIC,
+        .version      = FROZEN_MAP_VERSION,
+        .key_type     = g.key_type,
+        .key_size     = g.key_size,
+        .value_size   = layout.value_size,
+        .pair_size    = pair_size,
+        .value_offset = value_offset,
+        .size         = size,
+        .bucket_count = bucket_count,
+    };
+    header.displacements = align_up_pow2(sizeof(FrozenMapHeader), 64);
+    header.pairs         = align_up_pow2(header.displacements + bucket_count*sizeof(uint32_t), 64);
+    header.strings       = align_up_pow2(header.pairs + (size + 1)*pair_size, 64);
+    header.total_size    = header.strings + strings_size;
+
+    byte *block = arena_push_bytes(a, header.total_size, 64);
+    uint32_t *displacements = (uint32_t *)(block + header.displacements);
+
+    Temp tmp = arena_temp_excl(a);
+    uint64_t *hashes = arena_push(tmp.arena, uint64_t, size, .zeroed=false);
+    uint32_t *key_slots = arena_push(tmp.arena, uint32_t, size, .zeroed=false);
+    for (uint64_t attempt = 0;; attempt++) {
+        avow(attempt < 64, "%s: failed to build a perfect hash, the map probably has duplicate keys", __func__);
+        header.seed = hash_u64(attempt);
+        for (size_t i = 0; i < size; i++) {
+            hashes[i] = frozen_map__hash(g.key_type, (byte *)pairs + (i + 1)*g.elem_size, g.key_size, header.seed);
+        }
+        Temp place_tmp = arena_save(tmp.arena);
+        bool placed = frozen_map__place(hashes, size, bucket_count, displacements, key_slots, tmp.arena);
+        arena_rewind(place_tmp);
+        if (placed) break;
+    }
+
+    // copy over the pairs into their slots, with the default pair at the start
+    byte *frozen_pairs = block + header.pairs;
+    byte *strings = block + header.strings;
+    size_t string_pos = 0;
+    for (size_t i = 0; i <= size; i++) {
+        byte *src = (byte *)pairs + i*g.elem_size;
+        byte *dst = frozen_pairs + (i == 0? 0: key_slots[i - 1] + 1)*pair_size;
+        if (!is_str) {
+            memcpy(dst, src, g.key_size);
+        } else if (i > 0) {
+            Str key = frozen_map__key_str(g.key_type, src);
+            memcpy(strings + string_pos, key.data, key.length);
+            *(FrozenMapStr *)dst = (FrozenMapStr){ .offset = string_pos, .length = key.length };
+            string_pos += key.length;
+        }
+        memcpy(dst + value_offset, src + src_value_offset, layout.value_size);
+    }
+    arena_temp_release(tmp);
+
+    memcpy(block, &header, sizeof(header));
+    return (FrozenMapHeader *)block;
+}
+
+
+// Checks that every string key lies within the strings section
+static bool frozen_map__strings_ok(FrozenMapHeader *header) {
+    uint64_t strings_size = header->total_size - header->strings;
+    byte *pairs = (byte *)header + header->pairs;
+    for (uint64_t i = 1; i <= header->size; i++) {
+        FrozenMapStr *key = (FrozenMapStr *)(pairs + i*header->pair_size);
+        if (key->offset > strings_size || key->length > strings_size - key->offset) return false;
+    }
+    return true;
+}
+
+// Checks that the memory holds a valid frozen map of the expected types, and sets up the view for it
+// Every offset and size in the header is checked against the others and the length of the memory
+// (dividing instead of multiplying, so that nothing can overflow), so that lookups never read out of
+// bounds even if the file is corrupt, which means going through all the string keys once as well
+static bool frozen_map__view(FrozenMapView *f, Str bytes, FrozenMapLayout layout) {
+    FrozenMapHeader *header = (FrozenMapHeader *)bytes.data;
+    char *error = NULL;
+    if (bytes.length < sizeof(FrozenMapHeader) || header->magic != FROZEN_MAP_MAGIC) {
+        error = "not a frozen map";
+    } else if (header->version != FROZEN_MAP_VERSION) {
+        error = "unsupported version";
+    } else if (header->key_type != layout.key_type || header->key_size != layout.key_size ||
+               header->value_size != layout.value_size) {
+        error = "the key or value type doesn't match";
+    } else if (header->value_offset != frozen_map__value_offset(layout) ||
+               header->pair_size != frozen_map__pair_size(layout)) {
+        error = "the layout of the pairs doesn't match";
+    } else if (header->size >= UINT32_MAX || header->bucket_count == 0 || header->bucket_count > header->size + 1) {
+        error = "corrupt number of keys or buckets";
+    } else if (header->total_size > bytes.length ||
+               header->strings > header->total_size ||
+               header->pairs > header->strings ||
+               header->displacements > header->pairs ||
+               header->displacements < sizeof(FrozenMapHeader) ||
+               header->displacements % align_of(uint32_t) != 0 ||
+               header->pairs % max_of(layout.value_align, align_of(FrozenMapStr)) != 0 ||
+               (header->strings - header->pairs) / header->pair_size < header->size + 1 ||
+               (header->pairs - header->displacements) / sizeof(uint32_t) < header->bucket_count) {
+        error = "truncated or corrupt";
+    } else if (frozen_map__is_str(layout.key_type) && !frozen_map__strings_ok(header)) {
+        error = "corrupt string keys";
+    }
+    if (error) {
+        migi_log(Log_Error, "Invalid frozen map: %s", error);
+        return false;
+    }
+
+    *f = (FrozenMapView){
+        .header        = header,
+        .displacements = (uint32_t *)((byte *)header + header->displacements),
+        .pairs         = (byte *)header + header->pairs,
+        .strings       = (byte *)header + header->strings,
+    };
+    return true;
+}
+
+static bool frozen_map__view_header(FrozenMapView *f, FrozenMapHeader *header, FrozenMapLayout layout) {
+    return frozen_map__view(f, (Str){ .data = (char *)header, .length = header->total_size }, layout);
+}
+
+static bool frozen_map__load(FrozenMapView *f, Str filepath, FrozenMapLayout layout) {
+    TIME_FUNCTION;
+    FileMapping mapping = file_map(filepath);
+    if (!mapping.ok) return false;
+    if (!frozen_map__view(f, mapping.contents, layout)) {
+        file_unmap(mapping);
+        return false;
+    }
+    f->mapping = mapping;
+    return true;
+}
+
+static bool frozen_map__key_eq(FrozenMapView *f, HashMapKeyType key_type, void *key, size_t key_size, byte *pair) {
+    if (!frozen_map__is_str(key_type)) return memcmp(key, pair, key_size) == 0;
+    FrozenMapStr *stored = (FrozenMapStr *)pair;
+    Str str = frozen_map__key_str(key_type, key);
+    return stored->length == str.length && memcmp(f->strings + stored->offset, str.data, str.length) == 0;
+}
+
+// Returns a pointer to the value for the key, or NULL if not present
+static void *frozen_map__at(FrozenMapView *f, HashMapKeyType key_type, void *key, size_t key_size) {
+    TIME_FUNCTION;
+    FrozenMapHeader *header = f->header;
+    if (header->size == 0) return NULL;
+
+    uint64_t hash = frozen_map__hash(key_type, key, key_size, header->seed);
+    uint32_t displacement = f->displacements[frozen_map__bucket(hash, header->bucket_count)];
+    byte *pair = f->pairs + (frozen_map__slot(hash, displacement, header->size) + 1)*header->pair_size;
+    if (!frozen_map__key_eq(f, key_type, key, key_size, pair)) return NULL;
+    return pair + header->value_offset;
+}
+
+static void *frozen_map__get(FrozenMapView *f, HashMapKeyType key_type, void *key, size_t key_size) {
+    void *value = frozen_map__at(f, key_type, key, key_size);
+    return value? value: f->pairs + f->header->value_offset;
+}
+
+
+// Build a frozen map from all the pairs (and the default value) of `hashmap`
+// The map is allocated on `arena`, and can be used until the arena is freed
+#define hashmap_freeze(arena, hashmap, frozen)                                                     \
+    ((void)(check_type(type_of((hashmap)->pairs->key), (frozen)->_key)),                             \
+    (void)(check_type(type_of((hashmap)->pairs->value), (frozen)->_value)),                          \
+    (void)frozen_map__view_header(&(frozen)->_f,                                                   \
+        hashmap__freeze((arena), &(hashmap)->_h, hashmap__generic((hashmap)), (hashmap)->pairs,    \
+                        offsetof(type_of(*(hashmap)->pairs), value), frozen_map__layout((frozen))), \
+        frozen_map__layout((frozen))))
+
+
+// The frozen map as a block of memory, which can be written out to a file
+#define frozen_map_bytes(frozen) \
+    ((Str){ .data = (char *)(frozen)->_f.header, .length = (frozen)->_f.header->total_size })
+
+// Write the frozen map to a file
+#define frozen_map_save(frozen, filepath) str_to_file(frozen_map_bytes((frozen)), (filepath))
+
+// Map a file written by frozen_map_save into memory, and use it as the frozen map
+// Returns false if the file couldn't be mapped, or doesn't hold a frozen map of the same types
+#define frozen_map_load(frozen, filepath) \
+    frozen_map__load(&(frozen)->_f, (filepath), frozen_map__layout((frozen)))
+
+// Use a block of memory holding a frozen map, like one returned by frozen_map_bytes
+// NOTE: the memory must be aligned to at least 64 bytes
+#define frozen_map_from_bytes(frozen, bytes) \
+    frozen_map__view(&(frozen)->_f, (bytes), frozen_map__layout((frozen)))
+
+// Unmaps the file if the map was loaded from one
+#define frozen_map_unload(frozen) \
+    (file_unmap((frozen)->_f.mapping), mem_clear(&(frozen)->_f))
+
+
+// Get a pointer to the value for the specified key
+// Returns NULL if the key is not present
+// NOTE: the value must not be modified if the map was loaded from a file
+#define frozen_map_at(frozen, k)                                                            \
+    (check_type_value(type_of(*(frozen)->_key), (k)),                                       \
+    (type_of((frozen)->_value))frozen_map__at(&(frozen)->_f, frozen_map__layout((frozen)).key_type, \
+                                              address_of(*(frozen)->_key, k), sizeof(*(frozen)->_key)))
+
+// Get the value for the specified key
+// Returns the default value if key is not present
+#define frozen_map_get(frozen, k)                                                            \
+    (check_type_value(type_of(*(frozen)->_key), (k)),                                        \
+    *(type_of((frozen)->_value))frozen_map__get(&(frozen)->_f, frozen_map__layout((frozen)).key_type, \
+                                                address_of(*(frozen)->_key, k), sizeof(*(frozen)->_key)))
+
+#define frozen_map_size(frozen) ((frozen)->_f.header->size)
+
+
+#endif // MIGI_FROZEN_MAP_H
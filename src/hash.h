@@ -0,0 +1,282 @@
+#ifndef MIGI_HASH_H
+#define MIGI_HASH_H
+
+// Fast non-cryptographic hash functions
+//
+// `hash_bytes` is the general purpose hash used by default in the hashmap and
+// for strings. Short inputs (<= 256 bytes) are mixed 16 bytes at a time using
+// 64x64 -> 128 bit multiplies, similar to wyhash (https://github.com/wangyi-fudan/wyhash)
+// Longer inputs are accumulated in 4 independent 64-bit lanes over 32 byte stripes,
+// similar to XXH3 (https://github.com/Cyan4973/xxHash), which is done with AVX2 or
+// SSE2 if they are available. All paths produce the same result, so hashes are
+// stable across builds with or without AVX2.
+//
+// NOTE: None of these are suitable for anything where an adversary may pick the input
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "migi_core.h"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define HASH__AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define HASH__SSE2 1
+#endif
+
+#if COMPILER_MSVC
+    #include <intrin.h>
+#endif
+
+// Hash `length` bytes of `data`
+// The signature matches `HashMapHashFn`, so it can directly be used in the hashmap
+static uint64_t hash_bytes(void *data, size_t length);
+static uint64_t hash_bytes_seed(void *data, size_t length, uint64_t seed);
+
+// Mix the bits of a 64-bit integer, such that every input bit affects every output bit
+// Useful for hashing integers or combining hashes
+static uint64_t hash_u64(uint64_t x);
+
+// FNV style byte-at-a-time hash, kept for compatibility with older hashes
+// Taken from https://nullprogram.com/blog/2025/01/19/
+static uint64_t hash_fnv_bytes(void *d, size_t length);
+
+
+// Inputs longer than this use the striped accumulation
+#define HASH__STRIPED_THRESHOLD 256
+#define HASH__STRIPE_SIZE 32
+#define HASH__STRIPES_PER_BLOCK 16
+
+static const uint64_t hash__secret[24] = {
+    0x8f6541836f8ed16f, 0x8c6f14b1279bb818, 0xad56f0947af235b6, 0xa6ce0afdc413db91,
+    0x0dc0f11724765106, 0xc298037899d4d9da, 0xb053ef6f024b5379, 0x913140217814cf11,
+    0x51453ea246ba2cb3, 0x1d9f795562810e94, 0x6216790fde43cac7, 0xdecfb197024b40f7,
+    0xe2a812d344cf5389, 0x495c04750af5f078, 0x4f2d257f9bac7830, 0x6dcf9577d3e150f9,
+    0x3684297a5c00eaad, 0xdcf00b8a94416de2, 0x25fa46d61643754f, 0xe7ab5be0f4f5e831,
+    0x1ad468ede05d3e17, 0x982420117496ba45, 0x4d0f3798ef274350, 0x44210b5c25e9d94c,
+};
+#define HASH__PRIME32 0x9E3779B1ull
+
+// Multiplies `a` and `b` to get a 128 bit result, storing the low half in `a` and the high half in `b`
+static void hash__mum(uint64_t *a, uint64_t *b) {
+#if COMPILER_GCC_OR_CLANG
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#elif COMPILER_MSVC && ARCH_X64
+    *a = _umul128(*a, *b, b);
+#elif COMPILER_MSVC && ARCH_ARM64
+    uint64_t lo = *a * *b;
+    *b = __umulh(*a, *b);
+    *a = lo;
+#else
+    #error "hash__mum: 128-bit multiplication not supported for this compiler/architecture"
+#endif
+}
+
+static uint64_t hash__mix(uint64_t a, uint64_t b) {
+    hash__mum(&a, &b);
+    return a ^ b;
+}
+
+// NOTE: All reads assume a little endian architecture (see ARCH_LITTLE_ENDIAN)
+static uint64_t hash__read64(byte *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash__read32(byte *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Reads 1 to 3 bytes, touching the first, middle and last byte
+static uint64_t hash__read_small(byte *p, size_t length) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+}
+
+
+#ifdef HASH__AVX2
+
+// Accumulates `stripes` stripes of 32 bytes into the 4 lanes of `acc`
+static void hash__accumulate(uint64_t acc[4], byte *p, size_t stripes, size_t secret_offset) {
+    __m256i lanes = _mm256_loadu_si256((__m256i *)acc);
+    for (size_t s = 0; s < stripes; s++) {
+        __m256i data = _mm256_loadu_si256((__m256i *)(p + s*HASH__STRIPE_SIZE));
+        __m256i key  = _mm256_loadu_si256((__m256i *)(hash__secret + secret_offset + s));
+        __m256i data_key = _mm256_xor_si256(data, key);
+        // (data_key & 0xffffffff) * (data_key >> 32) for each lane
+        __m256i product = _mm256_mul_epu32(data_key, _mm256_srli_epi64(data_key, 32));
+        lanes = _mm256_add_epi64(lanes, product);
+        // each lane also gets the raw data of its neighbour
+        lanes = _mm256_add_epi64(lanes, _mm256_permute4x64_epi64(data, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+    _mm256_storeu_si256((__m256i *)acc, lanes);
+}
+
+static void hash__scramble(uint64_t acc[4]) {
+    __m256i lanes = _mm256_loadu_si256((__m256i *)acc);
+    __m256i key   = _mm256_loadu_si256((__m256i *)(hash__secret + 19));
+    __m256i prime = _mm256_set1_epi64x(HASH__PRIME32);
+    lanes = _mm256_xor_si256(lanes, _mm256_srli_epi64(lanes, 47));
+    lanes = _mm256_xor_si256(lanes, key);
+    // 64-bit multiply by a 32-bit constant, done in two halves
+    __m256i lo = _mm256_mul_epu32(lanes, prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(lanes, 32), prime);
+    lanes = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    _mm256_storeu_si256((__m256i *)acc, lanes);
+}
+
+#elif defined(HASH__SSE2)
+
+// Same as the AVX2 version, with the 4 lanes split across two registers
+static void hash__accumulate(uint64_t acc[4], byte *p, size_t stripes, size_t secret_offset) {
+    __m128i lanes[2] = {
+        _mm_loadu_si128((__m128i *)acc),
+        _mm_loadu_si128((__m128i *)(acc + 2)),
+    };
+    for (size_t s = 0; s < stripes; s++) {
+        for (size_t j = 0; j < 2; j++) {
+            __m128i data = _mm_loadu_si128((__m128i *)(p + s*HASH__STRIPE_SIZE + 16*j));
+            __m128i key  = _mm_loadu_si128((__m128i *)(hash__secret + secret_offset + s + 2*j));
+            __m128i data_key = _mm_xor_si128(data, key);
+            __m128i product = _mm_mul_epu32(data_key, _mm_srli_epi64(data_key, 32));
+            lanes[j] = _mm_add_epi64(lanes[j], product);
+            lanes[j] = _mm_add_epi64(lanes[j], _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)));
+        }
+    }
+    _mm_storeu_si128((__m128i *)acc, lanes[0]);
+    _mm_storeu_si128((__m128i *)(acc + 2), lanes[1]);
+}
+
+static void hash__scramble(uint64_t acc[4]) {
+    __m128i prime = _mm_set1_epi64x(HASH__PRIME32);
+    for (size_t j = 0; j < 2; j++) {
+        __m128i lanes = _mm_loadu_si128((__m128i *)(acc + 2*j));
+        __m128i key   = _mm_loadu_si128((__m128i *)(hash__secret + 19 + 2*j));
+        lanes = _mm_xor_si128(lanes, _mm_srli_epi64(lanes, 47));
+        lanes = _mm_xor_si128(lanes, key);
+        __m128i lo = _mm_mul_epu32(lanes, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(lanes, 32), prime);
+        lanes = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        _mm_storeu_si128((__m128i *)(acc + 2*j), lanes);
+    }
+}
+
+#else
+
+static void hash__accumulate(uint64_t acc[4], byte *p, size_t stripes, size_t secret_offset) {
+    for (size_t s = 0; s < stripes; s++) {
+        byte *stripe = p + s*HASH__STRIPE_SIZE;
+        for (size_t j = 0; j < 4; j++) {
+            uint64_t data = hash__read64(stripe + 8*j);
+            uint64_t data_key = data ^ hash__secret[secret_offset + s + j];
+            acc[j] += (data_key & 0xffffffff) * (data_key >> 32);
+            acc[j ^ 1] += data;
+        }
+    }
+}
+
+static void hash__scramble(uint64_t acc[4]) {
+    for (size_t j = 0; j < 4; j++) {
+        acc[j] ^= acc[j] >> 47;
+        acc[j] ^= hash__secret[19 + j];
+        acc[j] *= HASH__PRIME32;
+    }
+}
+
+#endif
+
+
+static uint64_t hash_bytes_seed(void *data, size_t length, uint64_t seed) {
+    byte *p = data;
+    uint64_t a = 0, b = 0;
+    seed ^= hash__mix(seed ^ hash__secret[0], hash__secret[1]);
+
+    if (length <= 16) {
+        if (length >= 4) {
+            // reads the first and last 4 bytes, along with 4 bytes from the
+            // middle if there are more than 8, overlapping where needed
+            size_t middle = (length >> 3) << 2;
+            a = (hash__read32(p) << 32) | hash__read32(p + middle);
+            b = (hash__read32(p + length - 4) << 32) | hash__read32(p + length - 4 - middle);
+        } else if (length > 0) {
+            a = hash__read_small(p, length);
+        }
+    } else {
+        size_t i = length;
+        if (length > HASH__STRIPED_THRESHOLD) {
+            uint64_t acc[4] = {
+                seed ^ hash__secret[2], seed + hash__secret[3],
+                seed ^ hash__secret[4], seed + hash__secret[5],
+            };
+            size_t block_size = HASH__STRIPE_SIZE*HASH__STRIPES_PER_BLOCK;
+            for (; i > block_size; i -= block_size, p += block_size) {
+                hash__accumulate(acc, p, HASH__STRIPES_PER_BLOCK, 0);
+                hash__scramble(acc);
+            }
+            // the remaining stripes of the last block
+            size_t stripes = (i - 1) / HASH__STRIPE_SIZE;
+            hash__accumulate(acc, p, stripes, 0);
+            p += stripes*HASH__STRIPE_SIZE;
+            i -= stripes*HASH__STRIPE_SIZE;
+
+            seed = hash__mix(acc[0] ^ hash__secret[6], acc[1] ^ hash__secret[7])
+                 ^ hash__mix(acc[2] ^ hash__secret[8], acc[3] ^ hash__secret[9])
+                 ^ (length * hash__secret[10]);
+        }
+
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed  = hash__mix(hash__read64(p)      ^ hash__secret[11], hash__read64(p + 8)  ^ seed);
+                seed1 = hash__mix(hash__read64(p + 16) ^ hash__secret[12], hash__read64(p + 24) ^ seed1);
+                seed2 = hash__mix(hash__read64(p + 32) ^ hash__secret[13], hash__read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hash__mix(hash__read64(p) ^ hash__secret[11], hash__read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // last 16 bytes, which may overlap with the bytes that were already mixed
+        a = hash__read64(p + i - 16);
+        b = hash__read64(p + i - 8);
+    }
+
+    a ^= hash__secret[14];
+    b ^= seed;
+    hash__mum(&a, &b);
+    return hash__mix(a ^ hash__secret[15] ^ length, b ^ hash__secret[14]);
+}
+
+static uint64_t hash_bytes(void *data, size_t length) {
+    return hash_bytes_seed(data, length, 0);
+}
+
+// Finalizer from splitmix64 (http://xoshiro.di.unimi.it/splitmix64.c)
+static uint64_t hash_u64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+static uint64_t hash_fnv_bytes(void *d, size_t length) {
+    byte *data = d;
+    uint64_t h = 0x100;
+    for (size_t i = 0; i < length; i++) {
+        h ^= data[i] & 255;
+        h *= 1111111111111111111;
+    }
+    return h;
+}
+
+#endif // MIGI_HASH_H
@@ -5,6 +5,7 @@
 #include "profiler.h"
 
 #include "migi_string.h"
+#include "hash.h"
 
 #include "arena.h"
 
@@ -23,14 +24,62 @@ static_assert(HASHMAP_INIT_CAP >= 2 && (HASHMAP_INIT_CAP & (HASHMAP_INIT_CAP - 1
 #endif
 static_assert(HASHMAP_LOAD_FACTOR > 0.0 && HASHMAP_LOAD_FACTOR < 1.0, "HASHMAP_LOAD_FACTOR must be in the range (0.0, 1.0) (both exclusive)");
 
+// Define HASHMAP_USE_GROUPS to use a swiss table style layout instead of robin hood
+// linear probing. A 1-byte fingerprint of each hash is kept in a separate control
+// array, which is split into groups of 16 bytes, such that a whole group can be
+// matched against the fingerprint of a key with a single SIMD compare. The key
+// comparison function is then only called for the slots whose fingerprint matched.
+// https://abseil.io/about/design/swisstables
+#ifdef HASHMAP_USE_GROUPS
+    #define HASHMAP_GROUP_WIDTH 16
+
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #include <emmintrin.h>
+        #define HASHMAP__SSE2 1
+    #endif
+#endif
+
+// Define HASHMAP_INCREMENTAL_RESIZE to spread the cost of rehashing over the operations
+// following a resize, instead of moving every entry during the put that triggered it.
+// The old and new entry arrays coexist until all of the old entries have been moved,
+// with every put, get and del moving a bounded number of slots (HASHMAP_MIGRATE_STEP)
+// and searches looking at both arrays in the meantime.
+// NOTE: the pairs array is still reallocated in one go, which is a plain memcpy
+// (and nothing if it can be extended in place), so it is much cheaper than rehashing
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    #ifndef HASHMAP_MIGRATE_STEP
+        #define HASHMAP_MIGRATE_STEP 64
+    #endif
+    static_assert(HASHMAP_MIGRATE_STEP >= 2, "HASHMAP_MIGRATE_STEP must be at least 2");
+#endif
+
+// Number of lookups which are interleaved with each other by hashmap_get_many and hashmap_at_many
+#ifndef HASHMAP_BATCH_SIZE
+    #define HASHMAP_BATCH_SIZE 16
+#endif
+
 typedef struct {
     int max_probe_length;   // tracks the maximum probe length of a search in the hashmap's lifetime
     int total_collisions;   // tracks all the collisions in the hashmap's lifetime
  } HashMapStats;
 
+// Define HASHMAP_COMPACT_ENTRIES to use 8 byte entries instead of 16, storing only the
+// low 32 bits of the hash and a 32-bit index into the pairs array, which halves the
+// memory used by the entries (and the cache misses of probing through them).
+// The capacity of a hashmap is then limited to 2^32, which is checked when growing.
+// NOTE: the low bits of the hash are always the ones used to pick a slot, so the
+// truncated hash still works for the robin hood distance and backshift calculations
+#ifdef HASHMAP_COMPACT_ENTRIES
+    typedef uint32_t HashMapEntryField;
+    #define HASHMAP_MAX_CAPACITY ((size_t)UINT32_MAX + 1)
+#else
+    typedef uint64_t HashMapEntryField;
+    #define HASHMAP_MAX_CAPACITY (SIZE_MAX/2 + 1)
+#endif
+
 typedef struct {
-    uint64_t hash;
-    uint64_t index;         // index of an entry in the `pairs` array, the 0 index is reserved for the default value
+    HashMapEntryField hash; // (the low bits of) the hash of the key
+    HashMapEntryField index;// index of an entry in the `pairs` array, the 0 index is reserved for the default value
 } HashMapEntry;
 
 typedef uint64_t (*HashMapHashFn)(void *data, size_t size);
@@ -38,24 +87,47 @@ typedef bool (*HashMapEqFn)(void *a, void *b, size_t size);
 
 // Optional tracking of statistics
 #ifdef HASHMAP_COLLECT_STATS
-    #define HASHMAP__HEADER    \
-        HashMapEntry *entries; \
-        size_t size;           \
-        size_t capacity;       \
-        size_t _temp_index;    \
-        HashMapHashFn hash_fn; \
-        HashMapEqFn eq_fn;     \
-        HashMapStats stats;
+    #define HASHMAP__STATS HashMapStats stats;
 #else
-    #define HASHMAP__HEADER    \
-        HashMapEntry *entries; \
-        size_t size;           \
-        size_t capacity;       \
-        size_t _temp_index;    \
-        HashMapHashFn hash_fn; \
-        HashMapEqFn eq_fn;
+    #define HASHMAP__STATS
 #endif
 
+// Control bytes for the group layout, `tombstones` counts the deleted
+// slots which still need to be probed past until the next rehash
+#ifdef HASHMAP_USE_GROUPS
+    #define HASHMAP__GROUPS \
+        byte *ctrl;         \
+        size_t tombstones;
+#else
+    #define HASHMAP__GROUPS
+#endif
+
+// Entries of the previous allocation, which are yet to be moved during an
+// incremental resize. Slots before `migrate_pos` have already been moved.
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    #define HASHMAP__INCREMENTAL       \
+        HashMapEntry *old_entries;     \
+        byte *old_ctrl;                \
+        size_t old_capacity;           \
+        size_t migrate_pos;
+#else
+    #define HASHMAP__INCREMENTAL
+#endif
+
+// `pair_slots` is the reverse of the `index` of the entries, holding the slot of the entry
+// for each pair, so that the entry of a pair can be found without searching for its key
+#define HASHMAP__HEADER            \
+    HashMapEntry *entries;         \
+    HashMapEntryField *pair_slots; \
+    size_t size;                   \
+    size_t capacity;               \
+    size_t _temp_index;            \
+    HashMapHashFn hash_fn;         \
+    HashMapEqFn eq_fn;             \
+    HASHMAP__GROUPS                \
+    HASHMAP__INCREMENTAL           \
+    HASHMAP__STATS
+
 typedef struct {
     HASHMAP__HEADER
 } HashMapHeader;
@@ -76,17 +148,40 @@ typedef struct {
 typedef enum {
     HashMapKey_Str,
     HashMapKey_CStr,
+    HashMapKey_Int,
     HashMapKey_Other
 } HashMapKeyType;
 
 // Strings store a pointer and a length which needs to be followed to get the
 // actual data to be hashed, rather than hashing the raw bytes themselves
-// TODO: could also add support for integer keys where it simply uses key itself as the hash function
-#define hashmap__key_type(k)      \
-    _Generic((k),                 \
-        Str:     HashMapKey_Str,  \
-        char *:  HashMapKey_CStr, \
-        default: HashMapKey_Other)
+//
+// Integers (and any other key of 1, 2, 4 or 8 bytes, such as pointers, which
+// can't be matched with _Generic) are loaded as a single integer and hashed
+// with a bijective mixer, so that two keys are equal if and only if their
+// hashes are equal, and the search never has to look at the keys at all
+#define hashmap__key_type(k)                         \
+    _Generic((k),                                    \
+        Str:                HashMapKey_Str,          \
+        char *:             HashMapKey_CStr,         \
+        _Bool:              HashMapKey_Int,          \
+        char:               HashMapKey_Int,          \
+        signed char:        HashMapKey_Int,          \
+        unsigned char:      HashMapKey_Int,          \
+        short:              HashMapKey_Int,          \
+        unsigned short:     HashMapKey_Int,          \
+        int:                HashMapKey_Int,          \
+        unsigned int:       HashMapKey_Int,          \
+        long:               HashMapKey_Int,          \
+        unsigned long:      HashMapKey_Int,          \
+        long long:          HashMapKey_Int,          \
+        unsigned long long: HashMapKey_Int,          \
+        void *:             HashMapKey_Int,          \
+        default:            hashmap__key_type_sized(sizeof(k)))
+
+#define hashmap__key_type_sized(size)                                      \
+    (((size) == 1 || (size) == 2 || (size) == 4 || (size) == 8)            \
+        ? HashMapKey_Int                                                   \
+        : HashMapKey_Other)
 
 
 typedef struct {
@@ -105,16 +200,16 @@ typedef struct {
     }
 
 
-// TODO: move the hash functions to a hash.h and add some more stuff
-// Taken from https://nullprogram.com/blog/2025/01/19/
-static uint64_t hash_fnv_bytes(void *d, size_t length) {
-    byte *data = d;
-    uint64_t h = 0x100;
-    for (size_t i = 0; i < length; i++) {
-        h ^= data[i] & 255;
-        h *= 1111111111111111111;
-    }
-    return h;
+static uint64_t hash_cstr(void *data, size_t size) {
+    unused(size);
+    char *cstr = *(char **)data;
+    return hash_bytes(cstr, strlen(cstr));
+}
+
+static uint64_t hash_str(void *s, size_t size) {
+    unused(size);
+    Str *str = s;
+    return hash_bytes((void *)str->data, str->length);
 }
 
 static uint64_t hash_fnv_cstr(void *data, size_t size) {
@@ -149,20 +244,41 @@ static bool eq_str(void *a, void *b, size_t size) {
 }
 
 
+// Loads a key of 1, 2, 4 or 8 bytes as an integer
+static uint64_t hashmap__int_key(void *key, size_t size) {
+    switch (size) {
+        case 1: { uint8_t  k; memcpy(&k, key, sizeof(k)); return k; }
+        case 2: { uint16_t k; memcpy(&k, key, sizeof(k)); return k; }
+        case 4: { uint32_t k; memcpy(&k, key, sizeof(k)); return k; }
+        case 8: { uint64_t k; memcpy(&k, key, sizeof(k)); return k; }
+        default: migi_unreachable(); return 0;
+    }
+}
+
+static uint64_t hash_int(void *data, size_t size) {
+    return hash_u64(hashmap__int_key(data, size));
+}
+
+static bool eq_int(void *a, void *b, size_t size) {
+    return hashmap__int_key(a, size) == hashmap__int_key(b, size);
+}
+
 // Sets default equality and hash functions for some common types if not provided
 static void hashmap__init(HashMapHeader *h, HashMapKeyType key_type) {
     if (h->hash_fn == NULL) {
         switch (key_type) {
-            case HashMapKey_Str:    h->hash_fn = hash_fnv_str;   break;
-            case HashMapKey_CStr:   h->hash_fn = hash_fnv_cstr;  break;
-            case HashMapKey_Other:  h->hash_fn = hash_fnv_bytes; break;
-            default:                migi_unreachable();          break;
+            case HashMapKey_Str:    h->hash_fn = hash_str;   break;
+            case HashMapKey_CStr:   h->hash_fn = hash_cstr;  break;
+            case HashMapKey_Int:    h->hash_fn = hash_int;   break;
+            case HashMapKey_Other:  h->hash_fn = hash_bytes; break;
+            default:                migi_unreachable();      break;
         }
     }
     if (h->eq_fn == NULL) {
         switch (key_type) {
             case HashMapKey_Str:    h->eq_fn = eq_str;   break;
             case HashMapKey_CStr:   h->eq_fn = eq_cstr;  break;
+            case HashMapKey_Int:    h->eq_fn = eq_int;   break;
             case HashMapKey_Other:  h->eq_fn = eq_bytes; break;
             default:                migi_unreachable();  break;
         }
@@ -170,6 +286,89 @@ static void hashmap__init(HashMapHeader *h, HashMapKeyType key_type) {
     return;
 }
 
+// The specialized search for integers is only valid with the default hash and equality functions
+#define hashmap__use_int_search(h, g) \
+    ((g).key_type == HashMapKey_Int && (h)->hash_fn == hash_int && (h)->eq_fn == eq_int)
+
+static uint64_t hashmap__hash_key(HashMapHeader *h, HashMapGeneric g, void *key) {
+    if (hashmap__use_int_search(h, g)) return hash_u64(hashmap__int_key(key, g.key_size));
+    return h->hash_fn(key, g.key_size);
+}
+
+#ifdef HASHMAP_COMPACT_ENTRIES
+    #define hashmap__int_key_eq(h, g, pairs, i, key) \
+        (hashmap__int_key((byte *)(pairs) + (h)->entries[(i)].index * (g).elem_size, (g).key_size) == (key))
+#else
+    #define hashmap__int_key_eq(h, g, pairs, i, key) true
+#endif
+
+#ifdef HASHMAP_USE_GROUPS
+
+// Control byte states, a full slot stores the top 7 bits of its hash
+// and so always has the top bit cleared, while empty and deleted don't
+#define HASHMAP__CTRL_EMPTY   ((byte)0x80)
+#define HASHMAP__CTRL_DELETED ((byte)0xFE)
+#ifdef HASHMAP_COMPACT_ENTRIES
+    // The fingerprint must be computable from the truncated hash of an entry when it is
+    // reinserted during a resize, but the top bits of the truncated hash are also used
+    // to pick a group in large tables, so they are mixed with the rest of the hash first
+    #define hashmap__fingerprint(hash) ((byte)(((uint32_t)(hash) * 0x9E3779B1u) >> 25))
+#else
+    #define hashmap__fingerprint(hash) ((byte)((hash) >> 57))
+#endif
+
+// Returns a bitmask with a bit set for each byte in the group equal to `value`
+static uint32_t hashmap__group_match(byte *group, byte value) {
+#ifdef HASHMAP__SSE2
+    __m128i ctrl = _mm_load_si128((__m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)value)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < HASHMAP_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] == value) << i;
+    }
+    return mask;
+#endif
+}
+
+// Returns a bitmask with a bit set for each empty or deleted byte in the group
+static uint32_t hashmap__group_match_free(byte *group) {
+#ifdef HASHMAP__SSE2
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((__m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < HASHMAP_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// Groups are probed with triangular numbers which visit
+// every group exactly once when their count is a power of two
+#define hashmap__group_start(h, hash) \
+    ((hash) & ((h)->capacity - 1) & ~(size_t)(HASHMAP_GROUP_WIDTH - 1))
+
+// Inserts an entry into the first empty or deleted slot of its probe sequence
+static void hashmap__insert_entry(HashMapHeader *h, HashMapEntry entry) {
+    TIME_FUNCTION;
+    size_t pos = hashmap__group_start(h, entry.hash);
+    for (size_t stride = HASHMAP_GROUP_WIDTH;; stride += HASHMAP_GROUP_WIDTH) {
+        uint32_t free_slots = hashmap__group_match_free(h->ctrl + pos);
+        if (free_slots) {
+            size_t i = pos + trailing_zeros_32(free_slots);
+            if (h->ctrl[i] == HASHMAP__CTRL_DELETED) h->tombstones--;
+            h->ctrl[i] = hashmap__fingerprint(entry.hash);
+            h->entries[i] = entry;
+            h->pair_slots[entry.index] = (HashMapEntryField)i;
+            return;
+        }
+        pos = (pos + stride) & (h->capacity - 1);
+    }
+}
+
+#else
+
 // Uses robin hood linear probing to insert an entry
 // https://thenumb.at/Hashtables/#robin-hood-linear-probing
 static void hashmap__insert_entry(HashMapHeader *h, HashMapEntry entry) {
@@ -182,6 +381,7 @@ static void hashmap__insert_entry(HashMapHeader *h, HashMapEntry entry) {
 
         if (cur_dist < dist) {
             mem_swap(entry, h->entries[i]);
+            h->pair_slots[h->entries[i].index] = (HashMapEntryField)i;
             dist = cur_dist;
         }
 
@@ -189,19 +389,114 @@ static void hashmap__insert_entry(HashMapHeader *h, HashMapEntry entry) {
         i = (i + 1) & (h->capacity - 1);
     }
     h->entries[i] = entry;
+    h->pair_slots[entry.index] = (HashMapEntryField)i;
 }
 
+#endif // HASHMAP_USE_GROUPS
+
+#ifdef HASHMAP_USE_GROUPS
+
+// A group which still has an empty slot was never probed past, so the slot
+// can directly be marked as empty, otherwise it needs to be left as a tombstone
+static void hashmap__del_entry(HashMapHeader *h, size_t start) {
+    TIME_FUNCTION;
+    size_t group = start & ~(size_t)(HASHMAP_GROUP_WIDTH - 1);
+    if (hashmap__group_match(h->ctrl + group, HASHMAP__CTRL_EMPTY)) {
+        h->ctrl[start] = HASHMAP__CTRL_EMPTY;
+    } else {
+        h->ctrl[start] = HASHMAP__CTRL_DELETED;
+        h->tombstones++;
+    }
+    h->entries[start].index = 0;
+}
+
+#else
+
+// Backshift Erasure (https://thenumb.at/Hashtables/#erase-backward-shift)
+// Move elements back until theres an empty entry or the entry is already
+// in its desired (best possible) position
+static void hashmap__del_entry(HashMapHeader *h, size_t start) {
+    TIME_FUNCTION;
+    size_t current = start;
+    while (true) {
+        h->entries[current].index = 0;
+        size_t next = (current + 1) & (h->capacity - 1);
+
+        HashMapEntry next_entry = h->entries[next];
+        size_t next_desired = next_entry.hash & (h->capacity - 1);
+        if (next_entry.index == 0) break;
+        if (next_desired == next) break;
+
+        h->entries[current] = h->entries[next];
+        h->pair_slots[h->entries[current].index] = (HashMapEntryField)current;
+        current = next;
+    }
+}
+
+#endif // HASHMAP_USE_GROUPS
+
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+
+// A view of the old entries as a regular table, so that the usual
+// search, insert and delete functions can be used on them
+static HashMapHeader hashmap__old_table(HashMapHeader *h) {
+    HashMapHeader old = *h;
+    old.entries = h->old_entries;
+    old.capacity = h->old_capacity;
+#ifdef HASHMAP_USE_GROUPS
+    old.ctrl = h->old_ctrl;
+#endif
+    return old;
+}
+
+// Moves entries from the old table into the new one, looking at `count` slots at most.
+// Moved entries are deleted from the old table, so it is always valid to search it.
+// NOTE: with robin hood probing, deleting an entry may shift the next one back into
+// the same slot, hence a slot is only skipped once it is empty
+static void hashmap__migrate(HashMapHeader *h, size_t count) {
+    TIME_FUNCTION;
+    HashMapHeader old = hashmap__old_table(h);
+    for (size_t n = 0; n < count && h->migrate_pos < h->old_capacity; n++) {
+        size_t i = h->migrate_pos;
+        if (old.entries[i].index != 0) {
+            hashmap__insert_entry(h, old.entries[i]);
+            hashmap__del_entry(&old, i);
+        } else {
+            h->migrate_pos++;
+        }
+    }
+    if (h->migrate_pos == h->old_capacity) {
+        h->old_entries = NULL;
+        h->old_ctrl = NULL;
+        h->old_capacity = 0;
+        h->migrate_pos = 0;
+    }
+}
+
+#endif // HASHMAP_INCREMENTAL_RESIZE
+
+
 
 // Grow the hashmap and rehash all the keys into the new allocation
 // if `at_least` == 0, then the capacity is simply doubled
 static void *hashmap__grow(Arena *a, HashMapHeader *h, HashMapGeneric g, void *pairs, size_t at_least) {
     TIME_FUNCTION;
     hashmap__init(h, g.key_type);
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    // the previous resize must be finished before starting a new one
+    if (h->old_entries) hashmap__migrate(h, SIZE_MAX);
+#endif
 
     size_t old_capacity = h->capacity;
 
     if (h->capacity == 0) {
         h->capacity = HASHMAP_INIT_CAP;
+#ifdef HASHMAP_USE_GROUPS
+        h->capacity = max_of(h->capacity, HASHMAP_GROUP_WIDTH);
+    } else if (h->size < (size_t)(h->capacity * HASHMAP_LOAD_FACTOR / 2)) {
+        // the table is mostly filled with tombstones, so
+        // rehashing at the same capacity is enough to clear them
+#endif
     } else {
         h->capacity = h->capacity * 2;
     }
@@ -211,8 +506,14 @@ static void *hashmap__grow(Arena *a, HashMapHeader *h, HashMapGeneric g, void *p
         if (required_capacity > old_capacity) {
             h->capacity = next_power_of_two(required_capacity);
         }
+#ifdef HASHMAP_USE_GROUPS
+        // the ctrl array is always read a whole group at a time
+        h->capacity = max_of(h->capacity, HASHMAP_GROUP_WIDTH);
+#endif
     }
 
+    avow(h->capacity <= HASHMAP_MAX_CAPACITY, "%s: capacity of %zu is too large", __func__, h->capacity);
+
     // TODO: Shouldnt this also be an arena realloc?
     HashMapEntry *new_entries = arena_push(a, HashMapEntry, h->capacity);
 
@@ -221,9 +522,31 @@ static void *hashmap__grow(Arena *a, HashMapHeader *h, HashMapGeneric g, void *p
     size_t new_pairs_size = g.elem_size * (h->capacity + 1);
 
     void *new_pairs = arena_realloc_bytes(a, pairs, pairs_size, new_pairs_size, g.elem_align);
+    h->pair_slots = arena_realloc(a, HashMapEntryField, h->pair_slots, old_capacity + 1, h->capacity + 1);
 
     HashMapEntry *old_entries = h->entries;
     h->entries = new_entries;
+#ifdef HASHMAP_USE_GROUPS
+    byte *old_ctrl = h->ctrl;
+    h->ctrl = arena_push_bytes(a, h->capacity, HASHMAP_GROUP_WIDTH, .zeroed=false);
+    memset(h->ctrl, HASHMAP__CTRL_EMPTY, h->capacity);
+    h->tombstones = 0;
+#endif
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    // the entries are moved by the following operations instead, except when
+    // reserving, which is expected to be slow and shouldn't leave work behind
+    if (at_least == 0 && old_capacity > 0) {
+        h->old_entries  = old_entries;
+        h->old_capacity = old_capacity;
+        h->migrate_pos  = 0;
+    #ifdef HASHMAP_USE_GROUPS
+        h->old_ctrl = old_ctrl;
+    #endif
+        return new_pairs;
+    }
+#elif defined(HASHMAP_USE_GROUPS)
+    unused(old_ctrl);
+#endif
     for (size_t j = 0; j < old_capacity; j++) {
         if (old_entries[j].index != 0) {
             hashmap__insert_entry(h, old_entries[j]);
@@ -235,14 +558,126 @@ static void *hashmap__grow(Arena *a, HashMapHeader *h, HashMapGeneric g, void *p
 typedef struct {
     uint64_t hash;
     int64_t entry_index;  // -1 means item was not found
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    bool in_old_table;    // entry_index is an index into `old_entries`
+#endif
 } HashMapItem;
 
+#ifdef HASHMAP_USE_GROUPS
+
+// Integer keys are equal only if their hashes are, so only the entries need to be searched
+// NOTE: with compact entries only a part of the hash is stored, so the keys must be compared
+static HashMapItem hashmap__index_of_int(HashMapHeader *h, HashMapGeneric g, void *pairs, uint64_t key, uint64_t hash) {
+    TIME_FUNCTION;
+    unused(g); unused(pairs); unused(key);
+    HashMapItem result = { .entry_index = -1, .hash = hash };
+    byte fingerprint = hashmap__fingerprint(result.hash);
+    size_t pos = hashmap__group_start(h, result.hash);
+
+    for (size_t stride = HASHMAP_GROUP_WIDTH;; stride += HASHMAP_GROUP_WIDTH) {
+        byte *group = h->ctrl + pos;
+        for (uint32_t matches = hashmap__group_match(group, fingerprint); matches; matches &= matches - 1) {
+            size_t i = pos + trailing_zeros_32(matches);
+            if (h->entries[i].hash == (HashMapEntryField)result.hash && hashmap__int_key_eq(h, g, pairs, i, key)) {
+                result.entry_index = i;
+                return result;
+            }
+        }
+        if (hashmap__group_match(group, HASHMAP__CTRL_EMPTY)) break;
+
+#ifdef HASHMAP_COLLECT_STATS
+        h->stats.total_collisions++;
+        h->stats.max_probe_length = max_of(h->stats.max_probe_length, (int)(stride / HASHMAP_GROUP_WIDTH));
+#endif
+        pos = (pos + stride) & (h->capacity - 1);
+    }
+    return result;
+}
+
+// Matches the fingerprint of the key against a whole group at a time, and only
+// compares the keys of the matching slots. The search ends at the first group
+// containing an empty slot, as an insertion would never have probed past it.
+static HashMapItem hashmap__index_of_hashed(HashMapHeader *h, HashMapGeneric g, void *pairs, void *key, uint64_t hash) {
+    TIME_FUNCTION;
+    if (hashmap__use_int_search(h, g)) {
+        return hashmap__index_of_int(h, g, pairs, hashmap__int_key(key, g.key_size), hash);
+    }
+
+    HashMapItem result = { .entry_index = -1, .hash = hash };
+    byte fingerprint = hashmap__fingerprint(result.hash);
+    size_t pos = hashmap__group_start(h, result.hash);
+
+    for (size_t stride = HASHMAP_GROUP_WIDTH;; stride += HASHMAP_GROUP_WIDTH) {
+        byte *group = h->ctrl + pos;
+        for (uint32_t matches = hashmap__group_match(group, fingerprint); matches; matches &= matches - 1) {
+            size_t i = pos + trailing_zeros_32(matches);
+            if (h->entries[i].hash != (HashMapEntryField)result.hash) continue;
+
+            byte *map_key = (byte *)pairs + (h->entries[i].index * g.elem_size);
+            if (h->eq_fn(key, map_key, g.key_size)) {
+                result.entry_index = i;
+                return result;
+            }
+        }
+        if (hashmap__group_match(group, HASHMAP__CTRL_EMPTY)) break;
+
+#ifdef HASHMAP_COLLECT_STATS
+        h->stats.total_collisions++;
+        h->stats.max_probe_length = max_of(h->stats.max_probe_length, (int)(stride / HASHMAP_GROUP_WIDTH));
+#endif
+        pos = (pos + stride) & (h->capacity - 1);
+    }
+    return result;
+}
+
+#else
+
 // Uses robin hood linear probing to search for an entry
 // https://thenumb.at/Hashtables/#robin-hood-linear-probing
-static HashMapItem hashmap__index_of(HashMapHeader *h, HashMapGeneric g, void *pairs, void *key) {
+// Integer keys are equal only if their hashes are, so only the entries need to be searched
+// NOTE: with compact entries only a part of the hash is stored, so the keys must be compared
+static HashMapItem hashmap__index_of_int(HashMapHeader *h, HashMapGeneric g, void *pairs, uint64_t key, uint64_t hash) {
+    TIME_FUNCTION;
+    unused(g); unused(pairs); unused(key);
+    HashMapItem result = { .entry_index = -1, .hash = hash };
+    size_t i = result.hash & (h->capacity - 1);
+    size_t dist = 0;
+
+#ifdef HASHMAP_COLLECT_STATS
+    int probes = 0;
+#endif
+
+    while (h->entries[i].index != 0) {
+        if (h->entries[i].hash == (HashMapEntryField)result.hash && hashmap__int_key_eq(h, g, pairs, i, key)) {
+            result.entry_index = i;
+            break;
+        }
+
+        size_t cur_desired = h->entries[i].hash & (h->capacity - 1);
+        size_t cur_dist = (i + h->capacity - cur_desired) & (h->capacity - 1);
+        if (cur_dist < dist) {
+            break;
+        }
+
+#ifdef HASHMAP_COLLECT_STATS
+        h->stats.total_collisions++;
+        probes++;
+        h->stats.max_probe_length = max_of(h->stats.max_probe_length, probes);
+#endif
+
+        dist++;
+        i = (i + 1) & (h->capacity - 1);
+    }
+    return result;
+}
+
+static HashMapItem hashmap__index_of_hashed(HashMapHeader *h, HashMapGeneric g, void *pairs, void *key, uint64_t hash) {
     TIME_FUNCTION;
-    HashMapItem result = { .entry_index = -1 };
-    result.hash = h->hash_fn(key, g.key_size);
+    if (hashmap__use_int_search(h, g)) {
+        return hashmap__index_of_int(h, g, pairs, hashmap__int_key(key, g.key_size), hash);
+    }
+
+    HashMapItem result = { .entry_index = -1, .hash = hash };
     size_t i = result.hash & (h->capacity - 1);
     size_t dist = 0;
 
@@ -280,54 +715,164 @@ static HashMapItem hashmap__index_of(HashMapHeader *h, HashMapGeneric g, void *p
     return result;
 }
 
+#endif // HASHMAP_USE_GROUPS
+
+static HashMapItem hashmap__index_of(HashMapHeader *h, HashMapGeneric g, void *pairs, void *key) {
+    return hashmap__index_of_hashed(h, g, pairs, key, hashmap__hash_key(h, g, key));
+}
+
+
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+
+// Searches the new table, and then the old one if a resize is in progress
+static HashMapItem hashmap__find_hashed(HashMapHeader *h, HashMapGeneric g, void *pairs, void *key, uint64_t hash) {
+    HashMapItem item = hashmap__index_of_hashed(h, g, pairs, key, hash);
+    if (item.entry_index == -1 && h->old_entries) {
+        HashMapHeader old = hashmap__old_table(h);
+        item = hashmap__index_of_hashed(&old, g, pairs, key, hash);
+        item.in_old_table = item.entry_index != -1;
+    }
+    return item;
+}
+
+static HashMapItem hashmap__find(HashMapHeader *h, HashMapGeneric g, void *pairs, void *key) {
+    return hashmap__find_hashed(h, g, pairs, key, hashmap__hash_key(h, g, key));
+}
+
+static HashMapEntry *hashmap__found_entry(HashMapHeader *h, HashMapItem item) {
+    return item.in_old_table
+        ? &h->old_entries[item.entry_index]
+        : &h->entries[item.entry_index];
+}
+
+// The slot doesn't say which of the tables the entry is in, but the
+// index of a pair is only ever stored in one entry, so checking it is enough
+static HashMapEntry *hashmap__pair_entry(HashMapHeader *h, size_t index) {
+    size_t slot = h->pair_slots[index];
+    if (slot < h->capacity && h->entries[slot].index == index) {
+        return &h->entries[slot];
+    }
+    assertf(h->old_entries && slot < h->old_capacity && h->old_entries[slot].index == index,
+            "%s: pair %zu has no entry", __func__, index);
+    return &h->old_entries[slot];
+}
+
+static void hashmap__remove_entry(HashMapHeader *h, HashMapItem item) {
+    if (item.in_old_table) {
+        HashMapHeader old = hashmap__old_table(h);
+        hashmap__del_entry(&old, item.entry_index);
+    } else {
+        hashmap__del_entry(h, item.entry_index);
+    }
+}
+
+#else
+
+#define hashmap__find_hashed(h, g, pairs, key, hash) hashmap__index_of_hashed((h), (g), (pairs), (key), (hash))
+#define hashmap__find(h, g, pairs, key)   hashmap__index_of((h), (g), (pairs), (key))
+#define hashmap__found_entry(h, item)     (&(h)->entries[(item).entry_index])
+#define hashmap__remove_entry(h, item)    hashmap__del_entry((h), (item).entry_index)
+#define hashmap__pair_entry(h, index)     (&(h)->entries[(h)->pair_slots[(index)]])
+
+#endif // HASHMAP_INCREMENTAL_RESIZE
 
 
 static void *hashmap__put(Arena *a, HashMapHeader *h, HashMapGeneric g, void *pairs, void *key) {
     TIME_FUNCTION;
     void *new_pairs = pairs;
-    if (h->size >= (size_t)(h->capacity * HASHMAP_LOAD_FACTOR)) {
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    if (h->old_entries) hashmap__migrate(h, HASHMAP_MIGRATE_STEP);
+#endif
+#ifdef HASHMAP_USE_GROUPS
+    size_t used = h->size + h->tombstones;
+#else
+    size_t used = h->size;
+#endif
+    if (used >= (size_t)(h->capacity * HASHMAP_LOAD_FACTOR)) {
         new_pairs = hashmap__grow(a, h, g, pairs, 0);
     }
 
-    HashMapItem item = hashmap__index_of(h, g, pairs, key);
+    HashMapItem item = hashmap__find(h, g, pairs, key);
     if (item.entry_index == -1) {
         // new items are always inserted at the end of the table
         h->size++;
-        hashmap__insert_entry(h, (HashMapEntry){ .hash = item.hash, .index = h->size });
+        hashmap__insert_entry(h, (HashMapEntry){
+            .hash = (HashMapEntryField)item.hash,
+            .index = (HashMapEntryField)h->size
+        });
         h->_temp_index = h->size;
     } else {
-        h->_temp_index = h->entries[item.entry_index].index;
+        h->_temp_index = hashmap__found_entry(h, item)->index;
     }
     return new_pairs;
 }
 
 
 static void hashmap__get(HashMapHeader *h, HashMapGeneric g, void *pairs, void *key) {
-    HashMapItem item = hashmap__index_of(h, g, pairs, key);
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    if (h->old_entries) hashmap__migrate(h, HASHMAP_MIGRATE_STEP);
+#endif
+    HashMapItem item = hashmap__find(h, g, pairs, key);
     if (item.entry_index != -1) {
-        h->_temp_index = h->entries[item.entry_index].index;
+        h->_temp_index = hashmap__found_entry(h, item)->index;
     } else {
         h->_temp_index = 0;
     }
 }
 
-// Backshift Erasure (https://thenumb.at/Hashtables/#erase-backward-shift)
-// Move elements back until theres an empty entry or the entry is already
-// in its desired (best possible) position
-static void hashmap__del_entry(HashMapHeader *h, size_t start) {
-    TIME_FUNCTION;
-    size_t current = start;
-    while (true) {
-        h->entries[current].index = 0;
-        size_t next = (current + 1) & (h->capacity - 1);
+#ifdef HASHMAP_USE_GROUPS
 
-        HashMapEntry next_entry = h->entries[next];
-        size_t next_desired = next_entry.hash & (h->capacity - 1);
-        if (next_entry.index == 0) break;
-        if (next_desired == next) break;
+#define hashmap__first_probe(h, hash) ((h)->ctrl + hashmap__group_start((h), (hash)))
 
-        h->entries[current] = h->entries[next];
-        current = next;
+// The first slot in the group of the key with a matching fingerprint
+static size_t hashmap__likely_slot(HashMapHeader *h, uint64_t hash) {
+    size_t pos = hashmap__group_start(h, hash);
+    uint32_t matches = hashmap__group_match(h->ctrl + pos, hashmap__fingerprint(hash));
+    return matches? pos + trailing_zeros_32(matches): pos;
+}
+
+#else
+
+#define hashmap__first_probe(h, hash) (&(h)->entries[(hash) & ((h)->capacity - 1)])
+#define hashmap__likely_slot(h, hash) ((hash) & ((h)->capacity - 1))
+
+#endif // HASHMAP_USE_GROUPS
+
+// Looks up `count` keys (at most HASHMAP_BATCH_SIZE) and stores the index of the pair for
+// each of them into `indices`. Rather than searching for one key at a time, where every
+// memory access depends on the previous one, each step is done for the whole batch at once
+// while prefetching the memory needed by the next step, so that the cache misses overlap:
+// 1. hash the keys, and prefetch the start of their probe sequence
+// 2. find the slot most likely to hold each key, and prefetch its entry
+// 3. prefetch the pair pointed to by that entry
+// 4. do the actual searches, which should mostly find everything in cache by now
+static void hashmap__get_batch(HashMapHeader *h, HashMapGeneric g, void *pairs, void *keys, size_t count, size_t *indices) {
+    TIME_FUNCTION;
+    assertf(count <= HASHMAP_BATCH_SIZE, "%s: batch of %zu is too large", __func__, count);
+    if (h->capacity == 0) {
+        mem_clear_array(indices, count);
+        return;
+    }
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    if (h->old_entries) hashmap__migrate(h, HASHMAP_MIGRATE_STEP);
+#endif
+
+    uint64_t hashes[HASHMAP_BATCH_SIZE];
+    size_t slots[HASHMAP_BATCH_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        hashes[i] = hashmap__hash_key(h, g, (byte *)keys + i*g.key_size);
+        mem_prefetch(hashmap__first_probe(h, hashes[i]));
+    }
+    for (size_t i = 0; i < count; i++) {
+        slots[i] = hashmap__likely_slot(h, hashes[i]);
+        mem_prefetch(&h->entries[slots[i]]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        mem_prefetch((byte *)pairs + h->entries[slots[i]].index * g.elem_size);
+    }
+    for (size_t i = 0; i < count; i++) {
+        HashMapItem item = hashmap__find_hashed(h, g, pairs, (byte *)keys + i*g.key_size, hashes[i]);
+        indices[i] = (item.entry_index == -1)? 0: hashmap__found_entry(h, item)->index;
     }
 }
 
@@ -337,23 +882,24 @@ static void hashmap__del(HashMapHeader *h, HashMapGeneric g, void *pairs, void *
         h->_temp_index = 0;
         return;
     }
-    HashMapItem item = hashmap__index_of(h, g, pairs, key);
+#ifdef HASHMAP_INCREMENTAL_RESIZE
+    if (h->old_entries) hashmap__migrate(h, HASHMAP_MIGRATE_STEP);
+#endif
+    HashMapItem item = hashmap__find(h, g, pairs, key);
     if (item.entry_index == -1) {
         h->_temp_index = 0;
         return;
     }
 
     // Update the entry of the last key in the hashmap data array to its new index
-    byte *last_key = (byte *)pairs + (h->size * g.elem_size);
-    HashMapItem last_item = hashmap__index_of(h, g, pairs, last_key);
-    assertf(last_item.entry_index != -1, "hashmap should always have a last entry");
-
-    h->entries[last_item.entry_index].index = h->entries[item.entry_index].index;
-    h->_temp_index = h->entries[item.entry_index].index;
+    // The entry is found through `pair_slots`, rather than searching for the key again
+    h->_temp_index = hashmap__found_entry(h, item)->index;
+    hashmap__pair_entry(h, h->size)->index = (HashMapEntryField)h->_temp_index;
+    h->pair_slots[h->_temp_index] = h->pair_slots[h->size];
     assertf(h->_temp_index != 0, "nothing can map to the 0 value of the data array");
 
     h->size--;
-    hashmap__del_entry(h, item.entry_index);
+    hashmap__remove_entry(h, item);
 }
 
 
@@ -429,6 +975,46 @@ static void hashmap__del(HashMapHeader *h, HashMapGeneric g, void *pairs, void *
         : (&(hashmap)->pairs[(hashmap)->_temp_index].value)))
 
 
+// Get the values for `n` keys from the `keys` array, and write them into `out_values`
+// Missing keys get the default value
+// NOTE: this is faster than calling hashmap_get for each key on large hashmaps,
+// as lookups are done HASHMAP_BATCH_SIZE keys at a time, interleaving their cache misses
+#define hashmap_get_many(hashmap, keys, n, out_values)                                              \
+do {                                                                                                \
+    (void)(check_type(type_of((hashmap)->pairs->key), (keys)));                                     \
+    size_t hashmap__indices[HASHMAP_BATCH_SIZE];                                                    \
+    for (size_t hashmap__i = 0; hashmap__i < (size_t)(n); hashmap__i += HASHMAP_BATCH_SIZE) {       \
+        size_t hashmap__count = min_of((size_t)(n) - hashmap__i, (size_t)HASHMAP_BATCH_SIZE);       \
+        hashmap__get_batch(&(hashmap)->_h, hashmap__generic((hashmap)), (hashmap)->pairs,           \
+                           (keys) + hashmap__i, hashmap__count, hashmap__indices);                  \
+        for (size_t hashmap__j = 0; hashmap__j < hashmap__count; hashmap__j++) {                    \
+            (out_values)[hashmap__i + hashmap__j] = (hashmap)->pairs[hashmap__indices[hashmap__j]].value; \
+        }                                                                                           \
+    }                                                                                               \
+} while (0)
+
+
+// Get pointers to the values for `n` keys from the `keys` array, and write them into `out_values`
+// Missing keys get a NULL pointer
+// NOTE: this is faster than calling hashmap_at for each key on large hashmaps,
+// as lookups are done HASHMAP_BATCH_SIZE keys at a time, interleaving their cache misses
+#define hashmap_at_many(hashmap, keys, n, out_values)                                               \
+do {                                                                                                \
+    (void)(check_type(type_of((hashmap)->pairs->key), (keys)));                                     \
+    size_t hashmap__indices[HASHMAP_BATCH_SIZE];                                                    \
+    for (size_t hashmap__i = 0; hashmap__i < (size_t)(n); hashmap__i += HASHMAP_BATCH_SIZE) {       \
+        size_t hashmap__count = min_of((size_t)(n) - hashmap__i, (size_t)HASHMAP_BATCH_SIZE);       \
+        hashmap__get_batch(&(hashmap)->_h, hashmap__generic((hashmap)), (hashmap)->pairs,           \
+                           (keys) + hashmap__i, hashmap__count, hashmap__indices);                  \
+        for (size_t hashmap__j = 0; hashmap__j < hashmap__count; hashmap__j++) {                    \
+            (out_values)[hashmap__i + hashmap__j] = hashmap__indices[hashmap__j] == 0               \
+                ? NULL                                                                              \
+                : &(hashmap)->pairs[hashmap__indices[hashmap__j]].value;                            \
+        }                                                                                           \
+    }                                                                                               \
+} while (0)
+
+
 // Iterate over each key-value pair (except for the default pair) in the hashmap
 #define hashmap_foreach(hashmap, pair)                          \
     for (type_of((hashmap)->pairs) pair = (hashmap)->pairs + 1; \
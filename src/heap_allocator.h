@@ -0,0 +1,403 @@
+#ifndef MIGI_HEAP_ALLOC_H
+#define MIGI_HEAP_ALLOC_H
+
+// General purpose allocator for objects which need to be freed individually, built on top of an Arena
+//
+// Small allocations (up to HEAP_MAX_SMALL_SIZE) are rounded up to one of HEAP_CLASS_COUNT size classes
+// (16 byte steps up to 128, and then 4 classes for every power of 2), and are carved out of pages of
+// HEAP_PAGE_SIZE bytes, each holding blocks of a single size class. The pages are pushed onto the arena,
+// aligned to their size, so the page (and size class) of any pointer is found by rounding it down.
+// Larger allocations get memory of their own directly from the OS, with the same header in front.
+//
+// Each thread keeps a cache of free blocks for every size class, so allocating and freeing usually
+// doesn't take any lock. The cache is refilled from (and flushed back to) the pages of the size class
+// half a cache at a time, with a lock for each size class. A cache holds at most HEAP_CACHE_SIZE blocks,
+// and at most HEAP_CACHE_BYTES bytes of each size class, so larger classes cache fewer blocks.
+// When all the blocks of a page are freed, the page is put on a list of empty pages to be reused by any
+// size class, and once more than HEAP_MAX_EMPTY_PAGES pages are empty, the memory of the rest of them
+// is given back to the OS (see memory_decommit_lazy), since memory can't be popped from the middle of
+// an arena.
+//
+// NOTE: The thread caches belong to a single heap at a time, and are flushed when a thread uses another
+// heap, but threads must call heap_flush_thread_cache before exiting, or their cached blocks are lost.
+// Likewise, no other thread may have anything cached when a heap is freed.
+// NOTE: the memory returned by heap_alloc isn't cleared
+
+#include "migi_core.h"
+#include "migi_math.h"
+#include "arena.h"
+#include "migi_thread.h"
+#include "profiler.h"
+
+#ifdef ARENA_USE_MALLOC
+    #define heap__large_alloc(size)         malloc(size)
+    #define heap__large_release(mem, size)  (unused((size)), free((mem)))
+    #define heap__decommit_lazy(mem, size)  (unused((mem)), unused((size)))
+#else
+    #define heap__large_alloc(size)         memory_alloc(size)
+    #define heap__large_release(mem, size)  memory_release(mem, size)
+    #define heap__decommit_lazy(mem, size)  memory_decommit_lazy(mem, size)
+#endif
+
+// NOTE: must be a power of 2
+#ifndef HEAP_PAGE_SIZE
+    #define HEAP_PAGE_SIZE (256*KB)
+#endif
+static_assert((HEAP_PAGE_SIZE & (HEAP_PAGE_SIZE - 1)) == 0, "HEAP_PAGE_SIZE must be a power of 2");
+
+// Anything larger is mapped separately, which costs a couple of system calls for every allocation
+#define HEAP_MAX_SMALL_SIZE (64*KB)
+static_assert(HEAP_PAGE_SIZE >= 4*HEAP_MAX_SMALL_SIZE, "HEAP_PAGE_SIZE must fit at least 4 of the largest blocks");
+
+// Maximum number of blocks of each size class in the cache of a thread
+#ifndef HEAP_CACHE_SIZE
+    #define HEAP_CACHE_SIZE 64
+#endif
+static_assert(HEAP_CACHE_SIZE >= 2, "HEAP_CACHE_SIZE must be at least 2");
+
+// Maximum number of bytes of each size class in the cache of a thread (a cache always holds at least 2 blocks)
+#ifndef HEAP_CACHE_BYTES
+    #define HEAP_CACHE_BYTES (64*KB)
+#endif
+
+#ifndef HEAP_MAX_EMPTY_PAGES
+    #define HEAP_MAX_EMPTY_PAGES 16
+#endif
+
+// The header at the start of each page, followed by the blocks
+#define HEAP__HEADER_SIZE 64
+#define HEAP__CLASS_LARGE UINT32_MAX
+
+typedef struct HeapBlock HeapBlock;
+struct HeapBlock {
+    HeapBlock *next;
+};
+
+typedef struct Heap Heap;
+typedef struct HeapPage HeapPage;
+struct HeapPage {
+    Heap *heap;
+    HeapPage *next;         // in the list of its size class, or of empty pages
+    HeapPage *prev;
+    union {
+        struct {
+            HeapBlock *free_list;
+            uint32_t block_size;
+            uint32_t used;  // blocks which are allocated or in the cache of some thread
+            uint32_t bump;  // offset of the first block which was never handed out
+            bool listed;    // whether it is in the list of its size class
+        };
+        struct {
+            void *large_mem;
+            size_t large_size;
+        };
+    };
+    uint32_t size_class;
+};
+static_assert(sizeof(HeapPage) <= HEAP__HEADER_SIZE, "heap page header is too large");
+
+// 8 classes of 16 bytes each, followed by 4 classes for every power of 2 up to HEAP_MAX_SMALL_SIZE
+#define HEAP_CLASS_COUNT 44
+
+typedef struct {
+    _Alignas(64) SpinLock lock;     // keeps each size class on its own cache line
+    HeapPage *pages;                // pages which have free blocks
+} HeapClass;
+
+struct Heap {
+    Arena *arena;       // the pages are pushed onto it [default: created on first use and owned by the heap]
+    bool owns_arena;    // false if the arena was passed from the outside
+    SpinLock lock;      // guards the arena, the empty pages and the large allocations
+    HeapPage *large_pages;
+    HeapPage *empty_pages;
+    size_t empty_page_count;
+    size_t page_count;  // pages taken from the arena (including empty ones)
+    HeapClass classes[HEAP_CLASS_COUNT];
+};
+
+typedef struct {
+    Heap *heap;
+    HeapBlock *blocks[HEAP_CLASS_COUNT];
+    uint32_t counts[HEAP_CLASS_COUNT];
+} HeapCache;
+
+threadvar HeapCache MIGI_HEAP_CACHE = {0};
+
+static void *heap_alloc(Heap *heap, size_t size);
+static void heap_dealloc(Heap *heap, void *mem);
+
+// Resizes an allocation, moving it if it doesn't fit in its block anymore
+static void *heap_realloc(Heap *heap, void *mem, size_t new_size);
+
+// Number of bytes that can be used in an allocation (at least the size it was allocated with)
+static size_t heap_usable_size(void *mem);
+
+// Returns the blocks in the cache of the current thread to their heap
+static void heap_flush_thread_cache();
+
+// Frees all the memory of the heap (including large allocations), and the arena if it is owned by the heap
+static void heap_free(Heap *heap);
+
+
+static uint32_t heap__size_class(size_t size) {
+    if (size <= 128) return size? (uint32_t)((size - 1) >> 4): 0;
+    int k = log2_64(size - 1);
+    return (uint32_t)(8 + (k - 7)*4 + (((size - 1) - ((size_t)1 << k)) >> (k - 2)));
+}
+
+static uint32_t heap__class_size(uint32_t size_class) {
+    if (size_class < 8) return (size_class + 1) * 16;
+    uint32_t k = 7 + (size_class - 8) / 4;
+    return (1u << k) + ((size_class - 8) % 4 + 1) * (1u << (k - 2));
+}
+
+// Number of blocks of a size class a cache can hold before half of them are flushed
+static uint32_t heap__cache_limit(uint32_t size_class) {
+    uint32_t limit = (uint32_t)(HEAP_CACHE_BYTES / heap__class_size(size_class));
+    return clamp(limit, 2, HEAP_CACHE_SIZE);
+}
+
+static HeapPage *heap__page(void *mem) {
+    return (HeapPage *)align_down_pow2((uintptr_t)mem, HEAP_PAGE_SIZE);
+}
+
+static void heap__list_remove(HeapPage **list, HeapPage *page) {
+    if (page->prev) page->prev->next = page->next;
+    else *list = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->next = page->prev = NULL;
+}
+
+static void heap__list_push(HeapPage **list, HeapPage *page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list) (*list)->prev = page;
+    *list = page;
+}
+
+// Arenas only align allocations within their blocks, which are themselves only aligned to the
+// OS page size, so the padding up to the next page boundary is pushed along with the page
+static HeapPage *heap__push_page(Arena *arena) {
+    for (;;) {
+        byte *start = arena_push_bytes(arena, 0, 1, .zeroed=false);
+        size_t padding = align_up_pow2((uintptr_t)start, HEAP_PAGE_SIZE) - (uintptr_t)start;
+        byte *mem = arena_push_bytes(arena, padding + HEAP_PAGE_SIZE, 1, .zeroed=false);
+        // otherwise a chained arena moved on to a new block, or a shared one was pushed onto in between
+        if (mem == start) return (HeapPage *)(mem + padding);
+    }
+}
+
+// NOTE: called with the lock of the size class held
+static HeapPage *heap__new_page(Heap *heap, uint32_t size_class) {
+    TIME_FUNCTION;
+    spinlock_lock(&heap->lock);
+    HeapPage *page = heap->empty_pages;
+    if (page) {
+        heap__list_remove(&heap->empty_pages, page);
+        heap->empty_page_count--;
+    } else {
+        if (!heap->arena) {
+            // chained, so that the heap can keep growing
+            heap->arena = arena_init(.type = Arena_Chained, .reserve_size = 1*MB);
+            heap->owns_arena = true;
+        }
+        page = heap__push_page(heap->arena);
+        heap->page_count++;
+    }
+    spinlock_unlock(&heap->lock);
+
+    *page = (HeapPage){
+        .heap = heap,
+        .block_size = heap__class_size(size_class),
+        .bump = HEAP__HEADER_SIZE,
+        .size_class = size_class,
+    };
+    return page;
+}
+
+// NOTE: called with the lock of the size class held
+static void heap__release_page(Heap *heap, HeapPage *page) {
+    TIME_FUNCTION;
+    spinlock_lock(&heap->lock);
+    if (heap->empty_page_count >= HEAP_MAX_EMPTY_PAGES) {
+        // the header stays, since it links the page into the list
+        size_t keep = align_up_pow2(HEAP__HEADER_SIZE, arena__alignment());
+        heap__decommit_lazy((byte *)page + keep, HEAP_PAGE_SIZE - keep);
+    }
+    heap__list_push(&heap->empty_pages, page);
+    heap->empty_page_count++;
+    spinlock_unlock(&heap->lock);
+}
+
+// Moves half a cache worth of blocks from the pages of a size class into the cache
+static void heap__refill(Heap *heap, HeapCache *cache, uint32_t size_class) {
+    TIME_FUNCTION;
+    HeapClass *c = &heap->classes[size_class];
+    uint32_t batch = heap__cache_limit(size_class) / 2;
+    spinlock_lock(&c->lock);
+    uint32_t count = 0;
+    while (count < batch) {
+        HeapPage *page = c->pages;
+        if (!page) {
+            page = heap__new_page(heap, size_class);
+            heap__list_push(&c->pages, page);
+            page->listed = true;
+        }
+        while (count < batch) {
+            HeapBlock *block = page->free_list;
+            if (block) {
+                page->free_list = block->next;
+            } else if (page->bump + page->block_size <= HEAP_PAGE_SIZE) {
+                block = (HeapBlock *)((byte *)page + page->bump);
+                page->bump += page->block_size;
+            } else {
+                break;
+            }
+            block->next = cache->blocks[size_class];
+            cache->blocks[size_class] = block;
+            page->used++;
+            count++;
+        }
+        if (!page->free_list && page->bump + page->block_size > HEAP_PAGE_SIZE) {
+            heap__list_remove(&c->pages, page);
+            page->listed = false;
+        }
+    }
+    cache->counts[size_class] += count;
+    spinlock_unlock(&c->lock);
+}
+
+// Returns `count` blocks from the cache to their pages
+static void heap__flush(Heap *heap, HeapCache *cache, uint32_t size_class, uint32_t count) {
+    TIME_FUNCTION;
+    HeapClass *c = &heap->classes[size_class];
+    spinlock_lock(&c->lock);
+    for (uint32_t i = 0; i < count; i++) {
+        HeapBlock *block = cache->blocks[size_class];
+        cache->blocks[size_class] = block->next;
+
+        HeapPage *page = heap__page(block);
+        block->next = page->free_list;
+        page->free_list = block;
+        page->used--;
+        if (page->used == 0) {
+            if (page->listed) heap__list_remove(&c->pages, page);
+            page->listed = false;
+            heap__release_page(heap, page);
+        } else if (!page->listed) {
+            heap__list_push(&c->pages, page);
+            page->listed = true;
+        }
+    }
+    cache->counts[size_class] -= count;
+    spinlock_unlock(&c->lock);
+}
+
+static void heap__flush_cache(HeapCache *cache) {
+    if (!cache->heap) return;
+    for (uint32_t i = 0; i < HEAP_CLASS_COUNT; i++) {
+        if (cache->counts[i]) heap__flush(cache->heap, cache, i, cache->counts[i]);
+    }
+    cache->heap = NULL;
+}
+
+static HeapCache *heap__cache(Heap *heap) {
+    HeapCache *cache = &MIGI_HEAP_CACHE;
+    if (cache->heap != heap) {
+        heap__flush_cache(cache);
+        cache->heap = heap;
+    }
+    return cache;
+}
+
+static void *heap__alloc_large(Heap *heap, size_t size) {
+    TIME_FUNCTION;
+    // the extra page is for aligning the header to the page size
+    size_t large_size = HEAP_PAGE_SIZE + HEAP__HEADER_SIZE + size;
+    void *mem = heap__large_alloc(large_size);
+    HeapPage *page = (HeapPage *)align_up_pow2((uintptr_t)mem, HEAP_PAGE_SIZE);
+    *page = (HeapPage){
+        .heap = heap,
+        .large_mem = mem,
+        .large_size = large_size,
+        .size_class = HEAP__CLASS_LARGE,
+    };
+    spinlock_lock(&heap->lock);
+    heap__list_push(&heap->large_pages, page);
+    spinlock_unlock(&heap->lock);
+    return (byte *)page + HEAP__HEADER_SIZE;
+}
+
+static void *heap_alloc(Heap *heap, size_t size) {
+    if (size > HEAP_MAX_SMALL_SIZE) return heap__alloc_large(heap, size);
+
+    uint32_t size_class = heap__size_class(size);
+    HeapCache *cache = heap__cache(heap);
+    if (cache->counts[size_class] == 0) heap__refill(heap, cache, size_class);
+
+    HeapBlock *block = cache->blocks[size_class];
+    cache->blocks[size_class] = block->next;
+    cache->counts[size_class]--;
+    return block;
+}
+
+static void heap_dealloc(Heap *heap, void *mem) {
+    if (!mem) return;
+    HeapPage *page = heap__page(mem);
+    assertf(page->heap == heap, "%s: memory doesn't belong to this heap", __func__);
+    if (page->size_class == HEAP__CLASS_LARGE) {
+        spinlock_lock(&heap->lock);
+        heap__list_remove(&heap->large_pages, page);
+        spinlock_unlock(&heap->lock);
+        heap__large_release(page->large_mem, page->large_size);
+        return;
+    }
+
+    uint32_t size_class = page->size_class;
+    HeapCache *cache = heap__cache(heap);
+    HeapBlock *block = mem;
+    block->next = cache->blocks[size_class];
+    cache->blocks[size_class] = block;
+    cache->counts[size_class]++;
+    uint32_t limit = heap__cache_limit(size_class);
+    if (cache->counts[size_class] >= limit) {
+        heap__flush(heap, cache, size_class, limit / 2);
+    }
+}
+
+static size_t heap_usable_size(void *mem) {
+    HeapPage *page = heap__page(mem);
+    if (page->size_class == HEAP__CLASS_LARGE) {
+        return (size_t)((byte *)page->large_mem + page->large_size - (byte *)mem);
+    }
+    return page->block_size;
+}
+
+static void *heap_realloc(Heap *heap, void *mem, size_t new_size) {
+    if (!mem) return heap_alloc(heap, new_size);
+    size_t old_size = heap_usable_size(mem);
+    if (new_size <= old_size) return mem;
+
+    void *new_mem = heap_alloc(heap, new_size);
+    memcpy(new_mem, mem, old_size);
+    heap_dealloc(heap, mem);
+    return new_mem;
+}
+
+static void heap_flush_thread_cache() {
+    heap__flush_cache(&MIGI_HEAP_CACHE);
+}
+
+static void heap_free(Heap *heap) {
+    // the blocks of this heap in the cache don't need to be returned anymore
+    if (MIGI_HEAP_CACHE.heap == heap) mem_clear(&MIGI_HEAP_CACHE);
+    while (heap->large_pages) {
+        HeapPage *page = heap->large_pages;
+        heap->large_pages = page->next;
+        heap__large_release(page->large_mem, page->large_size);
+    }
+    if (heap->owns_arena) arena_free(heap->arena);
+    mem_clear(heap);
+}
+
+#endif // MIGI_HEAP_ALLOC_H
@@ -0,0 +1,259 @@
+#ifndef MIGI_INTERN_H
+#define MIGI_INTERN_H
+
+// String interning: every distinct string is stored once, and gets a small integer id
+//
+// Once interned, two strings are equal if and only if their ids are equal (or equivalently,
+// if the data pointers of their canonical strings are equal), and their hash is stored along
+// with them, so comparing and hashing interned strings never has to look at the contents again.
+// The ids can also be used as the keys of a HashMap, which then uses its fast path for integers.
+//
+// The table is a plain open addressing table of 8 byte slots, each holding an id and 32 bits
+// of the hash of its string, which are compared before the strings themselves. The strings and
+// their full hashes are kept in blocks which never move, so that the canonical strings and ids
+// stay valid for the lifetime of the interner.
+
+#include "migi_core.h"
+#include "migi_math.h"
+#include "arena.h"
+#include "hash.h"
+#include "migi_thread.h"
+#include "profiler.h"
+
+// The id of a string, 0 is never used for any string
+typedef uint32_t InternId;
+
+typedef struct {
+    Str string;     // the canonical string, which is also null terminated
+    uint64_t hash;
+} InternEntry;
+
+typedef struct {
+    InternId id;
+    uint32_t hash;  // high bits of the hash of the string, the low bits pick the slot
+} InternSlot;
+
+// The entries are stored in blocks of INTERN__FIRST_BLOCK, 2*INTERN__FIRST_BLOCK, 4*INTERN__FIRST_BLOCK...
+// entries, which is enough for ids up to UINT32_MAX
+#define INTERN__FIRST_BLOCK_LOG2 8
+#define INTERN__FIRST_BLOCK      (1u << INTERN__FIRST_BLOCK_LOG2)
+#define INTERN__BLOCK_COUNT      (32 - INTERN__FIRST_BLOCK_LOG2)
+
+typedef struct {
+    Arena *arena;       // stores the strings and the table [default: created on first use and owned by the interner]
+    bool owns_arena;    // false if the arena was passed from the outside
+    InternSlot *slots;
+    uint32_t capacity;
+    uint32_t count;     // number of interned strings, which is also the last id handed out
+    InternEntry *blocks[INTERN__BLOCK_COUNT];
+} Interner;
+
+// Intern a string, copying it into the interner if it wasn't already present
+static InternId intern(Interner *in, Str string);
+
+// Get the id of a string, returns 0 if it was never interned
+static InternId intern_find(Interner *in, Str string);
+
+// Get the canonical copy of the string for an id
+static Str intern_str(Interner *in, InternId id);
+
+// Get the hash (same as `str_hash`) of the string for an id
+static uint64_t intern_hash(Interner *in, InternId id);
+
+// Get the canonical copy of a string, interning it if required
+#define intern_canonical(in, string) intern_str((in), intern((in), (string)))
+
+// Compare two canonical strings
+#define interned_eq(a, b) ((a).data == (b).data)
+
+// Frees the memory of the interner if it owns its arena
+static void intern_free(Interner *in);
+
+
+// Shifting the indices by the size of the first block makes
+// the block of each index the position of its highest set bit
+static int intern__block(InternId id) {
+    return log2_64((size_t)id - 1 + INTERN__FIRST_BLOCK) - INTERN__FIRST_BLOCK_LOG2;
+}
+
+static InternEntry *intern__block_entry(Interner *in, InternId id) {
+    int block = intern__block(id);
+    return &in->blocks[block][(size_t)id - 1 + INTERN__FIRST_BLOCK - ((size_t)INTERN__FIRST_BLOCK << block)];
+}
+
+static InternEntry *intern__entry(Interner *in, InternId id) {
+    assertf(id != 0 && id <= in->count, "%s: invalid id %u", __func__, id);
+    return intern__block_entry(in, id);
+}
+
+static InternId intern__find_hashed(Interner *in, Str string, uint64_t hash) {
+    TIME_FUNCTION;
+    if (in->capacity == 0) return 0;
+    uint32_t fragment = (uint32_t)(hash >> 32);
+    for (size_t i = hash & (in->capacity - 1);; i = (i + 1) & (in->capacity - 1)) {
+        InternSlot slot = in->slots[i];
+        if (slot.id == 0) return 0;
+        if (slot.hash == fragment && str_eq(intern__entry(in, slot.id)->string, string)) {
+            return slot.id;
+        }
+    }
+}
+
+static void intern__insert_slot(Interner *in, InternId id, uint64_t hash) {
+    size_t i = hash & (in->capacity - 1);
+    while (in->slots[i].id != 0) {
+        i = (i + 1) & (in->capacity - 1);
+    }
+    in->slots[i] = (InternSlot){ .id = id, .hash = (uint32_t)(hash >> 32) };
+}
+
+// The table is kept at most half full, since the slots are small and
+// the strings can only be compared by going through the entries
+static void intern__grow(Interner *in) {
+    TIME_FUNCTION;
+    uint32_t capacity = in->capacity? in->capacity * 2: 64;
+    avow(capacity != 0, "%s: too many strings interned", __func__);
+
+    in->slots = arena_push(in->arena, InternSlot, capacity);
+    in->capacity = capacity;
+    for (InternId id = 1; id <= in->count; id++) {
+        intern__insert_slot(in, id, intern__entry(in, id)->hash);
+    }
+}
+
+static InternId intern__hashed(Interner *in, Str string, uint64_t hash) {
+    TIME_FUNCTION;
+    InternId id = intern__find_hashed(in, string, hash);
+    if (id != 0) return id;
+
+    if (!in->arena) {
+        in->arena = arena_init();
+        in->owns_arena = true;
+    }
+    if (2*((size_t)in->count + 1) > in->capacity) {
+        intern__grow(in);
+    }
+    avow(in->count < UINT32_MAX, "%s: too many strings interned", __func__);
+
+    id = ++in->count;
+    int block = intern__block(id);
+    if (!in->blocks[block]) {
+        in->blocks[block] = arena_push(in->arena, InternEntry, (size_t)INTERN__FIRST_BLOCK << block, .zeroed=false);
+    }
+
+    char *data = arena_push(in->arena, char, string.length + 1, .zeroed=false);
+    memcpy(data, string.data, string.length);
+    data[string.length] = 0;
+    *intern__entry(in, id) = (InternEntry){
+        .string = str_from(data, string.length),
+        .hash   = hash,
+    };
+    intern__insert_slot(in, id, hash);
+    return id;
+}
+
+static InternId intern(Interner *in, Str string) {
+    return intern__hashed(in, string, str_hash(string));
+}
+
+static InternId intern_find(Interner *in, Str string) {
+    return intern__find_hashed(in, string, str_hash(string));
+}
+
+static Str intern_str(Interner *in, InternId id) {
+    return intern__entry(in, id)->string;
+}
+
+static uint64_t intern_hash(Interner *in, InternId id) {
+    return intern__entry(in, id)->hash;
+}
+
+static void intern_free(Interner *in) {
+    if (in->owns_arena) arena_free(in->arena);
+    mem_clear(in);
+}
+
+
+// Thread-safe version of the interner, which can be used by any number of threads at once
+//
+// The strings are split into INTERN_SHARD_COUNT separate interners (by their hash), each with
+// its own lock and arena, so that threads interning different strings rarely wait on each other.
+// The ids are then the id within the shard, followed by the index of the shard, so they are
+// not dense like the ones of Interner, but are still never 0.
+//
+// Getting the string or hash of an id doesn't take any lock, since the entries never move,
+// as long as the id was obtained by the same thread, or passed to it through something
+// which synchronizes the two threads (a lock, a queue, joining a thread, etc.)
+#ifndef INTERN_SHARD_COUNT
+    #define INTERN_SHARD_COUNT 16
+#endif
+static_assert(INTERN_SHARD_COUNT >= 1 && (INTERN_SHARD_COUNT & (INTERN_SHARD_COUNT - 1)) == 0,
+              "INTERN_SHARD_COUNT must be a power of 2");
+
+typedef struct {
+    _Alignas(64) SpinLock lock;     // keeps each shard on its own cache line
+    Interner interner;
+} InternShard;
+
+typedef struct {
+    InternShard shards[INTERN_SHARD_COUNT];
+} ConcurrentInterner;
+
+static size_t concurrent_intern__shard(uint64_t hash) {
+    // the low bits pick the slot within the shard, so the high ones pick the shard
+    return (size_t)(hash >> 58) & (INTERN_SHARD_COUNT - 1);
+}
+
+static InternId concurrent_intern__id(size_t shard, InternId local_id) {
+    avow(local_id <= UINT32_MAX / INTERN_SHARD_COUNT, "%s: too many strings interned", __func__);
+    return local_id * INTERN_SHARD_COUNT + (InternId)shard;
+}
+
+static InternId concurrent_intern(ConcurrentInterner *ci, Str string) {
+    TIME_FUNCTION;
+    uint64_t hash = str_hash(string);
+    size_t shard = concurrent_intern__shard(hash);
+    InternShard *s = &ci->shards[shard];
+
+    spinlock_lock(&s->lock);
+    InternId id = intern__hashed(&s->interner, string, hash);
+    spinlock_unlock(&s->lock);
+    return concurrent_intern__id(shard, id);
+}
+
+static InternId concurrent_intern_find(ConcurrentInterner *ci, Str string) {
+    uint64_t hash = str_hash(string);
+    size_t shard = concurrent_intern__shard(hash);
+    InternShard *s = &ci->shards[shard];
+
+    spinlock_lock(&s->lock);
+    InternId id = intern__find_hashed(&s->interner, string, hash);
+    spinlock_unlock(&s->lock);
+    return id? concurrent_intern__id(shard, id): 0;
+}
+
+static InternEntry *concurrent_intern__entry(ConcurrentInterner *ci, InternId id) {
+    Interner *in = &ci->shards[id % INTERN_SHARD_COUNT].interner;
+    InternId local_id = id / INTERN_SHARD_COUNT;
+    // the count of the shard isn't checked, since it might be changing
+    assertf(local_id != 0, "%s: invalid id %u", __func__, id);
+    return intern__block_entry(in, local_id);
+}
+
+static Str concurrent_intern_str(ConcurrentInterner *ci, InternId id) {
+    return concurrent_intern__entry(ci, id)->string;
+}
+
+static uint64_t concurrent_intern_hash(ConcurrentInterner *ci, InternId id) {
+    return concurrent_intern__entry(ci, id)->hash;
+}
+
+// NOTE: must not be called while any other thread is still using the interner
+static void concurrent_intern_free(ConcurrentInterner *ci) {
+    for (size_t i = 0; i < INTERN_SHARD_COUNT; i++) {
+        intern_free(&ci->shards[i].interner);
+    }
+    mem_clear(ci);
+}
+
+#endif // MIGI_INTERN_H
@@ -399,6 +399,17 @@ do {                                                \
 
 #define mem_clear(mem) mem_clear_array(mem, 1)
 
+// Hint to the processor to start loading the cache line containing `ptr`
+// so that a later access to it doesn't have to wait as long
+#if COMPILER_GCC_OR_CLANG
+    #define mem_prefetch(ptr) __builtin_prefetch((ptr))
+#elif COMPILER_MSVC && (ARCH_X64 || ARCH_X86)
+    #include <intrin.h>
+    #define mem_prefetch(ptr) _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#else
+    #define mem_prefetch(ptr) ((void)(ptr))
+#endif
+
 
 // Iterate over a dynamic array *by reference*
 // Should be used like array_foreach(&array, i) { ... }
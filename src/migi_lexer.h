@@ -15,6 +15,7 @@
 
 #include "migi_core.h"
 #include "migi_string.h"
+#include "intern.h"
 
 #include "profiler.h"
 
@@ -114,6 +115,7 @@ typedef struct {
     union {
         double floating;
         uint64_t integer;
+        InternId id;        // only set for identifiers, if the lexer has an interner
     };
 } Token;
 
@@ -123,6 +125,7 @@ typedef struct {
     size_t start;
     size_t end;
     Token token_buf[2];
+    Interner *interner;     // if set, identifiers are interned, and their string is the canonical one
 } Lexer;
 
 // TODO: prefix functions with `lexer_` or something similar
@@ -335,6 +338,10 @@ static bool tokenize_identifier(Lexer *lexer) {
         .type = Tok_Identifier,
         .string = str_slice(lexer->string, identifier_start, lexer->end),
     };
+    if (lexer->interner) {
+        lexer->token_buf[1].id = intern(lexer->interner, lexer->token_buf[1].string);
+        lexer->token_buf[1].string = intern_str(lexer->interner, lexer->token_buf[1].id);
+    }
     return true;
 }
 
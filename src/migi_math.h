@@ -7,6 +7,8 @@
 #include <stdbool.h>
 #include <math.h>
 
+#include "migi_core.h"
+
 
 // These constants are not part of the C standard (not even e and pi!)
 // so its best to just define them in one place manually
@@ -73,6 +75,14 @@ static uint64_t rotate_left(const uint64_t x, int k);
 static int log2_64(uint64_t value);
 static int log2_32(uint32_t value);
 
+// Count the number of trailing zero bits (index of the lowest set bit)
+// NOTE: `value` must be greater than 0
+static int trailing_zeros_64(uint64_t value);
+static int trailing_zeros_32(uint32_t value);
+
+// Count the number of set bits
+static int popcount_64(uint64_t value);
+
 // Relative and absolute Tolerances for isclose
 typedef struct {
     double rel_tol; // defaults to 1e-9
@@ -166,4 +176,41 @@ int log2_32 (uint32_t value)
     return tab32[(uint32_t)(value*0x07C4ACDD) >> 27];
 }
 
+#if COMPILER_MSVC
+#include <intrin.h>
+
+static int trailing_zeros_64(uint64_t value) {
+    unsigned long index = 0;
+    _BitScanForward64(&index, value);
+    return (int)index;
+}
+
+static int trailing_zeros_32(uint32_t value) {
+    unsigned long index = 0;
+    _BitScanForward(&index, value);
+    return (int)index;
+}
+
+// __popcnt64 needs the POPCNT instruction and doesn't exist on ARM64, so the bits are summed in parallel
+static int popcount_64(uint64_t value) {
+    value = value - ((value >> 1) & 0x5555555555555555ull);
+    value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+    value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (int)((value * 0x0101010101010101ull) >> 56);
+}
+#else
+
+static int trailing_zeros_64(uint64_t value) {
+    return __builtin_ctzll(value);
+}
+
+static int trailing_zeros_32(uint32_t value) {
+    return __builtin_ctz(value);
+}
+
+static int popcount_64(uint64_t value) {
+    return __builtin_popcountll(value);
+}
+#endif
+
 #endif // ifndef MIGI_MATH_H
@@ -10,6 +10,7 @@
 #endif
 
 #include "migi_core.h"
+#include "migi_math.h"
 
 #define align_up_page_size(n) (align_up_pow2((n), memory_page_size()))
 #define align_down_page_size(n) (align_down_pow2((n), memory_page_size()))
@@ -23,6 +24,56 @@ static void *memory_commit(void *mem, size_t size);
 static void memory_decommit(void *mem, size_t size);
 static void *memory_alloc(size_t size);
 
+// Tells the OS that the contents of the memory are not needed anymore, but unlike memory_decommit
+// the memory stays accessible, and the pages are only taken back whenever the OS needs them.
+// Until then, the memory keeps its old contents, so it must not be assumed to be zero afterwards
+// On Linux this is MADV_FREE (or MADV_DONTNEED on kernels which don't support it), and MEM_RESET on Windows
+static void memory_decommit_lazy(void *mem, size_t size);
+
+// Size of a (non-gigantic) huge page on x86-64 and ARM64 with 4 KB pages
+#define MEMORY_HUGE_PAGE_SIZE (2*MB)
+
+// Reserves memory aligned to MEMORY_HUGE_PAGE_SIZE, which the OS is asked to back with transparent huge pages
+// If `use_hugetlb` is true, the memory is first taken from the preallocated pool of huge pages
+// (see /proc/sys/vm/nr_hugepages), falling back to transparent huge pages if there aren't enough
+// NOTE: `size`, and every address and size passed to the other functions for this memory,
+// must be a multiple of MEMORY_HUGE_PAGE_SIZE
+// On Windows this is the same as memory_reserve, since large pages can only be
+// allocated all at once there, and need the SeLockMemoryPrivilege privilege
+static void *memory_reserve_huge(size_t size, bool use_hugetlb);
+
+// Commits memory and faults all of it in right away, so that the first access to each page doesn't
+static void *memory_commit_populate(void *mem, size_t size);
+
+// NOTE: not implemented on Windows
+#if !OS_WINDOWS
+// Memory backed by a file, where every change is written back to the file by the OS
+// The whole reservation is mapped (shared) with read and write access right away, and committing
+// grows the file instead, so that the memory below the committed size is backed by the file
+// NOTE: memory beyond the end of the file must never be accessed (SIGBUS on Linux)
+// Returns -1 if the file couldn't be opened (or created), and sets `length` to its current size otherwise
+static int memory_open_file(const char *path, size_t *length);
+static bool memory_file_length(int file, size_t *length);
+// If `base` isn't NULL, the memory is mapped at exactly that address,
+// and NULL is returned if anything else is already mapped there
+static void *memory_reserve_file(int file, size_t size, void *base);
+// Creates a file which only exists in memory (memfd_create on Linux), which is removed once it is
+// closed by every process using it. Child processes inherit it, so it can be mapped by both
+// Returns -1 on failure
+static int memory_create_shared(const char *name);
+static void memory_commit_file(int file, size_t offset, size_t size);
+// Blocks until the changes to the memory (and the size of the file) are on the disk
+static void memory_sync_file(int file, void *mem, size_t size);
+// NOTE: the memory must be released separately (with memory_release)
+static void memory_close_file(int file);
+#endif
+
+static void memory__touch_pages(void *mem, size_t size) {
+    for (size_t i = 0; i < size; i += memory_page_size()) {
+        ((volatile byte *)mem)[i] = 0;
+    }
+}
+
 #if OS_WINDOWS
 
 static size_t memory_page_size() {
@@ -61,6 +112,25 @@ static void memory_decommit(void *mem, size_t size) {
     assertf(ret != 0, "%s: failed to decommit memory: %ld", __func__, GetLastError());
 }
 
+static void memory_decommit_lazy(void *mem, size_t size) {
+    TIME_FUNCTION;
+    if (size == 0) return;
+    void *ret = VirtualAlloc(mem, size, MEM_RESET, PAGE_READWRITE);
+    assertf(ret != NULL, "%s: failed to reset memory: %ld", __func__, GetLastError());
+}
+
+static void *memory_reserve_huge(size_t size, bool use_hugetlb) {
+    unused(use_hugetlb);
+    return memory_reserve(size);
+}
+
+static void *memory_commit_populate(void *mem, size_t size) {
+    TIME_FUNCTION;
+    memory_commit(mem, size);
+    memory__touch_pages(mem, size);
+    return mem;
+}
+
 static void *memory_alloc(size_t size) {
     TIME_FUNCTION;
     void *mem = VirtualAlloc(NULL, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
@@ -71,9 +141,17 @@ static void *memory_alloc(size_t size) {
 #else
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <errno.h>
 
+// Only defined since glibc 2.28, and kernels before 4.17 ignore it (see memory_reserve_file)
+#ifndef MAP_FIXED_NOREPLACE
+    #define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
 static size_t memory_page_size() {
     return getpagesize();
 }
@@ -105,6 +183,51 @@ static void memory_decommit(void *mem, size_t size) {
     avow(ret != -1, "%s: failed to decommit memory: %s", __func__, strerror(errno));
 }
 
+static void memory_decommit_lazy(void *mem, size_t size) {
+    TIME_FUNCTION;
+    int ret = -1;
+#ifdef MADV_FREE
+    ret = madvise(mem, size, MADV_FREE);
+#endif
+    // MADV_FREE was only added in Linux 4.5
+    if (ret == -1) ret = madvise(mem, size, MADV_DONTNEED);
+    avow(ret != -1, "%s: failed to decommit memory: %s", __func__, strerror(errno));
+}
+
+static void *memory_reserve_huge(size_t size, bool use_hugetlb) {
+    TIME_FUNCTION;
+    if (use_hugetlb) {
+        void *mem = mmap(0, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) return mem;
+    }
+
+    // mmap only aligns to the page size, so reserve an extra huge page and trim the ends
+    size_t align = MEMORY_HUGE_PAGE_SIZE;
+    byte *mem = mmap(0, size + align, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    avow(mem != MAP_FAILED, "%s: failed to map memory: %s", __func__, strerror(errno));
+    byte *aligned = (byte *)align_up_pow2((uintptr_t)mem, align);
+    if (aligned > mem) munmap(mem, aligned - mem);
+    munmap(aligned + size, mem + align - aligned);
+
+    // ignored if transparent huge pages are disabled, but never an error
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+}
+
+static void *memory_commit_populate(void *mem, size_t size) {
+    TIME_FUNCTION;
+    memory_commit(mem, size);
+    int ret = -1;
+#ifdef MADV_POPULATE_WRITE
+    ret = madvise(mem, size, MADV_POPULATE_WRITE);
+#endif
+    // MADV_POPULATE_WRITE was only added in Linux 5.14
+    // NOTE: MAP_POPULATE doesn't work here, since it only applies when mapping
+    // memory, and reserved memory is mapped without any access
+    if (ret == -1) memory__touch_pages(mem, size);
+    return mem;
+}
+
 static void *memory_alloc(size_t size) {
     TIME_FUNCTION;
     void *mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
@@ -112,6 +235,70 @@ static void *memory_alloc(size_t size) {
     return mem;
 }
 
+static int memory_open_file(const char *path, size_t *length) {
+    TIME_FUNCTION;
+    int file = open(path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (file == -1) return -1;
+    if (!memory_file_length(file, length)) {
+        close(file);
+        return -1;
+    }
+    return file;
+}
+
+static bool memory_file_length(int file, size_t *length) {
+    struct stat st = {0};
+    if (fstat(file, &st) == -1) return false;
+    *length = (size_t)st.st_size;
+    return true;
+}
+
+static void *memory_reserve_file(int file, size_t size, void *base) {
+    TIME_FUNCTION;
+    if (base) {
+        void *mem = mmap(base, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED_NOREPLACE, file, 0);
+        if (mem == MAP_FAILED) return NULL;
+        // kernels before 4.17 treat the address as a hint instead
+        if (mem != base) {
+            munmap(mem, size);
+            return NULL;
+        }
+        return mem;
+    }
+    void *mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, file, 0);
+    avow(mem != MAP_FAILED, "%s: failed to map file: %s", __func__, strerror(errno));
+    return mem;
+}
+
+static int memory_create_shared(const char *name) {
+    TIME_FUNCTION;
+    // called directly, since glibc only declares memfd_create with _GNU_SOURCE
+    // NOTE: MFD_CLOEXEC is not passed, so that the file stays open in programs run by exec
+    return (int)syscall(SYS_memfd_create, name, 0);
+}
+
+static void memory_commit_file(int file, size_t offset, size_t size) {
+    TIME_FUNCTION;
+    // Allocating the blocks up front means that running out of disk space is reported
+    // here, instead of as a SIGBUS when the memory is first written to
+    int ret = posix_fallocate(file, (off_t)offset, (off_t)size);
+    // not every file system supports it, and growing the file is then all that can be done
+    if (ret != 0 && ret != ENOSPC) ret = ftruncate(file, (off_t)(offset + size)) == -1? errno: 0;
+    avow(ret == 0, "%s: failed to grow file: %s", __func__, strerror(ret));
+}
+
+static void memory_sync_file(int file, void *mem, size_t size) {
+    TIME_FUNCTION;
+    int ret = msync(mem, size, MS_SYNC);
+    avow(ret != -1, "%s: failed to sync memory: %s", __func__, strerror(errno));
+    ret = fdatasync(file);
+    avow(ret != -1, "%s: failed to sync file: %s", __func__, strerror(errno));
+}
+
+static void memory_close_file(int file) {
+    close(file);
+}
+
 
 #endif
 #endif // MIGI_MEMORY_H
@@ -11,6 +11,7 @@
 #include <string.h>
 #include "migi_core.h"
 #include "arena.h"
+#include "hash.h"
 
 // NOTE: Cannot use S macro here since compound literals are apparently not constants on MSVC
 const Str ASCII_WHITESPACES = {.data = " \n\r\t\v\f", .length = 6};
@@ -591,7 +592,7 @@ static uint64_t str_hash_fnv(Str string, uint64_t seed) {
 }
 
 static uint64_t str_hash(Str string) {
-    return str_hash_fnv(string, 0);
+    return hash_bytes((void *)string.data, string.length);
 }
 
 static Str str__format(Arena *arena, const char *fmt, va_list args) {
@@ -0,0 +1,311 @@
+#ifndef MIGI_THREAD_H
+#define MIGI_THREAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#if OS_WINDOWS
+    #include <windows.h>
+#endif
+
+#include "migi_core.h"
+
+// Atomic operations on plain integer and pointer variables
+// NOTE: the C11 <stdatomic.h> names are avoided, so that both can be included together
+#if COMPILER_GCC_OR_CLANG
+
+#define atomic_load_relaxed(ptr)        __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define atomic_load_acquire(ptr)        __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define atomic_store_relaxed(ptr, val)  __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define atomic_store_release(ptr, val)  __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+// Returns the value before the addition
+#define atomic_add(ptr, val)            __atomic_fetch_add((ptr), (val), __ATOMIC_ACQ_REL)
+
+// Returns the previous value
+#define atomic_swap(ptr, val)           __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+
+// Sets `*ptr` to `desired` if it is equal to `*expected`, and returns true
+// Otherwise, the current value of `*ptr` is written to `*expected` and false is returned
+#define atomic_cas(ptr, expected, desired) \
+    __atomic_compare_exchange_n((ptr), (expected), (desired), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#define atomic_fence_acquire()          __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define atomic_fence_release()          __atomic_thread_fence(__ATOMIC_RELEASE)
+#define atomic_fence()                  __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#if ARCH_X64 || ARCH_X86
+    #define cpu_relax() __builtin_ia32_pause()
+#elif ARCH_ARM64
+    #define cpu_relax() __asm__ __volatile__("yield")
+#else
+    #define cpu_relax() ((void)0)
+#endif
+
+#elif COMPILER_MSVC
+
+#include <intrin.h>
+
+// Loads and stores of aligned variables are already atomic
+#define atomic_load_relaxed(ptr)        (*(volatile type_of(*(ptr)) *)(ptr))
+#define atomic_store_relaxed(ptr, val)  ((void)(*(volatile type_of(*(ptr)) *)(ptr) = (val)))
+
+#if ARCH_ARM64
+
+// ARM64 reorders loads and stores freely (and volatile is only a compiler barrier there
+// under the default /volatile:iso), so the acquire and release instructions are needed
+#define atomic_load_acquire(ptr)                                                                   \
+    (sizeof(*(ptr)) == 8 ? (type_of(*(ptr)))__ldar64((volatile unsigned __int64 *)(ptr))           \
+   : sizeof(*(ptr)) == 4 ? (type_of(*(ptr)))__ldar32((volatile unsigned __int32 *)(ptr))           \
+   : sizeof(*(ptr)) == 2 ? (type_of(*(ptr)))__ldar16((volatile unsigned __int16 *)(ptr))           \
+   :                       (type_of(*(ptr)))__ldar8((volatile unsigned __int8 *)(ptr)))
+
+#define atomic_store_release(ptr, val)                                                             \
+    (sizeof(*(ptr)) == 8 ? __stlr64((volatile unsigned __int64 *)(ptr), (unsigned __int64)(val))   \
+   : sizeof(*(ptr)) == 4 ? __stlr32((volatile unsigned __int32 *)(ptr), (unsigned __int32)(val))   \
+   : sizeof(*(ptr)) == 2 ? __stlr16((volatile unsigned __int16 *)(ptr), (unsigned __int16)(val))   \
+   :                       __stlr8((volatile unsigned __int8 *)(ptr), (unsigned __int8)(val)))
+
+#define atomic_fence_acquire()          __dmb(_ARM64_BARRIER_ISHLD)
+#define atomic_fence_release()          __dmb(_ARM64_BARRIER_ISH)
+
+#else
+
+// x86 and x64 don't reorder loads with other loads or stores with other stores, and volatile
+// accesses have acquire and release semantics under /volatile:ms (the default on those targets),
+// so they also stop the compiler from moving other accesses across them
+#define atomic_load_acquire(ptr)        (*(volatile type_of(*(ptr)) *)(ptr))
+#define atomic_store_release(ptr, val)  ((void)(*(volatile type_of(*(ptr)) *)(ptr) = (val)))
+
+#define atomic_fence_acquire()          _ReadWriteBarrier()
+#define atomic_fence_release()          _ReadWriteBarrier()
+
+#endif
+
+#define atomic_add(ptr, val)                                                                   \
+    (sizeof(*(ptr)) == 8                                                                       \
+        ? (type_of(*(ptr)))_InterlockedExchangeAdd64((volatile long long *)(ptr), (long long)(val)) \
+        : (type_of(*(ptr)))_InterlockedExchangeAdd((volatile long *)(ptr), (long)(val)))
+
+#define atomic_swap(ptr, val)                                                                  \
+    (sizeof(*(ptr)) == 8                                                                       \
+        ? (type_of(*(ptr)))_InterlockedExchange64((volatile long long *)(ptr), (long long)(val)) \
+        : (type_of(*(ptr)))_InterlockedExchange((volatile long *)(ptr), (long)(val)))
+
+#define atomic_cas(ptr, expected, desired)                                                     \
+    (sizeof(*(ptr)) == 8                                                                       \
+        ? atomic__cas64((volatile long long *)(ptr), (long long *)(expected), (long long)(desired)) \
+        : atomic__cas32((volatile long *)(ptr), (long *)(expected), (long)(desired)))
+
+static bool atomic__cas64(volatile long long *ptr, long long *expected, long long desired) {
+    long long prev = _InterlockedCompareExchange64(ptr, desired, *expected);
+    if (prev == *expected) return true;
+    *expected = prev;
+    return false;
+}
+
+static bool atomic__cas32(volatile long *ptr, long *expected, long desired) {
+    long prev = _InterlockedCompareExchange(ptr, desired, *expected);
+    if (prev == *expected) return true;
+    *expected = prev;
+    return false;
+}
+
+#define atomic_fence()                  MemoryBarrier()
+#define cpu_relax()                     YieldProcessor()
+
+#else
+    #error "atomics are not supported for this compiler"
+#endif
+
+
+// Gives up the rest of the time slice of the current thread
+static void thread_yield();
+
+// Number of logical cores that the process can run on
+static size_t thread_cpu_count();
+
+
+// A lock that spins for a while before yielding to other threads
+// Meant for short critical sections, where going to sleep costs more than waiting
+typedef struct {
+    uint32_t locked;
+} SpinLock;
+
+// Number of times to spin before starting to yield
+#ifndef SPINLOCK_SPIN_COUNT
+    #define SPINLOCK_SPIN_COUNT 64
+#endif
+
+static bool spinlock_try_lock(SpinLock *lock) {
+    return atomic_load_relaxed(&lock->locked) == 0 && atomic_swap(&lock->locked, 1) == 0;
+}
+
+static void spinlock_lock(SpinLock *lock) {
+    size_t spins = 0;
+    while (!spinlock_try_lock(lock)) {
+        if (spins < SPINLOCK_SPIN_COUNT) {
+            cpu_relax();
+            spins++;
+        } else {
+            thread_yield();
+        }
+    }
+}
+
+static void spinlock_unlock(SpinLock *lock) {
+    atomic_store_release(&lock->locked, 0);
+}
+
+
+typedef void (*ThreadFn)(void *arg);
+
+typedef struct {
+    ThreadFn fn;
+    void *arg;
+} Thread__Start;
+
+// A function which is called by every thread that armed the hook when it exits
+// Meant for giving back thread local caches, which would otherwise leak when threads come and go
+// NOTE: it isn't called for the thread which ends the process (eg. by returning from main)
+// The hook is set up on the first call to thread_exit_hook_arm, and is never destroyed
+typedef struct ThreadExitHook ThreadExitHook;
+
+// Makes the current thread call `hook->fn` when it exits (arming it again does nothing)
+static void thread_exit_hook_arm(ThreadExitHook *hook);
+
+enum {
+    ThreadExitHook__Uninit = 0,
+    ThreadExitHook__Initializing,
+    ThreadExitHook__Ready,
+};
+
+#if OS_WINDOWS
+
+typedef struct {
+    HANDLE handle;
+    Thread__Start *start;
+} Thread;
+
+static DWORD WINAPI thread__entry(LPVOID arg) {
+    Thread__Start *start = arg;
+    start->fn(start->arg);
+    return 0;
+}
+
+static Thread thread_spawn(ThreadFn fn, void *arg) {
+    Thread thread = {0};
+    thread.start = malloc(sizeof(*thread.start));
+    *thread.start = (Thread__Start){ .fn = fn, .arg = arg };
+    thread.handle = CreateThread(NULL, 0, thread__entry, thread.start, 0, NULL);
+    avow(thread.handle != NULL, "%s: failed to create thread: %ld", __func__, GetLastError());
+    return thread;
+}
+
+static void thread_join(Thread thread) {
+    WaitForSingleObject(thread.handle, INFINITE);
+    CloseHandle(thread.handle);
+    free(thread.start);
+}
+
+static void thread_yield() {
+    SwitchToThread();
+}
+
+struct ThreadExitHook {
+    void (*fn)(void);
+    uint32_t state;
+    DWORD key;
+};
+
+// Fiber local storage is used, since unlike thread local storage it can have a callback
+static void WINAPI thread__exit_hook_callback(void *data) {
+    ThreadExitHook *hook = data;
+    if (hook) hook->fn();
+}
+
+static void thread_exit_hook_arm(ThreadExitHook *hook) {
+    uint32_t state = ThreadExitHook__Uninit;
+    if (atomic_cas(&hook->state, &state, ThreadExitHook__Initializing)) {
+        hook->key = FlsAlloc(thread__exit_hook_callback);
+        avow(hook->key != FLS_OUT_OF_INDEXES, "%s: failed to allocate key: %ld", __func__, GetLastError());
+        atomic_store_release(&hook->state, ThreadExitHook__Ready);
+    }
+    while (atomic_load_acquire(&hook->state) != ThreadExitHook__Ready) cpu_relax();
+    FlsSetValue(hook->key, hook);
+}
+
+static size_t thread_cpu_count() {
+    SYSTEM_INFO info = {0};
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+
+typedef struct {
+    pthread_t handle;
+    Thread__Start *start;
+} Thread;
+
+static void *thread__entry(void *arg) {
+    Thread__Start *start = arg;
+    start->fn(start->arg);
+    return NULL;
+}
+
+static Thread thread_spawn(ThreadFn fn, void *arg) {
+    Thread thread = {0};
+    thread.start = malloc(sizeof(*thread.start));
+    *thread.start = (Thread__Start){ .fn = fn, .arg = arg };
+    int ret = pthread_create(&thread.handle, NULL, thread__entry, thread.start);
+    avow(ret == 0, "%s: failed to create thread: %s", __func__, strerror(ret));
+    return thread;
+}
+
+static void thread_join(Thread thread) {
+    pthread_join(thread.handle, NULL);
+    free(thread.start);
+}
+
+static void thread_yield() {
+    sched_yield();
+}
+
+struct ThreadExitHook {
+    void (*fn)(void);
+    uint32_t state;
+    pthread_key_t key;
+};
+
+static void thread__exit_hook_callback(void *data) {
+    ThreadExitHook *hook = data;
+    hook->fn();
+}
+
+static void thread_exit_hook_arm(ThreadExitHook *hook) {
+    uint32_t state = ThreadExitHook__Uninit;
+    if (atomic_cas(&hook->state, &state, ThreadExitHook__Initializing)) {
+        int ret = pthread_key_create(&hook->key, thread__exit_hook_callback);
+        avow(ret == 0, "%s: failed to create key: %s", __func__, strerror(ret));
+        atomic_store_release(&hook->state, ThreadExitHook__Ready);
+    }
+    while (atomic_load_acquire(&hook->state) != ThreadExitHook__Ready) cpu_relax();
+    // the destructor is only called for non-NULL values
+    pthread_setspecific(hook->key, hook);
+}
+
+static size_t thread_cpu_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0? (size_t)count: 1;
+}
+
+#endif // OS_WINDOWS
+
+#endif // MIGI_THREAD_H
@@ -3,104 +3,463 @@
 
 #include "arena.h"
 #include "migi_core.h"
+#include "migi_math.h"
+#include "migi_thread.h"
 
-#define POOL_ALLOC_ACTIVE (PoolItem *)0x1
-
+// Number of items in the first chunk of a pool (unless `capacity` is set before the first allocation)
 #ifndef POOL_ALLOC_DEFAULT_CAP
     #define POOL_ALLOC_DEFAULT_CAP 256
 #endif
 
+// Each chunk is twice as large as the previous one, so this is never reached in practice
+#define POOL_ALLOC_MAX_CHUNKS 64
+
+// The `next` of an item also holds the index of its chunk in the top bits (which are
+// never part of a user space address), and this bit while the item is allocated
+#define POOL_ALLOC_ACTIVE 0x1
+#define POOL__CHUNK_SHIFT 58
+static_assert(sizeof(uintptr_t) == 8, "pools need 64 bit pointers");
+
 typedef struct PoolItem PoolItem;
 struct PoolItem {
     PoolItem *next;
     byte data[];
 };
 
+// The items are stored in chunks, each twice as large as the previous one,
+// and the items never move once they are allocated
+// Each chunk has a bit for every item, which is set while it is allocated, so that
+// pool_foreach only has to look at the allocated items, instead of all of them
+typedef struct {
+    size_t capacity;
+    size_t used;        // items after this were never allocated since the chunk was created or reset
+    byte *items;
+    uint64_t occupied[];
+} PoolChunk;
+
 // Used to create a pool allocator for storing a particular type
 #define PoolAlloc(T)             \
     union {                      \
         T *_item;                \
         struct {                 \
-            PoolItem *data;      \
+            PoolChunk **chunks;  \
+            size_t chunk_count;  \
+            size_t current;      \
             size_t length;       \
             size_t capacity;     \
             PoolItem *free_list; \
         };                       \
     }
 
-static void *pool_alloc_bytes(Arena *arena, size_t capacity, size_t elem_size,
-                       PoolItem **free_list, size_t *length, PoolItem **data);
-
-#define pool_alloc(arena, pool)                                                             \
-    (type_of((pool)->_item)) pool__alloc((arena), sizeof(*(pool)->_item), &(pool)->capacity, \
-                                        &(pool)->free_list, &(pool)->length, &(pool)->data)
+#define pool_alloc(arena, pool)                                                               \
+    (type_of((pool)->_item)) pool__alloc((arena), sizeof(*(pool)->_item), &(pool)->capacity,   \
+                                        &(pool)->free_list, &(pool)->length, &(pool)->chunks, \
+                                        &(pool)->chunk_count, &(pool)->current)
 
-#define pool_dealloc(pool, elem) \
-    *((type_of((pool)->_item)) pool__dealloc(elem, &(pool)->free_list, &(pool)->length))
+#define pool_dealloc(pool, elem)                                                             \
+    *((type_of((pool)->_item)) pool__dealloc(elem, sizeof(*(pool)->_item), (pool)->chunks, \
+                                             &(pool)->free_list, &(pool)->length))
 
 #define pool_reset(pool) \
-    pool__reset((byte *)(pool)->data, sizeof(*(pool)->_item), (pool)->capacity, &(pool)->free_list, &(pool)->length)
+    pool__reset((pool)->chunks, (pool)->chunk_count, &(pool)->current, &(pool)->free_list, &(pool)->length)
 
-#define pool_foreach(pool, elem)                                                                         \
-    for (type_of((pool)->_item) elem = (type_of((pool)->_item))(pool)->data->data;                         \
-        pool__item(elem) < pool__item_index((pool)->data, sizeof(*(pool)->_item), (pool)->capacity);     \
-        elem = (type_of((pool)->_item))(pool__item_next(pool__item(elem), sizeof(*(pool)->_item)))->data) \
-        if ((pool__item(elem))->next == POOL_ALLOC_ACTIVE)
+// Iterates over the allocated items of all the chunks
+#define pool_foreach(pool, elem)                                                                     \
+    for (PoolIter elem##_iter = { .chunks = (pool)->chunks, .chunk_count = (pool)->chunk_count },      \
+             *elem##_once = &elem##_iter;                                                           \
+         elem##_once;                                                                               \
+         elem##_once = NULL)                                                                        \
+        for (type_of((pool)->_item) elem = pool__next(&elem##_iter, sizeof(*(pool)->_item));       \
+             elem;                                                                                  \
+             elem = pool__next(&elem##_iter, sizeof(*(pool)->_item)))
 
 // Internal implementation macros
-#define pool__item(elem)                          (PoolItem *)((uintptr_t)(elem) - offsetof(PoolItem, data))
+#define pool__item(elem)                          ((PoolItem *)((uintptr_t)(elem) - offsetof(PoolItem, data)))
 #define pool__item_size(elem_size)                align_up_pow2(sizeof(PoolItem) + (elem_size), align_of(PoolItem))
-#define pool__item_index(start, elem_size, index) (PoolItem *)((uintptr_t)(start) + pool__item_size((elem_size))*(index)) 
-#define pool__item_next(pool_item, elem_size)     (PoolItem *)((uintptr_t)(pool_item) + pool__item_size((elem_size)))
+#define pool__item_index(start, elem_size, index) ((PoolItem *)((uintptr_t)(start) + pool__item_size((elem_size))*(index)))
+#define pool__chunk_words(capacity)               (((capacity) + 63) / 64)
+
+#define pool__tag(next, chunk_index, flags) \
+    (PoolItem *)((uintptr_t)(next) | ((uintptr_t)(chunk_index) << POOL__CHUNK_SHIFT) | (flags))
+#define pool__chunk_index(next)    (size_t)((uintptr_t)(next) >> POOL__CHUNK_SHIFT)
+#define pool__next_free(next)      (PoolItem *)((uintptr_t)(next) & (((uintptr_t)1 << POOL__CHUNK_SHIFT) - 1))
 
 
-static void *pool__alloc(Arena *arena, size_t elem_size, size_t *capacity,
-                              PoolItem **free_list, size_t *length, PoolItem **data) {
-    if (*data == NULL) {
-        if (*capacity == 0) {
-            *capacity = POOL_ALLOC_DEFAULT_CAP;
+typedef struct {
+    PoolChunk **chunks;
+    size_t chunk_count;
+    size_t chunk;       // index of the chunk being visited
+    size_t word;        // next word of its bitmap to load
+    uint64_t bits;      // bits of the items from the previous word which weren't visited yet
+} PoolIter;
+
+static void *pool__next(PoolIter *iter, size_t elem_size) {
+    while (iter->chunk < iter->chunk_count) {
+        PoolChunk *chunk = iter->chunks[iter->chunk];
+        if (iter->bits) {
+            size_t index = (iter->word - 1)*64 + trailing_zeros_64(iter->bits);
+            iter->bits &= iter->bits - 1;
+            return pool__item_index(chunk->items, elem_size, index)->data;
+        }
+        if (iter->word < pool__chunk_words(chunk->used)) {
+            iter->bits = chunk->occupied[iter->word++];
+        } else {
+            iter->chunk++;
+            iter->word = 0;
         }
-        *data = arena_push_bytes(arena, pool__item_size(elem_size) * *capacity, align_of(PoolItem), .zeroed=false);
     }
+    return NULL;
+}
 
-    assertf(*length < *capacity, "pool_alloc_bytes: pool out of capacity");
+// Moves on to the next chunk, which is pushed onto the arena if there isn't one already
+static void pool__next_chunk(Arena *arena, size_t elem_size, size_t *capacity,
+                             PoolChunk ***chunks, size_t *chunk_count, size_t *current) {
+    if (*chunk_count > 0 && *current + 1 < *chunk_count) {
+        (*current)++;
+        return;
+    }
 
+    // before the first chunk, `capacity` is the size it should have
+    size_t chunk_capacity = POOL_ALLOC_DEFAULT_CAP;
+    if (*chunk_count == 0) {
+        if (*capacity) chunk_capacity = *capacity;
+        *capacity = 0;
+        *chunks = arena_push(arena, PoolChunk *, POOL_ALLOC_MAX_CHUNKS);
+    } else {
+        chunk_capacity = (*chunks)[*chunk_count - 1]->capacity * 2;
+    }
+    avow(*chunk_count < POOL_ALLOC_MAX_CHUNKS, "pool_alloc: too many chunks");
+
+    size_t bitmap_size = pool__chunk_words(chunk_capacity)*sizeof(uint64_t);
+    PoolChunk *chunk = arena_push_bytes(arena, sizeof(PoolChunk) + bitmap_size + pool__item_size(elem_size)*chunk_capacity,
+                                        align_of(PoolChunk), .zeroed=false);
+    chunk->capacity = chunk_capacity;
+    chunk->used = 0;
+    chunk->items = (byte *)chunk->occupied + bitmap_size;
+    mem_clear_array((byte *)chunk->occupied, bitmap_size);
+
+    *current = *chunk_count;
+    (*chunks)[(*chunk_count)++] = chunk;
+    *capacity += chunk_capacity;
+}
+
+static void *pool__alloc(Arena *arena, size_t elem_size, size_t *capacity, PoolItem **free_list,
+                         size_t *length, PoolChunk ***chunks, size_t *chunk_count, size_t *current) {
     PoolItem *item = NULL;
+    size_t chunk_index = 0;
     if (*free_list) {
         item = *free_list;
-        *free_list = (*free_list)->next;
+        chunk_index = pool__chunk_index(item->next);
+        *free_list = pool__next_free(item->next);
     } else {
-        item = pool__item_index(*data, elem_size, *length);
+        if (*chunk_count == 0 || (*chunks)[*current]->used == (*chunks)[*current]->capacity) {
+            pool__next_chunk(arena, elem_size, capacity, chunks, chunk_count, current);
+        }
+        chunk_index = *current;
+        PoolChunk *chunk = (*chunks)[chunk_index];
+        item = pool__item_index(chunk->items, elem_size, chunk->used);
+        chunk->used++;
     }
-    // used in pool_foreach to check whether the `pool_item` is active or not
-    item->next = POOL_ALLOC_ACTIVE;
+    // the bit is what pool_foreach looks at, the tag is what pool_dealloc looks at
+    PoolChunk *chunk = (*chunks)[chunk_index];
+    size_t index = ((byte *)item - chunk->items) / pool__item_size(elem_size);
+    chunk->occupied[index / 64] |= 1ull << (index % 64);
+    item->next = pool__tag(NULL, chunk_index, POOL_ALLOC_ACTIVE);
 
     (*length)++;
     mem_clear_array(item->data, elem_size);
     return item->data;
 }
 
-static void *pool__dealloc(void *elem, PoolItem **free_list, size_t *length) {
+static void *pool__dealloc(void *elem, size_t elem_size, PoolChunk **chunks, PoolItem **free_list, size_t *length) {
     if (elem == NULL || *length == 0) {
         return NULL;
     }
 
     PoolItem *pool_item = pool__item(elem);
-    assertf(pool_item->next == POOL_ALLOC_ACTIVE, "pool_dealloc_bytes: double free");
+    assertf((uintptr_t)pool_item->next & POOL_ALLOC_ACTIVE, "pool_dealloc_bytes: double free");
+
+    size_t chunk_index = pool__chunk_index(pool_item->next);
+    PoolChunk *chunk = chunks[chunk_index];
+    size_t index = ((byte *)pool_item - chunk->items) / pool__item_size(elem_size);
+    chunk->occupied[index / 64] &= ~(1ull << (index % 64));
 
-    pool_item->next = *free_list;
+    pool_item->next = pool__tag(*free_list, chunk_index, 0);
     *free_list = pool_item;
     (*length)--;
 
     return pool_item->data;
 }
 
-static void pool__reset(byte *data, size_t elem_size, size_t capacity, PoolItem **free_list, size_t *length) {
+// The chunks are kept, and reused from the first one onwards
+static void pool__reset(PoolChunk **chunks, size_t chunk_count, size_t *current, PoolItem **free_list, size_t *length) {
+    for (size_t i = 0; i < chunk_count; i++) {
+        mem_clear_array((byte *)chunks[i]->occupied, pool__chunk_words(chunks[i]->used)*sizeof(uint64_t));
+        chunks[i]->used = 0;
+    }
+    *current = 0;
     *free_list = NULL;
     *length = 0;
-    mem_clear_array(data, pool__item_size(elem_size)*capacity);
 }
 
 
+// Thread-safe version of the pool, which can be allocated from and freed to by any number of threads
+//
+// Each thread keeps a magazine (a small free list) of items for the last few pools it used, so
+// allocating and freeing usually doesn't touch anything shared. When a magazine runs dry, a batch
+// of POOL_MAGAZINE_BATCH items is popped off a lock-free stack of batches shared by all the threads,
+// and when it fills up, a batch is pushed back, so an item allocated by one thread and freed by
+// another only costs a compare and swap every POOL_MAGAZINE_BATCH items. Only when there are no
+// batches left are new items carved out of the chunks, with a lock.
+//
+// The items have the same layout as the ones of PoolAlloc. Chunk `i` holds POOL_ALLOC_DEFAULT_CAP << i
+// items, so every item is numbered across all the chunks, and the stack refers to items by their
+// 32 bit number instead of their address. The first word of the data of the first item of a batch
+// links it to the next batch, with the number of items in the top 32 bits, and the head of the stack
+// counts every change in its top 32 bits, so that a batch being popped and pushed back in between
+// doesn't go unnoticed (an ABA). The counter only wraps around after 2^32 pushes and pops, which takes
+// minutes even when every thread does nothing else, so a pop would have to stall for that long
+// (and then see exactly the same count) to go wrong.
+//
+// NOTE: a pop reads the link of the batch at the head it loaded, which may already have been popped by
+// another thread and be in use, being written to without any atomics. That read is a deliberate data race
+// (the value is thrown away, since the exchange then fails as the counter moved on), and is harmless
+// because the items are never handed back to the arena
+//
+// NOTE: threads must call concurrent_pool_flush_thread_cache before exiting, or their cached
+// items are lost, and no other thread may have anything cached when a pool is freed
+// NOTE: there is no pool_foreach or length, since the items are spread over the threads
+// NOTE: concurrent_pool_dealloc doesn't return the item, since another thread might already have it
+
+// Maximum number of items in the magazine of a thread
+#ifndef POOL_MAGAZINE_SIZE
+    #define POOL_MAGAZINE_SIZE 64
+#endif
+#define POOL_MAGAZINE_BATCH (POOL_MAGAZINE_SIZE / 2)
+static_assert(POOL_MAGAZINE_BATCH >= 1 && POOL_MAGAZINE_BATCH < (1 << 16), "POOL_MAGAZINE_SIZE is out of range");
+
+// Number of pools that a thread keeps a magazine for at once
+#ifndef POOL_MAGAZINE_COUNT
+    #define POOL_MAGAZINE_COUNT 4
+#endif
+
+// Every item must have a 32 bit number, which limits the pool to about 4 billion items
+#define POOL__MAX_CHUNKS 32
+
+typedef struct {
+    _Alignas(64) uint64_t batches;  // the stack of full batches, keeps it on its own cache line
+    _Alignas(64) SpinLock lock;     // guards everything below
+    Arena *arena;       // the chunks are pushed onto it [default: created on first use and owned by the pool]
+    bool owns_arena;    // false if the arena was passed from the outside
+    size_t elem_size;
+    byte *chunks[POOL__MAX_CHUNKS];
+    uint32_t chunk_count;   // also read without the lock, to find the items of the stack
+    size_t chunk_used;      // number of items carved out of the last chunk
+    size_t capacity;        // number of items in all the chunks
+} ConcurrentPool;
+
+// Used to create a concurrent pool allocator for storing a particular type
+#define ConcurrentPoolAlloc(T) \
+    union {                    \
+        T *_item;              \
+        ConcurrentPool pool;   \
+    }
+
+#define concurrent_pool_alloc(cpool) \
+    (type_of((cpool)->_item)) concurrent_pool__alloc(&(cpool)->pool, sizeof(*(cpool)->_item))
+
+#define concurrent_pool_dealloc(cpool, elem) \
+    concurrent_pool__dealloc(&(cpool)->pool, check_type(type_of(*(cpool)->_item), (elem)))
+
+#define concurrent_pool_free(cpool) concurrent_pool__free(&(cpool)->pool)
+
+// Returns the items in the magazines of the current thread to their pools
+static void concurrent_pool_flush_thread_cache();
+
+
+typedef struct {
+    ConcurrentPool *pool;
+    PoolItem *items;
+    uint32_t count;
+} PoolMagazine;
+
+typedef struct {
+    PoolMagazine magazines[POOL_MAGAZINE_COUNT];
+    uint32_t next_evicted;
+} PoolMagazines;
+
+threadvar PoolMagazines MIGI_POOL_MAGAZINES = {0};
+
+#define concurrent_pool__batch_link(item) (*(uint64_t *)(item)->data)
+
+#define concurrent_pool__chunk_capacity(chunk_index) ((size_t)POOL_ALLOC_DEFAULT_CAP << (chunk_index))
+// number of the first item of a chunk
+#define concurrent_pool__chunk_start(chunk_index)    ((size_t)POOL_ALLOC_DEFAULT_CAP * (((size_t)1 << (chunk_index)) - 1))
+
+// The stack and the links hold the number of an item plus 1 in their low 32 bits, so that 0 is the empty stack
+static uint64_t concurrent_pool__pack(uint32_t number, uint64_t top) {
+    return (uint64_t)number | (top << 32);
+}
+
+static PoolItem *concurrent_pool__item(ConcurrentPool *pool, uint32_t number) {
+    size_t index = number - 1;
+    size_t chunk_index = log2_64(index / POOL_ALLOC_DEFAULT_CAP + 1);
+    byte *chunk = atomic_load_relaxed(&pool->chunks[chunk_index]);
+    return pool__item_index(chunk, pool->elem_size, index - concurrent_pool__chunk_start(chunk_index));
+}
+
+static uint32_t concurrent_pool__number(ConcurrentPool *pool, PoolItem *item) {
+    size_t item_size = pool__item_size(pool->elem_size);
+    for (uint32_t i = atomic_load_acquire(&pool->chunk_count); i-- > 0;) {
+        uintptr_t chunk = (uintptr_t)atomic_load_relaxed(&pool->chunks[i]);
+        if ((uintptr_t)item >= chunk && (uintptr_t)item - chunk < concurrent_pool__chunk_capacity(i)*item_size) {
+            return (uint32_t)(concurrent_pool__chunk_start(i) + ((uintptr_t)item - chunk) / item_size + 1);
+        }
+    }
+    avow(false, "%s: item doesn't belong to the pool", __func__);
+    return 0;
+}
+
+static void concurrent_pool__push_batch(ConcurrentPool *pool, PoolItem *batch, uint32_t count) {
+    uint32_t number = concurrent_pool__number(pool, batch);
+    uint64_t head = atomic_load_relaxed(&pool->batches);
+    for (;;) {
+        atomic_store_relaxed(&concurrent_pool__batch_link(batch), concurrent_pool__pack((uint32_t)head, count));
+        uint64_t desired = concurrent_pool__pack(number, (head >> 32) + 1);
+        if (atomic_cas(&pool->batches, &head, desired)) return;
+    }
+}
+
+static PoolItem *concurrent_pool__pop_batch(ConcurrentPool *pool, uint32_t *count) {
+    uint64_t head = atomic_load_acquire(&pool->batches);
+    for (;;) {
+        if ((uint32_t)head == 0) return NULL;
+        PoolItem *batch = concurrent_pool__item(pool, (uint32_t)head);
+        // might already be stale (and in use by another thread), in which case
+        // the exchange fails since the counter moved on (see ConcurrentPool)
+        uint64_t link = atomic_load_relaxed(&concurrent_pool__batch_link(batch));
+        uint64_t desired = concurrent_pool__pack((uint32_t)link, (head >> 32) + 1);
+        if (atomic_cas(&pool->batches, &head, desired)) {
+            *count = (uint32_t)(link >> 32);
+            return batch;
+        }
+    }
+}
+
+// Carves out up to POOL_MAGAZINE_BATCH new items, moving on to a new chunk (twice as large) if needed
+static PoolItem *concurrent_pool__carve(ConcurrentPool *pool, uint32_t *count) {
+    size_t item_size = pool__item_size(pool->elem_size);
+    spinlock_lock(&pool->lock);
+    uint32_t chunk_count = pool->chunk_count;
+    if (chunk_count == 0 || pool->chunk_used == concurrent_pool__chunk_capacity(chunk_count - 1)) {
+        if (!pool->arena) {
+            // chained, so that the pool can keep growing
+            pool->arena = arena_init(.type = Arena_Chained, .reserve_size = 1*MB);
+            pool->owns_arena = true;
+        }
+        size_t chunk_capacity = concurrent_pool__chunk_capacity(chunk_count);
+        avow(chunk_count < POOL__MAX_CHUNKS && pool->capacity + chunk_capacity < UINT32_MAX,
+             "%s: too many items in the pool", __func__);
+        pool->chunks[chunk_count] = arena_push_bytes(pool->arena, item_size*chunk_capacity, align_of(PoolItem), .zeroed=false);
+        // the chunk has to be there before anything can look for its items
+        chunk_count++;
+        atomic_store_release(&pool->chunk_count, chunk_count);
+        pool->chunk_used = 0;
+        pool->capacity += chunk_capacity;
+    }
+    size_t carved = min_of(concurrent_pool__chunk_capacity(chunk_count - 1) - pool->chunk_used, (size_t)POOL_MAGAZINE_BATCH);
+    PoolItem *first = pool__item_index(pool->chunks[chunk_count - 1], pool->elem_size, pool->chunk_used);
+    pool->chunk_used += carved;
+    spinlock_unlock(&pool->lock);
+
+    for (size_t i = 0; i < carved; i++) {
+        PoolItem *item = pool__item_index(first, pool->elem_size, i);
+        item->next = i + 1 < carved? pool__item_index(first, pool->elem_size, i + 1): NULL;
+    }
+    *count = (uint32_t)carved;
+    return first;
+}
+
+// Pushes the first `count` items of the magazine as a batch
+static void concurrent_pool__flush(PoolMagazine *m, uint32_t count) {
+    PoolItem *batch = m->items;
+    PoolItem *last = batch;
+    for (uint32_t i = 1; i < count; i++) last = last->next;
+    m->items = last->next;
+    m->count -= count;
+    last->next = NULL;
+    concurrent_pool__push_batch(m->pool, batch, count);
+}
+
+static void concurrent_pool__flush_magazine(PoolMagazine *m) {
+    if (m->pool && m->count) concurrent_pool__flush(m, m->count);
+    mem_clear(m);
+}
+
+static PoolMagazine *concurrent_pool__magazine(ConcurrentPool *pool) {
+    PoolMagazines *ms = &MIGI_POOL_MAGAZINES;
+    for (size_t i = 0; i < POOL_MAGAZINE_COUNT; i++) {
+        if (ms->magazines[i].pool == pool) return &ms->magazines[i];
+    }
+    PoolMagazine *m = &ms->magazines[ms->next_evicted];
+    ms->next_evicted = (ms->next_evicted + 1) % POOL_MAGAZINE_COUNT;
+    concurrent_pool__flush_magazine(m);
+    m->pool = pool;
+    return m;
+}
+
+static void *concurrent_pool__alloc(ConcurrentPool *pool, size_t elem_size) {
+    PoolMagazine *m = concurrent_pool__magazine(pool);
+    if (m->count == 0) {
+        if (!atomic_load_relaxed(&pool->elem_size)) {
+            spinlock_lock(&pool->lock);
+            if (!pool->elem_size) atomic_store_relaxed(&pool->elem_size, elem_size);
+            spinlock_unlock(&pool->lock);
+        }
+        assertf(atomic_load_relaxed(&pool->elem_size) == elem_size, "%s: pool was used with another type", __func__);
+
+        uint32_t count = 0;
+        PoolItem *items = concurrent_pool__pop_batch(pool, &count);
+        if (!items) items = concurrent_pool__carve(pool, &count);
+        m->items = items;
+        m->count = count;
+    }
+
+    PoolItem *item = m->items;
+    m->items = item->next;
+    m->count--;
+    item->next = (PoolItem *)POOL_ALLOC_ACTIVE;
+    mem_clear_array(item->data, elem_size);
+    return item->data;
+}
+
+static void concurrent_pool__dealloc(ConcurrentPool *pool, void *elem) {
+    if (elem == NULL) return;
+
+    PoolItem *item = pool__item(elem);
+    assertf((uintptr_t)item->next == POOL_ALLOC_ACTIVE, "%s: double free", __func__);
+    PoolMagazine *m = concurrent_pool__magazine(pool);
+    item->next = m->items;
+    m->items = item;
+    m->count++;
+    if (m->count >= POOL_MAGAZINE_SIZE) {
+        concurrent_pool__flush(m, POOL_MAGAZINE_BATCH);
+    }
+}
+
+static void concurrent_pool_flush_thread_cache() {
+    for (size_t i = 0; i < POOL_MAGAZINE_COUNT; i++) {
+        concurrent_pool__flush_magazine(&MIGI_POOL_MAGAZINES.magazines[i]);
+    }
+}
+
+static void concurrent_pool__free(ConcurrentPool *pool) {
+    // the items of this pool in the magazine don't need to be returned anymore
+    for (size_t i = 0; i < POOL_MAGAZINE_COUNT; i++) {
+        if (MIGI_POOL_MAGAZINES.magazines[i].pool == pool) mem_clear(&MIGI_POOL_MAGAZINES.magazines[i]);
+    }
+    if (pool->owns_arena) arena_free(pool->arena);
+    mem_clear(pool);
+}
 
 #endif // MIGI_POOL_ALLOC_H
@@ -38,6 +38,13 @@ typedef struct {
 #define cmd_push_many(cmd, ...) \
     cmd__push_many((cmd), str_span( __VA_ARGS__ ))
 
+// Passes a file arena (eg. from arena_init_shared_memory) to the command, by pushing the
+// file descriptor which it inherits as an argument, to be passed to arena_open_shared
+// NOTE: only available with ARENA_HAS_FILES
+#ifdef ARENA_HAS_FILES
+static void cmd_push_arena(Cmd *cmd, Arena *arena);
+#endif
+
 
 typedef struct {
     // TODO: implement these
@@ -81,6 +88,17 @@ static void cmd__push_many(Cmd *cmd, StrSpan args) {
     }
 }
 
+#ifdef ARENA_HAS_FILES
+static void cmd_push_arena(Cmd *cmd, Arena *arena) {
+    assertf(arena->type == Arena_File, "%s: only file arenas can be passed to other processes", __func__);
+    if (!cmd->arena) {
+        cmd->owns_arena = true;
+        cmd->arena = arena_init();
+    }
+    strlist_push(cmd->arena, &cmd->args, strf(cmd->arena, "%d", arena->file));
+}
+#endif
+
 #if OS_WINDOWS
 
 // Taken and adapted from: https://github.com/tsoding/nob.h/
@@ -0,0 +1,178 @@
+#ifndef MIGI_SLOTMAP_H
+#define MIGI_SLOTMAP_H
+
+// Storage for objects which are referred to by handles, which (unlike the pointers from
+// pool_alloc) can still be checked after the object was removed
+//
+// A handle is the index of a slot and a generation. The generation of the slot is bumped
+// every time its value is removed, so the handles of earlier values stop matching it, and
+// checking a handle is a single lookup in the slots array and a comparison.
+// The values themselves are stored densely in a separate array (removed values are replaced
+// by the last one, like hashmap_del), so that iterating over all of them is a linear scan.
+// Each slot holds the index of its value, and another array holds the slot of each value,
+// so that the slot of the value moved by a removal can be updated.
+//
+// NOTE: pointers to the values are invalidated by any insertion or removal, keep the handles instead
+
+#include "migi_core.h"
+#include "migi_math.h"
+#include "arena.h"
+
+#ifndef SLOTMAP_INIT_CAP
+    #define SLOTMAP_INIT_CAP 32
+#endif
+
+// Since a generation is never 0, a zero-initialized handle never refers to anything
+typedef struct {
+    uint32_t index;
+    uint32_t generation;
+} SlotHandle;
+static_assert(sizeof(SlotHandle) == 8, "slot handles must be 64 bits");
+
+typedef struct {
+    uint32_t generation;    // of the current value, or the next one if the slot is free
+    uint32_t value_index;   // index of the value, or the next free slot if the slot is free
+} SlotMapSlot;
+
+#define SLOTMAP__NO_SLOT UINT32_MAX
+
+// `slots` has a slot for the most values there ever were at once, the rest are only as large as `length`
+#define SLOTMAP__HEADER          \
+    SlotMapSlot *slots;          \
+    uint32_t *value_slots;       \
+    uint32_t length;             \
+    uint32_t slot_count;         \
+    uint32_t capacity;           \
+    uint32_t free_slot;          \
+    SlotHandle _temp_handle;
+
+typedef struct {
+    SLOTMAP__HEADER
+} SlotMapHeader;
+
+#define SlotMap(T)          \
+    union {                 \
+        SlotMapHeader _h;   \
+        struct {            \
+            SLOTMAP__HEADER \
+            T *values;      \
+        };                  \
+    }
+
+// Insert a value, and get a handle for it
+#define slotmap_insert(arena, slotmap, v)                                                   \
+    ((slotmap)->values = slotmap__insert((arena), &(slotmap)->_h, (slotmap)->values,          \
+                                         sizeof(*(slotmap)->values), align_of(type_of(*(slotmap)->values))), \
+    (slotmap)->values[(slotmap)->length - 1] = (v),                                         \
+    (slotmap)->_temp_handle)
+
+// Get a pointer to the value for a handle
+// Returns NULL if the value was removed
+#define slotmap_at(slotmap, handle) \
+    ((type_of((slotmap)->values))slotmap__at(&(slotmap)->_h, (slotmap)->values, sizeof(*(slotmap)->values), (handle)))
+
+#define slotmap_contains(slotmap, handle) slotmap__contains(&(slotmap)->_h, (handle))
+
+// Remove the value for a handle, moving the last value into its place
+// Returns false if it was already removed
+#define slotmap_remove(slotmap, handle) \
+    slotmap__remove(&(slotmap)->_h, (slotmap)->values, sizeof(*(slotmap)->values), (handle))
+
+// Get the handle for a value (for example while iterating with slotmap_foreach)
+#define slotmap_handle(slotmap, v_ptr) \
+    slotmap__handle(&(slotmap)->_h, (size_t)((check_type(type_of(*(slotmap)->values), (v_ptr))) - (slotmap)->values))
+
+// Iterate over pointers to each value, in no particular order
+// NOTE: values must not be inserted or removed while iterating
+#define slotmap_foreach(slotmap, v_ptr)                         \
+    for (type_of((slotmap)->values) v_ptr = (slotmap)->values;  \
+         v_ptr < (slotmap)->values + (slotmap)->length;         \
+         v_ptr++)
+
+// Remove all the values, keeping the memory
+// The generations of all the slots are bumped, so none of the handles handed out so far match anymore
+#define slotmap_clear(slotmap) slotmap__clear(&(slotmap)->_h)
+
+// Clear slotmap state, doesn't free the values, since those are separately allocated on an arena
+#define slotmap_free(slotmap) (mem_clear((slotmap)))
+
+
+static void *slotmap__grow(Arena *a, SlotMapHeader *h, void *values, size_t elem_size, size_t elem_align) {
+    uint32_t old_capacity = h->capacity;
+    uint64_t capacity = old_capacity? (uint64_t)old_capacity * 2: SLOTMAP_INIT_CAP;
+    avow(capacity < SLOTMAP__NO_SLOT, "%s: capacity of %llu is too large", __func__, (unsigned long long)capacity);
+    h->capacity = (uint32_t)capacity;
+
+    h->slots = arena_realloc(a, SlotMapSlot, h->slots, old_capacity, h->capacity);
+    h->value_slots = arena_realloc(a, uint32_t, h->value_slots, old_capacity, h->capacity);
+    return arena_realloc_bytes(a, values, elem_size*old_capacity, elem_size*h->capacity, elem_align);
+}
+
+static void *slotmap__insert(Arena *a, SlotMapHeader *h, void *values, size_t elem_size, size_t elem_align) {
+    if (h->capacity == 0) h->free_slot = SLOTMAP__NO_SLOT;
+    if (h->length == h->capacity) values = slotmap__grow(a, h, values, elem_size, elem_align);
+
+    uint32_t index = h->free_slot;
+    if (index != SLOTMAP__NO_SLOT) {
+        h->free_slot = h->slots[index].value_index;
+    } else {
+        // every slot is taken, since there are as many as there are values
+        index = h->slot_count++;
+        h->slots[index].generation = 1;
+    }
+    h->slots[index].value_index = h->length;
+    h->value_slots[h->length] = index;
+    h->length++;
+    h->_temp_handle = (SlotHandle){ .index = index, .generation = h->slots[index].generation };
+    return values;
+}
+
+static bool slotmap__contains(SlotMapHeader *h, SlotHandle handle) {
+    return handle.index < h->slot_count && h->slots[handle.index].generation == handle.generation;
+}
+
+static void *slotmap__at(SlotMapHeader *h, void *values, size_t elem_size, SlotHandle handle) {
+    if (!slotmap__contains(h, handle)) return NULL;
+    return (byte *)values + (size_t)h->slots[handle.index].value_index*elem_size;
+}
+
+static bool slotmap__remove(SlotMapHeader *h, void *values, size_t elem_size, SlotHandle handle) {
+    if (!slotmap__contains(h, handle)) return false;
+
+    SlotMapSlot *slot = &h->slots[handle.index];
+    uint32_t last = h->length - 1;
+    if (slot->value_index != last) {
+        memcpy((byte *)values + (size_t)slot->value_index*elem_size, (byte *)values + (size_t)last*elem_size, elem_size);
+        uint32_t moved_slot = h->value_slots[last];
+        h->slots[moved_slot].value_index = slot->value_index;
+        h->value_slots[slot->value_index] = moved_slot;
+    }
+    h->length--;
+
+    // 0 is skipped when the generation wraps around, so that zeroed handles stay invalid
+    slot->generation++;
+    if (slot->generation == 0) slot->generation = 1;
+    slot->value_index = h->free_slot;
+    h->free_slot = handle.index;
+    return true;
+}
+
+static SlotHandle slotmap__handle(SlotMapHeader *h, size_t value_index) {
+    assertf(value_index < h->length, "%s: not a value of the slotmap", __func__);
+    uint32_t index = h->value_slots[value_index];
+    return (SlotHandle){ .index = index, .generation = h->slots[index].generation };
+}
+
+static void slotmap__clear(SlotMapHeader *h) {
+    for (uint32_t i = 0; i < h->length; i++) {
+        SlotMapSlot *slot = &h->slots[h->value_slots[i]];
+        slot->generation++;
+        if (slot->generation == 0) slot->generation = 1;
+        slot->value_index = h->free_slot;
+        h->free_slot = h->value_slots[i];
+    }
+    h->length = 0;
+}
+
+
+#endif // MIGI_SLOTMAP_H
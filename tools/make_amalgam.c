@@ -30,12 +30,15 @@ int main(int argc, char **argv) {
         { .name=S("src/timing.h"),           },
         { .name=S("src/profiler.h"),         },
         { .name=S("src/migi_memory.h"),      },
+        { .name=S("src/migi_thread.h"),      },
         { .name=S("src/arena.h"),            },
+        { .name=S("src/hash.h"),             },
         { .name=S("src/migi_string.h"),      },
         { .name=S("src/string_builder.h"),   },
         { .name=S("src/migi_list.h"),        },
         { .name=S("src/hashmap.h"),          },
         { .name=S("src/file.h"),             },
+        { .name=S("src/intern.h"),           },
         { .name=S("src/cli_parse.h"),        },
         { .name=S("src/random.h"),          .include_macro=S("MIGI_INCLUDE_RANDOM")     },
         { .name=S("src/filepath.h"),        .include_macro=S("MIGI_INCLUDE_FILESYSTEM") },